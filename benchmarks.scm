@@ -0,0 +1,108 @@
+; vim:lisp:et:ai
+
+; Benchmarks for the JIT compiler, the number types and the f64vector kernels
+; of bootstrap.cpp. Every benchmark is run twice, once in the interpreter and
+; once with the JIT compiler enabled, or once with the plain and once with the
+; SIMD kernels. Run with: minscm -i init.img benchmarks.scm
+
+(define (fib n)
+  (if (fix< n 2)
+      n
+      (fix+ (fib (fix- n 1)) (fib (fix- n 2)))))
+
+(define (generic-fib n)
+  (if (< n 2)
+      n
+      (+ (generic-fib (- n 1)) (generic-fib (- n 2)))))
+
+(define (tak x y z)
+  (if (fix< y x)
+      (tak (tak (fix- x 1) y z)
+           (tak (fix- y 1) z x)
+           (tak (fix- z 1) x y))
+      z))
+
+(define (make-numbers n acc)
+  (if (fix= n 0)
+      acc
+      (make-numbers (fix- n 1) (cons n acc))))
+
+(define (list-sum lst acc)
+  (if (eq? lst '())
+      acc
+      (list-sum (cdr lst) (fix+ acc (car lst)))))
+
+(define (sum-lists n acc)
+  (if (fix= n 0)
+      acc
+      (sum-lists (fix- n 1) (fix+ acc (list-sum (make-numbers 1000 '()) 0)))))
+
+(define (factorial n acc)
+  (if (= n 0)
+      acc
+      (factorial (- n 1) (* n acc))))
+
+(define (big-fib n a b)
+  (if (= n 0)
+      a
+      (big-fib (- n 1) b (+ a b))))
+
+(define (fraction-sum n acc)
+  (if (= n 0)
+      acc
+      (fraction-sum (- n 1) (+ (- acc (/ 1 (+ 2 (remainder n 5)))) (/ n 6)))))
+
+; Bignum results are too long to display, so the bignum benchmarks count the
+; digits instead, which includes the conversion to decimal
+(define (digits n)
+  (string-length (number->string n)))
+
+(define (repeat n thunk)
+  (if (fix= n 1)
+      (thunk)
+      (begin
+        (thunk)
+        (repeat (fix- n 1) thunk))))
+
+(define v1 (make-f64vector 1000000 1.5))
+(define v2 (make-f64vector 1000000 0.25))
+
+; Runs thunk with (switch #f) and (switch #t)
+(define (compare name switch off-label on-label thunk)
+  (define (run on)
+    (switch on)
+    (let* ((start (sys:runtime))
+           (result (thunk))
+           (time (fix- (sys:runtime) start)))
+      (display "  ")
+      (display (if on on-label off-label))
+      (display (quotient time 1000))
+      (display " ms, result ")
+      (display result)
+      (newline)))
+  (display name)
+  (newline)
+  (run #f)
+  (run #t))
+
+(define (benchmark name thunk)
+  (compare name sys:set-jit! "interpreter: " "jit:         " thunk))
+
+(define (simd-benchmark name thunk)
+  (compare name sys:set-simd! "plain:       " "simd:        " thunk))
+
+(benchmark "fib 30" (lambda () (fib 30)))
+(benchmark "fib 30, generic arithmetic" (lambda () (generic-fib 30)))
+(benchmark "tak 24 16 8" (lambda () (tak 24 16 8)))
+(benchmark "list sum 1000 x 1000" (lambda () (sum-lists 1000 0)))
+(benchmark "sum of 2 x 200000 fractions" (lambda () (fraction-sum 200000 0)))
+(benchmark "digits of 5000!" (lambda () (digits (factorial 5000 1))))
+(benchmark "digits of fib 50000" (lambda () (digits (big-fib 50000 0 1))))
+(benchmark "write 20000 numbers to a string"
+           (lambda () (string-length (object->string (make-numbers 20000 '()) #t))))
+(simd-benchmark "f64vector-dot 1000000 x 100"
+                (lambda () (repeat 100 (lambda () (f64vector-dot v1 v2)))))
+(simd-benchmark "f64vector-sum 1000000 x 100"
+                (lambda () (repeat 100 (lambda () (f64vector-sum v1)))))
+(simd-benchmark "f64vector-map * 1000000 x 100"
+                (lambda () (repeat 100 (lambda () (f64vector-sum (f64vector-map * v1 v2))))))
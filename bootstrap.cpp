@@ -19,6 +19,12 @@
 // ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 // OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <fstream>
 #include <iostream>
 #include <map>
@@ -27,53 +33,381 @@
 #include <string>
 #include <vector>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 #define GC_FREQUENCY 100000
+#define GC_STEP_FREQUENCY 1000
+#define GC_MAX_PAUSE_MICROSECONDS 1000
+#define GC_PAUSE_HISTOGRAM_SIZE 6
+#define GC_PAYLOAD_BYTES 64
+#define JIT_CALL_THRESHOLD 1000
+#define JIT_MAX_DEOPTIMIZATIONS 100
+#define VALUE_STACK_SIZE 1048576
+#define C_STACK_RESERVE 262144
+#define SLAB_SIZE 65536
+#define SIZE_CLASS_GRANULARITY 16
+#define SIZE_CLASSES 16
+#define PORT_BUFFER_SIZE 262144
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void flushStandardOutput();
+#define error(msg) do { flushStandardOutput(); cout << msg << endl; throw 0; } while(0)
+
+enum ObjectType { otFixnum, otFlonum, otSymbol, otPair, otString, otBoolean, otChar, otNull, otProcedure, otVector, otEof, otEnvironment, otTag,
+                 otLocalReference, otNode, otCode, otBignum,
+                 otFraction, otF64Vector, otS32Vector, otU8Vector, otStringPort, otFilePort };
+#define OBJECT_TYPES (otFilePort + 1)
 
 //----------------------------------------------------------------------------------------------------------------------
 
-#define error(msg) do { cout << msg << endl; throw 0; } while(0)
+// All objects are allocated from SLAB_SIZE aligned slabs, each holding objects of a single size class. A free slot has
+// its first word (the vtable pointer of a live object) set to NULL and links to the next free slot of its size class
+// through its second word, so the garbage collector can walk the slabs without any per-object bookkeeping.
+struct Slab
+{
+    Slab *next;
+    size_t objectSize;
+    size_t objectCount;
+    char *firstSlot() { return (char*)this + SIZE_CLASS_GRANULARITY * ((sizeof(Slab) - 1) / SIZE_CLASS_GRANULARITY + 1); }
+};
+
+Slab *slabs[SIZE_CLASSES];
+void **freeSlots[SIZE_CLASSES];
+
+void addSlab(size_t sizeClass)
+{
+    void *memory;
+    if (posix_memalign(&memory, SLAB_SIZE, SLAB_SIZE) != 0) error("Out of memory");
+    memset(memory, 0, SLAB_SIZE);
+
+    Slab *slab = (Slab*) memory;
+    slab->next = slabs[sizeClass];
+    slab->objectSize = (sizeClass + 1) * SIZE_CLASS_GRANULARITY;
+    slab->objectCount = (SLAB_SIZE - (slab->firstSlot() - (char*)slab)) / slab->objectSize;
+    slabs[sizeClass] = slab;
+
+    for (long i = slab->objectCount - 1; i >= 0; --i)
+    {
+        void **slot = (void**) (slab->firstSlot() + i * slab->objectSize);
+        slot[1] = freeSlots[sizeClass];
+        freeSlots[sizeClass] = slot;
+    }
+}
+
+void *slabAllocate(size_t size)
+{
+    size_t sizeClass = (size - 1) / SIZE_CLASS_GRANULARITY;
+    if (sizeClass >= SIZE_CLASSES) error("Internal error: Object too large for slab allocation");
+    if (freeSlots[sizeClass] == NULL) addSlab(sizeClass);
+    void **slot = freeSlots[sizeClass];
+    freeSlots[sizeClass] = (void**) slot[1];
+    return slot;
+}
+
+void slabFree(void *p)
+{
+    Slab *slab = (Slab*) ((size_t)p & ~(size_t)(SLAB_SIZE - 1));
+    size_t sizeClass = slab->objectSize / SIZE_CLASS_GRANULARITY - 1;
+    void **slot = (void**) p;
+    slot[0] = NULL;
+    slot[1] = freeSlots[sizeClass];
+    freeSlots[sizeClass] = slot;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
 
-enum ObjectType { otFixnum, otFlonum, otSymbol, otPair, otString, otBoolean, otChar, otNull, otProcedure, otVector, otEof, otEnvironment, otTag };
+// The garbage collector runs incrementally, interleaved with the interpreter: A cycle marks the live objects in small
+// steps (tri-color marking, with the grey objects kept on the stack objectsToMark), then sweeps the slabs in small steps. Each
+// step ends once gcMaxPauseMicroseconds have passed.
+//
+// An object is black or grey if its gcMarked flag equals gcMarkColor, otherwise it is white. Flipping gcMarkColor at
+// the start of a cycle turns all objects white at once, so the survivors of the sweep need no reset. New objects are
+// black, so their constructors must pass the references they store through gcWriteBarrier.
+enum GcPhase { gcIdle, gcMarking, gcSweeping };
 
 class Object;
 
 bool needToRunGC;
 long objectsAllocatedSinceLastGc;
-set<Object*> heap;
-set<Object*> objectsToMark;
+long objectsAllocatedSinceLastGcStep;
+long gcMaxPauseMicroseconds = GC_MAX_PAUSE_MICROSECONDS;
+GcPhase gcPhase = gcIdle;
+bool gcMarkColor;
+vector<Object*> objectsToMark;
+ostream *gcLog = &cerr;
+
+// Pauses are counted in the histogram bucket of their order of magnitude: < 10us, < 100us, ..., >= 100ms
+struct GcStatistics
+{
+    long cycles;
+    long steps;
+    long totalPauseMicroseconds;
+    long maxPauseMicroseconds;
+    long pauseHistogram[GC_PAUSE_HISTOGRAM_SIZE];
+    long objectsAllocated[OBJECT_TYPES];
+    long bytesAllocated[OBJECT_TYPES];
+    long liveObjects;
+    long liveBytes;
+    long freedObjects;
+};
+
+GcStatistics gcStats;
+
+// Objects that own a large buffer, like homogeneous vectors, count as one allocation per GC_PAYLOAD_BYTES bytes of it
+// in addition, so that allocating them drives the garbage collector as well
+inline void gcCountAllocations(long count)
+{
+    objectsAllocatedSinceLastGc += count;
+    objectsAllocatedSinceLastGcStep += count;
+    if (gcPhase == gcIdle ? objectsAllocatedSinceLastGc >= GC_FREQUENCY : objectsAllocatedSinceLastGcStep >= GC_STEP_FREQUENCY)
+        needToRunGC = true;
+}
 
 class Object
 {
 public:
-    Object() { heap.insert(this); ++objectsAllocatedSinceLastGc; if (objectsAllocatedSinceLastGc >= GC_FREQUENCY) needToRunGC = true; }
-    virtual ~Object() { heap.erase(this); }
+    Object(ObjectType type, size_t size): gcMarked(gcMarkColor)
+    {
+        ++gcStats.objectsAllocated[type];
+        gcStats.bytesAllocated[type] += (size - 1) / SIZE_CLASS_GRANULARITY * SIZE_CLASS_GRANULARITY + SIZE_CLASS_GRANULARITY;
+        gcCountAllocations(1);
+    }
+    Object(): gcMarked(gcMarkColor) { } // For objects on the C++ stack, which are neither counted nor collected
+    virtual ~Object() { }
+    static void *operator new(size_t size) { return slabAllocate(size); }
+    static void operator delete(void *p) { slabFree(p); }
     virtual ObjectType getType() const = 0;
     virtual string toString() const = 0;
-    virtual void getReferences(set<Object*> *dest) const = 0;
+    virtual void getReferences(vector<Object*> *dest) const = 0;
     virtual bool gcIgnore() { return false; }
-    void gcInit() { gcMarked = false; gcHandled = false; }
-    void gcMark() { if (!gcMarked) getReferences(&objectsToMark); gcMarked = true; }
+    void gcMark() { if (gcMarked != gcMarkColor) getReferences(&objectsToMark); gcMarked = gcMarkColor; }
     bool gcMarked;
-    bool gcHandled;
 };
 
+//----------------------------------------------------------------------------------------------------------------------
+
+// Fixnums, chars, booleans, the empty list and the EOF object are not allocated at all, but encoded in the object
+// reference itself. Heap objects are at least 8 byte aligned, so the lowest bits of a reference tell the kinds apart:
+// ...1 is a fixnum, ..10 another immediate with its type in the next two bits, ..00 a pointer to a heap object.
+#define FIXNUM_TAG 1
+#define FIXNUM_MAX ((1L << 62) - 1)
+#define FIXNUM_MIN (-(1L << 62))
+#define IMMEDIATE_TAG 2
+#define IMMEDIATE_CHAR (0 << 2 | IMMEDIATE_TAG)
+#define IMMEDIATE_BOOLEAN (1 << 2 | IMMEDIATE_TAG)
+#define IMMEDIATE_NULL (2 << 2 | IMMEDIATE_TAG)
+#define IMMEDIATE_EOF (3 << 2 | IMMEDIATE_TAG)
+
+inline bool isHeapObject(const Object *o) { return ((size_t)o & 3) == 0; }
+inline bool isFixnum(const Object *o) { return ((size_t)o & FIXNUM_TAG) != 0; }
+
+inline ObjectType getType(const Object *o)
+{
+    if (isHeapObject(o)) return o->getType();
+    if (isFixnum(o)) return otFixnum;
+    switch ((size_t)o & 15)
+    {
+    case IMMEDIATE_CHAR: return otChar;
+    case IMMEDIATE_BOOLEAN: return otBoolean;
+    case IMMEDIATE_NULL: return otNull;
+    default: return otEof;
+    }
+}
+
+string toString(const Object *o);
+
+// Must be called whenever a reference to value is stored into an existing object, so that a black object never
+// references a white one. The value is marked right away, so storing it again does not grow objectsToMark.
+inline void gcWriteBarrier(Object *value)
+{
+    if (gcPhase == gcMarking && value != NULL && isHeapObject(value) && value->gcMarked != gcMarkColor)
+        value->gcMark();
+}
+
 void assertType(const char *procedure, const Object *o, ObjectType expectedType)
 {
-    if (o->getType() != expectedType)
+    if (getType(o) != expectedType)
         error((string)procedure + ": Invalid argument type");
 }
 
-void gc()
+//----------------------------------------------------------------------------------------------------------------------
+
+// Object references held in C++ variables (e.g. the locals of evalExpandedForm) are invisible to the garbage collector,
+// so every stack frame that keeps objects alive across a possible collection registers them here for its lifetime.
+vector<Object**> gcRootStack;
+vector<const vector<Object*>*> gcParameterStack;
+
+class GcRoot
+{
+public:
+    GcRoot(Object **root) { gcRootStack.push_back(root); }
+    ~GcRoot() { gcRootStack.pop_back(); }
+};
+
+class GcParameterRoot
+{
+public:
+    GcParameterRoot(const vector<Object*> *parameters) { gcParameterStack.push_back(parameters); }
+    ~GcParameterRoot() { gcParameterStack.pop_back(); }
+};
+
+// Procedure arguments are passed on the value stack: The caller pushes them, and the procedure is called with a
+// pointer to the first one. The caller pops them again, except for calls of lambdas, see callLambda.
+Object *valueStack[VALUE_STACK_SIZE];
+size_t valueStackTop;
+
+inline void pushValue(Object *o)
+{
+    if (valueStackTop == VALUE_STACK_SIZE) error("Stack overflow");
+    valueStack[valueStackTop++] = o;
+}
+
+// Every non-tail call nests execute and callLambda on the C++ stack, which usually runs out long before the value
+// stack does. Calls check against this limit, C_STACK_RESERVE bytes above the end of the C++ stack, instead.
+char *cStackLimit;
+
+void initCStackLimit(char *stackTop)
+{
+    struct rlimit limit;
+    size_t size = 8 * 1024 * 1024;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) size = limit.rlim_cur;
+    cStackLimit = size > 2 * C_STACK_RESERVE ? stackTop - size + C_STACK_RESERVE : stackTop - size / 2;
+}
+
+inline void checkCStack()
+{
+    char marker;
+    if (&marker < cStackLimit) error("Stack overflow");
+}
+
+// The objects referenced by the interpreter itself. They are only collected when a cycle starts and when marking ends,
+// not on every step.
+class GcRoots
+{
+public:
+    virtual ~GcRoots() { }
+    virtual void getRoots(vector<Object*> *dest) const = 0;
+};
+
+void gcMarkRoots(const GcRoots *roots)
+{
+    roots->getRoots(&objectsToMark);
+    for (vector<Object**>::const_iterator i = gcRootStack.begin(); i != gcRootStack.end(); ++i)
+        objectsToMark.push_back(**i);
+    for (vector<const vector<Object*>*>::const_iterator i = gcParameterStack.begin(); i != gcParameterStack.end(); ++i)
+        objectsToMark.insert(objectsToMark.end(), (*i)->begin(), (*i)->end());
+    objectsToMark.insert(objectsToMark.end(), valueStack, valueStack + valueStackTop);
+}
+
+bool gcMarkStep(long *work)
+{
+    while (!objectsToMark.empty() && *work > 0)
+    {
+        Object *o = objectsToMark.back();
+        objectsToMark.pop_back();
+        if (o != NULL && isHeapObject(o)) { o->gcMark(); --*work; }
+    }
+    return objectsToMark.empty();
+}
+
+size_t sweepSizeClass;
+Slab *sweepSlab;
+size_t sweepIndex;
+long sweepLiveObjects;
+long sweepLiveBytes;
+long sweepFreedObjects;
+
+bool gcSweepStep(long *work)
+{
+    for (; sweepSizeClass < SIZE_CLASSES; ++sweepSizeClass, sweepSlab = NULL)
+    {
+        if (sweepSlab == NULL) { sweepSlab = slabs[sweepSizeClass]; sweepIndex = 0; }
+        for (; sweepSlab != NULL; sweepSlab = sweepSlab->next, sweepIndex = 0)
+            for (; sweepIndex < sweepSlab->objectCount; ++sweepIndex)
+            {
+                if (--*work < 0) return false;
+                Object *o = (Object*) (sweepSlab->firstSlot() + sweepIndex * sweepSlab->objectSize);
+                if (*(void**)o == NULL) continue; // Free slot
+                if (o->gcMarked != gcMarkColor && !o->gcIgnore())
+                {
+                    delete o;
+                    ++sweepFreedObjects;
+                }
+                else
+                {
+                    ++sweepLiveObjects;
+                    sweepLiveBytes += sweepSlab->objectSize;
+                }
+            }
+    }
+    return true;
+}
+
+// Performs one step of the current collection cycle, starting a new one if none is running. The roots are the objects
+// referenced by the interpreter itself; the objects registered in the root stacks are added to them.
+void gc(const GcRoots *roots)
 {
-        cout << "Garbage collection..." << flush;
-        needToRunGC = false;
+    clock_t start = clock();
+    needToRunGC = false;
+    objectsAllocatedSinceLastGcStep = 0;
+
+    if (gcPhase == gcIdle)
+    {
+        gcPhase = gcMarking;
+        gcMarkColor = !gcMarkColor;
         objectsAllocatedSinceLastGc = 0;
-        // TODO: Mark all reachable objects
-        // TODO: Transfer all objects that were not marked into a "delete" list
-        // TODO: Delete everything from that list
-        cout << " Done." << endl;
+        gcMarkRoots(roots);
+    }
+
+    // Checking the clock is expensive, so work is done in chunks between checks. The first chunk is done in any case,
+    // making sure that marking and sweeping keep up with allocation even if the pause budget is tiny.
+    clock_t deadline = start + (clock_t) ((double)gcMaxPauseMicroseconds * CLOCKS_PER_SEC / 1000000);
+    do
+    {
+        long work = GC_STEP_FREQUENCY;
+        if (gcPhase == gcMarking && gcMarkStep(&work))
+        {
+            // The root stacks are not covered by the write barrier: Rescan them and finish marking in one go
+            gcMarkRoots(roots);
+            while (!gcMarkStep(&work)) work = GC_STEP_FREQUENCY;
+            gcPhase = gcSweeping;
+            sweepSizeClass = 0;
+            sweepSlab = NULL;
+            sweepLiveObjects = sweepLiveBytes = sweepFreedObjects = 0;
+            work = GC_STEP_FREQUENCY;
+        }
+        if (gcPhase == gcSweeping && gcSweepStep(&work))
+        {
+            gcPhase = gcIdle;
+            ++gcStats.cycles;
+            gcStats.liveObjects = sweepLiveObjects;
+            gcStats.liveBytes = sweepLiveBytes;
+            gcStats.freedObjects = sweepFreedObjects;
+            if (gcLog != NULL) *gcLog << "Garbage collection... Done." << endl;
+            break;
+        }
+    }
+    while (clock() < deadline);
+
+    long pause = (long) ((double)(clock() - start) * 1000000 / CLOCKS_PER_SEC);
+    int bucket = 0;
+    for (long limit = 10; pause >= limit && bucket < GC_PAUSE_HISTOGRAM_SIZE - 1; limit *= 10) ++bucket;
+    ++gcStats.steps;
+    ++gcStats.pauseHistogram[bucket];
+    gcStats.totalPauseMicroseconds += pause;
+    if (pause > gcStats.maxPauseMicroseconds) gcStats.maxPauseMicroseconds = pause;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -81,13 +415,16 @@ void gc()
 class Tag: public Object
 {
 public:
-    Tag(Object *value): _value(value) { }
+    Tag(Object *value): Object(otTag, sizeof(Tag)), _value(value) { gcWriteBarrier(value); }
     Object *getValue() { return _value; }
     ObjectType getType() const { return otTag; }
-    string toString() const { return "<tag " + _value->toString() + ">"; }
-    void getReferences(set<Object*> *dest) const { dest->insert(_value); }
+    string toString() const { return "<tag " + ::toString(_value) + ">"; }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_value); }
 
 private:
+    friend class ImageReader;
+    friend class ImageWriter;
+
     Object *_value;
 };
 
@@ -98,21 +435,21 @@ class Pair: public Object
 public:
     Object *_car;
     Object *_cdr;
-    Pair(Object *car, Object *cdr): _car(car), _cdr(cdr) { }
+    Pair(Object *car, Object *cdr): Object(otPair, sizeof(Pair)), _car(car), _cdr(cdr) { gcWriteBarrier(car); gcWriteBarrier(cdr); }
     ObjectType getType() const { return otPair; }
-    void getReferences(set<Object*> *dest) const { dest->insert(_car); dest->insert(_cdr); }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_car); dest->push_back(_cdr); }
     
     string toString() const
     {
         stringstream sb;
         sb << '(';
         Object *i=(Object*) this;
-        while (i->getType() == otPair)
+        while (::getType(i) == otPair)
         {
-            sb << ((Pair*)i)->_car->toString() << " ";
+            sb << ::toString(((Pair*)i)->_car) << " ";
             i = ((Pair*)i)->_cdr;
         }
-        if (i->getType() == otNull)
+        if (::getType(i) == otNull)
         {
             string ret = sb.str();
             ret[ret.length()-1] = ')';
@@ -120,7 +457,7 @@ public:
         }
         else
         {
-            sb << ". " << i->toString() << ")";
+            sb << ". " << ::toString(i) << ")";
             return sb.str();
         }
     }
@@ -128,111 +465,27 @@ public:
     bool isDottedList()
     {
         Object *i = this;
-        while (i->getType() == otPair) i = ((Pair*)i)->_cdr;
-        return i->getType() != otNull;
+        while (::getType(i) == otPair) i = ((Pair*)i)->_cdr;
+        return ::getType(i) != otNull;
     }
 };
 
 //----------------------------------------------------------------------------------------------------------------------
 
-class Null: public Object
-{
-public:
-    ObjectType getType() const { return otNull; }
-    string toString() const { return "()"; }
-    static const Null *getInstance() { return _instance; }
-    void getReferences(set<Object*> *dest) const { }
-    bool gcIgnore() { return true; }
-
-private:
-    Null() { }
-    static const Null *_instance;
-};
-
-const Null *Null::_instance = new Null();
-
-//----------------------------------------------------------------------------------------------------------------------
-
-class Environment: public Object
+class Null
 {
 public:
-    Environment(): _outer(NULL) { }
-    Environment(Environment *outer): _outer(outer) { }
-    ObjectType getType() const { return otEnvironment; }
-    string toString() const { return "<Environment>"; }
-    void getReferences(set<Object*> *dest) const
-    {
-        for (map<string, Object*>::const_iterator i = _data.begin(); i != _data.end(); ++i)
-            dest->insert((Object*)i->second);
-    }
-
-    void define(const string& identifier, Object *value)
-    {
-        if (identifier == "if" || identifier == "define" ||identifier == "defmacro" ||identifier == "set!" || identifier == "lambda" ||identifier == "quote" ||identifier == "begin")
-            error("Symbol '" + identifier + "' is constant and must not be changed");
-        else
-            _data[identifier] = value;
-    }
-
-    void set(const string& identifier, Object *value)
-    {
-        if (_data.count(identifier)) _data[identifier] = value;
-        else if (_outer != NULL) _outer->set(identifier, value);
-        else error("Unknown variable '" + identifier + "'");
-    }
-
-    Object* get(const string& identifier)
-    {
-        if (_data.count(identifier)) return _data[identifier];
-        else if (_outer != NULL) return _outer->get(identifier);
-        else error("Unknown variable '" + identifier + "'");
-        return NULL; // Just to keep the compiler happy
-    }
-
-    Environment* extendIntoNew(const vector<string> *argumentNames, const vector<Object*> *arguments, bool hasRestParameter)
-    {
-        Environment *ret = new Environment(this);
-
-        if (hasRestParameter)
-        {
-            if (arguments->size() < argumentNames->size() - 1) error("Invalid parameter count");
-            for (size_t i = 0; i < argumentNames->size() - 1; ++i) ret->define(argumentNames->at(i), arguments->at(i));
-            Object *o = (Object*) Null::getInstance();
-            for (long i = arguments->size()-1; i >= (long)argumentNames->size() - 1; --i) o = new Pair(arguments->at(i), o);
-            ret->define(argumentNames->back(), o);
-        }
-        else
-        {
-            if (arguments->size() != argumentNames->size()) error("Invalid parameter count");
-            for (size_t i = 0; i < argumentNames->size(); ++i) ret->define(argumentNames->at(i), arguments->at(i));
-        }
-        return ret;
-    }
-
-private:
-    map<string, Object*> _data;
-    Environment *_outer;
+    static Object *getInstance() { return (Object*) IMMEDIATE_NULL; }
 };
 
 //----------------------------------------------------------------------------------------------------------------------
 
-class Fixnum: public Object
+// Fixnums are limited to 63 bits. fix+ and friends wrap around silently, the generic arithmetic promotes to bignums.
+class Fixnum
 {
 public:
-    Fixnum(long value): _value(value) { }
-    long getValue() const { return _value; }
-    ObjectType getType() const { return otFixnum; }
-    void getReferences(set<Object*> *dest) const { }
-    
-    string toString() const
-    {
-        stringstream ss;
-        ss << _value;
-        return ss.str();
-    }
-
-private:
-    const long _value;
+    static Object *valueOf(long value) { return (Object*) (((size_t)value << 1) | FIXNUM_TAG); }
+    static long getValue(const Object *o) { return (long)(size_t)o >> 1; }
 };
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -240,10 +493,10 @@ private:
 class Flonum: public Object
 {
 public:
-    Flonum(double value): _value(value) { }
+    Flonum(double value): Object(otFlonum, sizeof(Flonum)), _value(value) { }
     double getValue() const { return _value; }
     ObjectType getType() const { return otFlonum; }
-    void getReferences(set<Object*> *dest) const { }
+    void getReferences(vector<Object*> *dest) const { }
     
     string toString() const
     {
@@ -258,772 +511,4908 @@ private:
 
 //----------------------------------------------------------------------------------------------------------------------
 
-class Symbol: public Object
+// The magnitude of a bignum is a vector of 32 bit limbs, least significant first and without leading zero limbs, so
+// zero is the empty vector. The product of two limbs plus two more limbs still fits into an unsigned long.
+typedef vector<unsigned int> Limbs;
+#define LIMB_BITS 32
+#define LIMB_MAX 0xFFFFFFFFul
+#define KARATSUBA_THRESHOLD 32
+
+void trimLimbs(Limbs *a)
 {
-public:
-    ObjectType getType() const { return otSymbol; }
-    string toString() const { return _value; }
-    string getName() const { return _value; }
-    void getReferences(set<Object*> *dest) const { }
-    bool gcIgnore() { return true; }
-    
-    static Symbol *fromString(const string& value)
+    while (!a->empty() && a->back() == 0) a->pop_back();
+}
+
+void setLimbs(unsigned long value, Limbs *a)
+{
+    a->clear();
+    for (; value != 0; value >>= LIMB_BITS) a->push_back((unsigned int)value);
+}
+
+int compareLimbs(const Limbs& a, const Limbs& b)
+{
+    if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0;) if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+// Adds b, shifted left by the given number of limbs, to a
+void addLimbs(Limbs *a, const Limbs& b, size_t shift = 0)
+{
+    if (b.empty()) return;
+    if (a->size() < b.size() + shift) a->resize(b.size() + shift, 0);
+    unsigned long carry = 0;
+    size_t i;
+    for (i = 0; i < b.size(); ++i)
     {
-        if (!cache.count(value)) cache[value] = new Symbol(value);
-        return cache[value];
+        carry += (unsigned long)(*a)[i + shift] + b[i];
+        (*a)[i + shift] = (unsigned int)carry;
+        carry >>= LIMB_BITS;
     }
+    for (i += shift; carry != 0; ++i)
+    {
+        if (i == a->size()) a->push_back(0);
+        carry += (*a)[i];
+        (*a)[i] = (unsigned int)carry;
+        carry >>= LIMB_BITS;
+    }
+}
 
-private:
-    const string _value;
-    static map<string, Symbol*> cache;
-    Symbol(const string& value): _value(value) { }
-};
+// Subtracts b from a, which must not be less than b
+void subtractLimbs(Limbs *a, const Limbs& b)
+{
+    unsigned long borrow = 0;
+    for (size_t i = 0; i < a->size() && (i < b.size() || borrow != 0); ++i)
+    {
+        unsigned long subtrahend = (i < b.size() ? b[i] : 0) + borrow;
+        borrow = (*a)[i] < subtrahend ? 1 : 0;
+        (*a)[i] = (unsigned int)((*a)[i] - subtrahend);
+    }
+    trimLimbs(a);
+}
 
-map<string, Symbol*> Symbol::cache;
+void multiplyAddLimbs(Limbs *a, unsigned int factor, unsigned int addend)
+{
+    unsigned long carry = addend;
+    for (size_t i = 0; i < a->size(); ++i)
+    {
+        carry += (unsigned long)(*a)[i] * factor;
+        (*a)[i] = (unsigned int)carry;
+        carry >>= LIMB_BITS;
+    }
+    if (carry != 0) a->push_back((unsigned int)carry);
+}
 
-//----------------------------------------------------------------------------------------------------------------------
+// Divides a by a single limb in place and returns the remainder
+unsigned int divideLimbsBySmall(Limbs *a, unsigned int divisor)
+{
+    unsigned long remainder = 0;
+    for (size_t i = a->size(); i-- > 0;)
+    {
+        remainder = remainder << LIMB_BITS | (*a)[i];
+        (*a)[i] = (unsigned int)(remainder / divisor);
+        remainder %= divisor;
+    }
+    trimLimbs(a);
+    return (unsigned int)remainder;
+}
 
-class String: public Object
+void multiplyLimbsSchoolbook(const Limbs& a, const Limbs& b, Limbs *result)
 {
-public:
-    String(const vector<int>& value): _value(value) { }
-    String(const long size) { _value.resize(size, ' '); }
-    ObjectType getType() const { return otString; }
-    string toString() const { return getValue(); }
-    long getLength() const { return _value.size(); }
-    int GetAt(int index) const { return _value[index]; }
-    void SetAt(int index, int newChar) { _value[index] = newChar; }
-    void getReferences(set<Object*> *dest) const { }
+    result->assign(a.size() + b.size(), 0);
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        unsigned long carry = 0;
+        for (size_t j = 0; j < b.size(); ++j)
+        {
+            carry += (unsigned long)a[i] * b[j] + (*result)[i + j];
+            (*result)[i + j] = (unsigned int)carry;
+            carry >>= LIMB_BITS;
+        }
+        (*result)[i + b.size()] = (unsigned int)carry;
+    }
+    trimLimbs(result);
+}
 
-    string getValue() const
+void splitLimbs(const Limbs& a, size_t at, Limbs *low, Limbs *high)
+{
+    low->assign(a.begin(), a.begin() + min(at, a.size()));
+    trimLimbs(low);
+    high->assign(a.begin() + min(at, a.size()), a.end());
+}
+
+// Karatsuba's method splits both factors at half their length, a = a1 B + a0 and b = b1 B + b0, and gets along with
+// three half size products: a b = a1 b1 B^2 + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B + a0 b0
+void multiplyLimbs(const Limbs& a, const Limbs& b, Limbs *result)
+{
+    if (a.size() < KARATSUBA_THRESHOLD || b.size() < KARATSUBA_THRESHOLD)
     {
-        stringstream sb;
-        for (size_t i=0; i<_value.size(); ++i) sb << (char)_value[i];
-        return sb.str();
+        multiplyLimbsSchoolbook(a, b, result);
+        return;
     }
 
-private:
-    vector<int> _value;
-};
+    size_t half = max(a.size(), b.size()) / 2;
+    Limbs a0, a1, b0, b1, low, middle, high;
+    splitLimbs(a, half, &a0, &a1);
+    splitLimbs(b, half, &b0, &b1);
+    multiplyLimbs(a0, b0, &low);
+    multiplyLimbs(a1, b1, &high);
+    addLimbs(&a0, a1);
+    addLimbs(&b0, b1);
+    multiplyLimbs(a0, b0, &middle);
+    subtractLimbs(&middle, low);
+    subtractLimbs(&middle, high);
+    *result = low;
+    addLimbs(result, middle, half);
+    addLimbs(result, high, 2 * half);
+    trimLimbs(result);
+}
 
-//----------------------------------------------------------------------------------------------------------------------
+// The limb i of a shifted left by less than LIMB_BITS bits
+unsigned int shiftedLimb(const Limbs& a, size_t i, int shift)
+{
+    unsigned int ret = i < a.size() ? a[i] << shift : 0;
+    if (shift != 0 && i > 0 && i <= a.size()) ret |= a[i - 1] >> (LIMB_BITS - shift);
+    return ret;
+}
 
-class Boolean: public Object
+// Long division after Knuth, The Art of Computer Programming, Vol. 2, 4.3.1, Algorithm D. The divisor must not be zero.
+void divideLimbs(const Limbs& a, const Limbs& b, Limbs *quotient, Limbs *remainder)
 {
-public:
-    bool getValue() const { return _value; }
-    ObjectType getType() const { return otBoolean; }
-    string toString() const { return _value ? "#t" : "#f"; }
-    static const Boolean *getTrue() { return _true; }
-    static const Boolean *getFalse() { return _false; }
-    static const Boolean *valueOf(bool value) { return value ? _true : _false; }
-    void getReferences(set<Object*> *dest) const { }
-    bool gcIgnore() { return true; }
+    if (compareLimbs(a, b) < 0)
+    {
+        quotient->clear();
+        *remainder = a;
+        return;
+    }
+    if (b.size() == 1)
+    {
+        *quotient = a;
+        setLimbs(divideLimbsBySmall(quotient, b[0]), remainder);
+        return;
+    }
 
-private:
-    Boolean(bool value): _value(value) { }
-    const bool _value;
-    static const Boolean *_true;
-    static const Boolean *_false;
-};
+    // Normalize the divisor so that its highest bit is set, which keeps the estimated quotient digits within two of
+    // the real ones
+    int shift = 0;
+    while ((b.back() << shift & 0x80000000u) == 0) ++shift;
+    size_t n = b.size(), m = a.size() - n;
+    Limbs u(a.size() + 1), v(n);
+    for (size_t i = 0; i <= a.size(); ++i) u[i] = shiftedLimb(a, i, shift);
+    for (size_t i = 0; i < n; ++i) v[i] = shiftedLimb(b, i, shift);
+
+    quotient->assign(m + 1, 0);
+    for (size_t j = m + 1; j-- > 0;)
+    {
+        unsigned long numerator = (unsigned long)u[j + n] << LIMB_BITS | u[j + n - 1];
+        unsigned long estimate = numerator / v[n - 1], rest = numerator % v[n - 1];
+        while (estimate > LIMB_MAX || estimate * v[n - 2] > (rest << LIMB_BITS | u[j + n - 2]))
+        {
+            --estimate;
+            rest += v[n - 1];
+            if (rest > LIMB_MAX) break;
+        }
+
+        long borrow = 0, t;
+        for (size_t i = 0; i < n; ++i)
+        {
+            unsigned long product = estimate * v[i];
+            t = (long)u[i + j] - borrow - (long)(product & LIMB_MAX);
+            u[i + j] = (unsigned int)t;
+            borrow = (long)(product >> LIMB_BITS) - (t >> LIMB_BITS);
+        }
+        t = (long)u[j + n] - borrow;
+        u[j + n] = (unsigned int)t;
 
-const Boolean *Boolean::_true = new Boolean(true);
-const Boolean *Boolean::_false = new Boolean(false);
+        // The estimate was one too large: Add the divisor back
+        if (t < 0)
+        {
+            --estimate;
+            unsigned long carry = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                carry += (unsigned long)u[i + j] + v[i];
+                u[i + j] = (unsigned int)carry;
+                carry >>= LIMB_BITS;
+            }
+            u[j + n] += (unsigned int)carry;
+        }
+        (*quotient)[j] = (unsigned int)estimate;
+    }
+    trimLimbs(quotient);
 
-//----------------------------------------------------------------------------------------------------------------------
+    remainder->assign(n, 0);
+    for (size_t i = 0; i < n; ++i) (*remainder)[i] = u[i] >> shift | (shift != 0 ? u[i + 1] << (LIMB_BITS - shift) : 0);
+    trimLimbs(remainder);
+}
 
-class Char: public Object
+// The largest power of the base that fits into a limb, and its exponent
+unsigned int limbPower(int base, int *digits)
 {
-public:
-    Char(int value): _value(value) { }
-    int getValue() const { return _value; }
-    ObjectType getType() const { return otChar; }
-    void getReferences(set<Object*> *dest) const { }
-    
-    string toString() const
+    unsigned int ret = base;
+    for (*digits = 1; (unsigned long)ret * base <= LIMB_MAX; ++*digits) ret *= base;
+    return ret;
+}
+
+// Divides by the largest power of the base that fits into a limb, which yields several digits per pass over the
+// magnitude instead of one
+string limbsToString(Limbs a, int base)
+{
+    if (a.empty()) return "0";
+    int digits;
+    unsigned int power = limbPower(base, &digits);
+    string ret;
+    while (!a.empty())
     {
-        stringstream sb;
-        sb << (char)_value;
-        return sb.str();
+        unsigned int chunk = divideLimbsBySmall(&a, power);
+        for (int i = 0; i < digits && (chunk != 0 || !a.empty()); ++i)
+        {
+            ret += "0123456789abcdefghijklmnopqrstuvwxyz"[chunk % base];
+            chunk /= base;
+        }
     }
+    reverse(ret.begin(), ret.end());
+    return ret;
+}
 
-private:
-    const int _value;
-};
+// Returns false if the string is empty or contains anything but digits of the base
+bool parseLimbs(const string& s, int base, Limbs *a)
+{
+    a->clear();
+    if (s.empty()) return false;
+    unsigned int power = 1, chunk = 0;
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        char c = tolower(s[i]);
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'z' ? c - 'a' + 10 : base;
+        if (digit >= base) return false;
+        chunk = chunk * base + digit;
+        power *= base;
+        if ((unsigned long)power * base > LIMB_MAX)
+        {
+            multiplyAddLimbs(a, power, chunk);
+            power = 1;
+            chunk = 0;
+        }
+    }
+    if (power > 1) multiplyAddLimbs(a, power, chunk);
+    trimLimbs(a);
+    return true;
+}
 
 //----------------------------------------------------------------------------------------------------------------------
 
-class Eof: public Object
+// Integers outside the fixnum range. Bignums are never zero and never in the fixnum range, the generic arithmetic
+// always returns a fixnum where one will do.
+class Bignum: public Object
 {
 public:
-    ObjectType getType() const { return otEof; }
-    string toString() const { return "<EOF>"; }
-    static const Eof *getInstance() { return _instance; }
-    void getReferences(set<Object*> *dest) const { }
-    bool gcIgnore() { return true; }
+    Bignum(bool negative, const Limbs& limbs): Object(otBignum, sizeof(Bignum)), _negative(negative), _limbs(limbs) { }
+    bool isNegative() const { return _negative; }
+    const Limbs& getLimbs() const { return _limbs; }
+    ObjectType getType() const { return otBignum; }
+    string toString() const { return (_negative ? "-" : "") + limbsToString(_limbs, 10); }
+    void getReferences(vector<Object*> *dest) const { }
 
 private:
-    Eof() { }
-    static const Eof *_instance;
+    const bool _negative;
+    const Limbs _limbs;
 };
 
-const Eof *Eof::_instance = new Eof();
-
-//----------------------------------------------------------------------------------------------------------------------
+inline bool isInteger(const Object *o) { return isFixnum(o) || getType(o) == otBignum; }
+inline bool isNegativeInteger(const Object *o) { return isFixnum(o) ? Fixnum::getValue(o) < 0 : ((Bignum*)o)->isNegative(); }
 
-class Procedure: public Object
+Object *makeInteger(bool negative, const Limbs& limbs)
 {
-public:
-    Procedure(const string& name): _name(name) { }
-    virtual ~Procedure() { }
-    string getName() const { return _name; }
-    ObjectType getType() const { return otProcedure; }
-    string toString() const { return "<procedure " + _name + ">"; }
-    virtual Object* call(const vector<Object*> *parameters) = 0;
-    virtual bool isBuiltin() const { return true; }
-    virtual bool hasRestParameter() const { return false; }
-    virtual Object* getBody() const { return Symbol::fromString("builtin"); }
-    virtual const vector<string>* getArgumentNames() const { return new vector<string>(); }
-    void getReferences(set<Object*> *dest) const { }
-    bool gcIgnore() { return true; }
-
-protected:
-    void assertParameterCount(int expected, int got) const
+    if (limbs.size() <= 2)
     {
-        if (expected != got)
-        {
-            stringstream sb;
-            sb << _name << ": Invalid parameter count. Expected: " << expected << ", got " << got;
-            error(sb.str());
-        }
+        unsigned long magnitude = 0;
+        for (size_t i = limbs.size(); i-- > 0;) magnitude = magnitude << LIMB_BITS | limbs[i];
+        if (magnitude <= (unsigned long)FIXNUM_MAX) return Fixnum::valueOf(negative ? -(long)magnitude : (long)magnitude);
+        if (negative && magnitude == (unsigned long)FIXNUM_MAX + 1) return Fixnum::valueOf(FIXNUM_MIN);
     }
+    return new Bignum(negative, limbs);
+}
 
-private:
-    const string _name;
-};
+Object *makeInteger(long value)
+{
+    if (value >= FIXNUM_MIN && value <= FIXNUM_MAX) return Fixnum::valueOf(value);
+    Limbs limbs;
+    setLimbs(value < 0 ? -(unsigned long)value : (unsigned long)value, &limbs);
+    return new Bignum(value < 0, limbs);
+}
 
-class UnaryProcedure: public Procedure
+// Returns the sign and stores the magnitude of a fixnum or bignum
+bool getLimbs(const Object *o, Limbs *limbs)
 {
-public:
-    UnaryProcedure(const string& name, Object *(*f)(Object*)): Procedure(name), _f(f) { }
-    Object* call(const vector<Object*> *parameters)
+    if (!isFixnum(o))
     {
-        assertParameterCount(1, parameters->size());
-        return _f(parameters->at(0));
+        *limbs = ((Bignum*)o)->getLimbs();
+        return ((Bignum*)o)->isNegative();
     }
+    long value = Fixnum::getValue(o);
+    setLimbs(value < 0 ? -(unsigned long)value : (unsigned long)value, limbs);
+    return value < 0;
+}
 
-private:
-    Object *(*_f)(Object*);
-};
+// Parses an optionally signed integer, returns NULL if the string is not one
+Object *parseInteger(const string& s, int base)
+{
+    bool negative = !s.empty() && s[0] == '-';
+    size_t start = !s.empty() && (s[0] == '-' || s[0] == '+') ? 1 : 0;
+    Limbs limbs;
+    if (!parseLimbs(s.substr(start), base, &limbs)) return NULL;
+    return makeInteger(negative, limbs);
+}
 
-class BinaryProcedure: public Procedure
+string integerToString(const Object *o, int base)
 {
-public:
-    BinaryProcedure(const string& name, Object *(*f)(Object*, Object*)): Procedure(name), _f(f) { }
-    Object* call(const vector<Object*> *parameters)
+    Limbs limbs;
+    bool negative = getLimbs(o, &limbs);
+    return (negative ? "-" : "") + limbsToString(limbs, base);
+}
+
+Object *integerAdd(Object *o1, Object *o2, bool subtract = false)
+{
+    if (isFixnum(o1) && isFixnum(o2))
+        return makeInteger(subtract ? Fixnum::getValue(o1) - Fixnum::getValue(o2) : Fixnum::getValue(o1) + Fixnum::getValue(o2));
+
+    Limbs a, b;
+    bool aNegative = getLimbs(o1, &a), bNegative = getLimbs(o2, &b) != subtract;
+    if (aNegative == bNegative)
+    {
+        addLimbs(&a, b);
+        return makeInteger(aNegative, a);
+    }
+    if (compareLimbs(a, b) >= 0)
     {
-        assertParameterCount(2, parameters->size());
-        return _f(parameters->at(0), parameters->at(1));
+        subtractLimbs(&a, b);
+        return makeInteger(aNegative, a);
     }
+    subtractLimbs(&b, a);
+    return makeInteger(bNegative, b);
+}
 
-private:
-    Object *(*_f)(Object*, Object*);
-};
+// Both factors must be in fixnum range. Returns false if the product is not.
+bool multiplyExact(long a, long b, long *result)
+{
+    if (a == 0 || b == 0) { *result = 0; return true; }
+    long product = (long)((unsigned long)a * (unsigned long)b);
+    if (product / b != a || product < FIXNUM_MIN || product > FIXNUM_MAX) return false;
+    *result = product;
+    return true;
+}
 
-class TrinaryProcedure: public Procedure
+Object *integerMultiply(Object *o1, Object *o2)
 {
-public:
-    TrinaryProcedure(const string& name, Object *(*f)(Object*, Object*, Object*)): Procedure(name), _f(f) { }
-    Object* call(const vector<Object*> *parameters)
+    long product;
+    if (isFixnum(o1) && isFixnum(o2) && multiplyExact(Fixnum::getValue(o1), Fixnum::getValue(o2), &product))
+        return Fixnum::valueOf(product);
+
+    Limbs a, b, result;
+    bool negative = getLimbs(o1, &a) != getLimbs(o2, &b);
+    multiplyLimbs(a, b, &result);
+    return makeInteger(negative, result);
+}
+
+// Truncating division, so the remainder has the sign of the dividend. The divisor must not be zero.
+void integerDivide(Object *o1, Object *o2, Object **quotient, Object **remainder)
+{
+    if (isFixnum(o1) && isFixnum(o2))
     {
-        assertParameterCount(3, parameters->size());
-        return _f(parameters->at(0), parameters->at(1), parameters->at(2));
+        long a = Fixnum::getValue(o1), b = Fixnum::getValue(o2);
+        *quotient = makeInteger(a / b);
+        *remainder = Fixnum::valueOf(a % b);
+        return;
     }
 
-private:
-    Object *(*_f)(Object*, Object*, Object*);
-};
+    Limbs a, b, q, r;
+    bool aNegative = getLimbs(o1, &a), bNegative = getLimbs(o2, &b);
+    divideLimbs(a, b, &q, &r);
+    *quotient = makeInteger(aNegative != bNegative, q);
+    *remainder = makeInteger(aNegative, r);
+}
 
-class Lambda: public Procedure
+int integerCompare(const Object *o1, const Object *o2)
 {
-public:
-    Lambda(const string& name, Object *body, Environment *env, vector<string> argumentNames, bool hasRestParameter):
-        Procedure(name),
-        _body(new Pair(Symbol::fromString("begin"), body)),
-        _env(env),
-        _argumentNames(argumentNames),
-        _hasRest(hasRestParameter)
+    if (isFixnum(o1) && isFixnum(o2)) return Fixnum::getValue(o1) < Fixnum::getValue(o2) ? -1 : o1 == o2 ? 0 : 1;
+    Limbs a, b;
+    bool aNegative = getLimbs(o1, &a), bNegative = getLimbs(o2, &b);
+    if (aNegative != bNegative) return aNegative ? -1 : 1;
+    return aNegative ? compareLimbs(b, a) : compareLimbs(a, b);
+}
+
+double integerToDouble(const Object *o)
+{
+    if (isFixnum(o)) return (double)Fixnum::getValue(o);
+    const Limbs& limbs = ((Bignum*)o)->getLimbs();
+    double ret = 0;
+    for (size_t i = limbs.size(); i-- > 0;) ret = ret * 4294967296.0 + limbs[i];
+    return ((Bignum*)o)->isNegative() ? -ret : ret;
+}
+
+Object *integerNegate(Object *o) { return integerAdd(Fixnum::valueOf(0), o, true); }
+
+#if defined(__GNUC__)
+inline int trailingZeros(unsigned long x) { return __builtin_ctzl(x); }
+#else
+inline int trailingZeros(unsigned long x)
+{
+    int ret = 0;
+    for (; (x & 1) == 0; x >>= 1) ++ret;
+    return ret;
+}
+#endif
+
+// Stein's binary gcd needs only shifts and subtractions, no divisions
+unsigned long binaryGcd(unsigned long a, unsigned long b)
+{
+    if (a == 0) return b;
+    if (b == 0) return a;
+    int shift = trailingZeros(a | b);
+    a >>= trailingZeros(a);
+    while (b != 0)
     {
+        b >>= trailingZeros(b);
+        if (a > b) swap(a, b);
+        b -= a;
     }
+    return a << shift;
+}
 
-    Object* call(const vector<Object*> *parameters)
+// Euclid's remainders shrink bignums fast, the binary gcd takes over once both numbers are fixnums. The result is never
+// negative.
+Object *integerGcd(Object *a, Object *b)
+{
+    while (!isFixnum(a) || !isFixnum(b))
     {
-        error("Internal error: Lambda must be called by executing the body in tail position");
-        return NULL; // Just to keep the compiler happy
+        if (b == Fixnum::valueOf(0)) return isNegativeInteger(a) ? integerNegate(a) : a;
+        Object *quotient, *remainder;
+        integerDivide(a, b, &quotient, &remainder);
+        a = b;
+        b = remainder;
     }
+    long x = Fixnum::getValue(a), y = Fixnum::getValue(b);
+    return makeInteger((long)binaryGcd(x < 0 ? -(unsigned long)x : x, y < 0 ? -(unsigned long)y : y));
+}
 
-    virtual bool isBuiltin() const { return false; }
-    virtual bool hasRestParameter() const { return _hasRest; }
-    virtual Object* getBody() const { return _body; }
-    virtual const vector<string>* getArgumentNames() const { return &_argumentNames; }
-    Environment *getCapturedEnvironment() const { return _env; }
-    void getReferences(set<Object*> *dest) const { dest->insert(_body); dest->insert(_env); }
-    bool gcIgnore() { return false; }
+//----------------------------------------------------------------------------------------------------------------------
+
+// Exact rationals that are not integers. They are always in lowest terms, with the sign in the numerator and a
+// denominator greater than one; numerator and denominator are fixnums or bignums.
+class Fraction: public Object
+{
+public:
+    Fraction(Object *numerator, Object *denominator):
+        Object(otFraction, sizeof(Fraction)), _numerator(numerator), _denominator(denominator)
+    {
+        gcWriteBarrier(numerator);
+        gcWriteBarrier(denominator);
+    }
+    Object *getNumerator() const { return _numerator; }
+    Object *getDenominator() const { return _denominator; }
+    ObjectType getType() const { return otFraction; }
+    string toString() const { return integerToString(_numerator, 10) + "/" + integerToString(_denominator, 10); }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_numerator); dest->push_back(_denominator); }
 
 private:
-    Object *_body;
-    Environment *_env;
-    vector<string> _argumentNames;
-    bool _hasRest;
+    friend class ImageReader;
+    friend class ImageWriter;
+
+    Object *_numerator;
+    Object *_denominator;
 };
 
+// Returns an integer if the denominator divides the numerator
+Object *makeRational(const char *procedure, Object *numerator, Object *denominator)
+{
+    Object *one = Fixnum::valueOf(1), *remainder;
+    if (denominator == Fixnum::valueOf(0)) error((string)procedure + ": Division by zero");
+    if (isNegativeInteger(denominator))
+    {
+        numerator = integerNegate(numerator);
+        denominator = integerNegate(denominator);
+    }
+    Object *g = integerGcd(numerator, denominator);
+    if (g != one)
+    {
+        integerDivide(numerator, g, &numerator, &remainder);
+        integerDivide(denominator, g, &denominator, &remainder);
+    }
+    if (denominator == one) return numerator;
+    return new Fraction(numerator, denominator);
+}
+
+// Parses an integer or a fraction like -2/3, returns NULL if the string is neither
+Object *parseRational(const string& s, int base)
+{
+    size_t slash = s.find('/');
+    if (slash == string::npos) return parseInteger(s, base);
+    string denominator = s.substr(slash + 1);
+    if (denominator.empty() || denominator[0] == '-' || denominator[0] == '+') return NULL;
+    Object *n = parseInteger(s.substr(0, slash), base), *d = parseInteger(denominator, base);
+    if (n == NULL || d == NULL || d == Fixnum::valueOf(0)) return NULL;
+    return makeRational("read", n, d);
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 
-class Vector: public Object
+// Symbols are interned in an open addressing hash table with linear probing. Its size is a power of two, and it is
+// at most half full. Every symbol keeps its hash, so growing the table does not need to hash the names again.
+class Symbol: public Object
 {
 public:
-    Vector(vector<Object*> value): _value(value) { }
-    Vector(const long size) { _value.resize(size, Symbol::fromString("undefined")); }
-    ObjectType getType() const { return otVector; }
-    long getLength() const { return _value.size(); }
-    Object* GetAt(int index) const { return _value[index]; }
-    void SetAt(int index, Object* newValue) { _value[index] = newValue; }
-    void getReferences(set<Object*> *dest) const
+    ObjectType getType() const { return otSymbol; }
+    string toString() const { return _value; }
+    const string& getName() const { return _value; }
+    void getReferences(vector<Object*> *dest) const { }
+    bool gcIgnore() { return true; }
+
+    // The value of the global variable named by this symbol, NULL if there is none
+    Object *getGlobalValue() const { return _globalValue; }
+    void setGlobalValue(Object *value) { gcWriteBarrier(value); _globalValue = value; }
+
+    // Symbols are never collected and not traced, so the global values are roots of their own
+    static void getGlobalValues(vector<Object*> *dest)
     {
-        for (vector<Object*>::const_iterator i = _value.begin(); i != _value.end(); ++i)
-            dest->insert((Object*)*i);
+        for (size_t i = 0; i < tableSize; ++i)
+            if (table[i] != NULL && table[i]->_globalValue != NULL) dest->push_back(table[i]->_globalValue);
+    }
+
+    static void getGlobalSymbols(vector<Symbol*> *dest)
+    {
+        for (size_t i = 0; i < tableSize; ++i)
+            if (table[i] != NULL && table[i]->_globalValue != NULL) dest->push_back(table[i]);
     }
     
-    string toString() const
+    static Symbol *fromString(const string& value) { return fromString(value.data(), value.length()); }
+
+    static Symbol *fromString(const char *name, size_t length)
     {
-        stringstream sb;
-        sb << "#(";
-        for (size_t i=0; i<_value.size(); ++i) sb << _value[i]->toString() << " ";
-        string ret = sb.str();
-        ret[ret.length()-1] = ')';
-        return ret;
+        size_t hash = hashName(name, length);
+        if (2 * (symbolCount + 1) > tableSize) growTable();
+
+        size_t i = hash & (tableSize - 1);
+        for (; table[i] != NULL; i = (i + 1) & (tableSize - 1))
+            if (table[i]->_hash == hash && table[i]->_value.length() == length && memcmp(table[i]->_value.data(), name, length) == 0)
+                return table[i];
+
+        ++symbolCount;
+        table[i] = new Symbol(string(name, length), hash);
+        return table[i];
     }
 
 private:
-    vector<Object*> _value;
-};
-
-//----------------------------------------------------------------------------------------------------------------------
+    friend class JitCompiler;
 
-class Reader
-{
-public:
-    Reader(istream *input):
-        _input(input),
-        dot((Object*) Symbol::fromString(".")),
-        listEnd((Object*) Symbol::fromString(")"))
+    const string _value;
+    const size_t _hash;
+    Object *_globalValue;
+    static Symbol **table;
+    static size_t tableSize;
+    static size_t symbolCount;
+    Symbol(const string& value, size_t hash): Object(otSymbol, sizeof(Symbol)), _value(value), _hash(hash), _globalValue(NULL) { }
+
+    // FNV-1a
+    static size_t hashName(const char *name, size_t length)
     {
+        size_t ret = 2166136261u;
+        for (size_t i = 0; i < length; ++i) ret = (ret ^ (unsigned char)name[i]) * 16777619u;
+        return ret;
     }
 
-    Object *read(bool throwOnEof = true)
+    static void growTable()
     {
-        skipWhitespace();
-        
-        if (isEof())
-        {
-            if (throwOnEof) error("Unexpected end of input stream");
-            return (Object*) Eof::getInstance();
-        }
+        Symbol **oldTable = table;
+        size_t oldSize = tableSize;
 
-        switch (peekChar())
+        tableSize = tableSize == 0 ? 1024 : tableSize * 2;
+        table = (Symbol**) calloc(tableSize, sizeof(Symbol*));
+        if (table == NULL) error("Out of memory");
+
+        for (size_t i = 0; i < oldSize; ++i)
         {
-            case ';':
-                skipComment();
-                return read(throwOnEof);
-            case '\'':
-                readChar();
-                return (Object*) new Pair((Object*) Symbol::fromString("quote"), (Object*) new Pair(read(), (Object*) Null::getInstance()));
-            case '`':
-                readChar();
-                return (Object*) new Pair((Object*) Symbol::fromString("quasiquote"), (Object*) new Pair(read(), (Object*) Null::getInstance()));
-            case ',':
-                readChar();
-                return (Object*) new Pair((Object*) Symbol::fromString("unquote"), (Object*) new Pair(read(), (Object*) Null::getInstance()));
-            case '(':
-                return readList();
-            case '"':
-                return readString();
-            case '#':
-                return readSpecial();
-            default:
-                return readSymbolOrNumber();
+            if (oldTable[i] == NULL) continue;
+            size_t j = oldTable[i]->_hash & (tableSize - 1);
+            while (table[j] != NULL) j = (j + 1) & (tableSize - 1);
+            table[j] = oldTable[i];
         }
+        free(oldTable);
     }
+};
+
+// Zero initialized before any constructor runs, so symbols can be interned during static initialization
+Symbol **Symbol::table;
+size_t Symbol::tableSize;
+size_t Symbol::symbolCount;
+
+// Well-known symbols, interned once instead of on every use
+Symbol *undefinedSymbol = Symbol::fromString("undefined");
+Symbol *quoteSymbol = Symbol::fromString("quote");
+Symbol *quasiquoteSymbol = Symbol::fromString("quasiquote");
+Symbol *unquoteSymbol = Symbol::fromString("unquote");
+Symbol *beginSymbol = Symbol::fromString("begin");
+Symbol *builtinSymbol = Symbol::fromString("builtin");
+Symbol *nanSymbol = Symbol::fromString("nan");
+Symbol *defineSymbol = Symbol::fromString("define");
+Symbol *setSymbol = Symbol::fromString("set!");
+Symbol *lambdaSymbol = Symbol::fromString("lambda");
+Symbol *ifSymbol = Symbol::fromString("if");
+Symbol *printEvalFormsSymbol = Symbol::fromString("print-eval-forms");
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// A reference to a local variable, which replaces its symbol in the forms evaluated: The variable is in slot index of
+// the environment depth levels up from the current one.
+class LocalReference: public Object
+{
+public:
+    LocalReference(size_t depth, size_t index, Symbol *symbol): Object(otLocalReference, sizeof(LocalReference)), _depth(depth), _index(index), _symbol(symbol) { }
+    ObjectType getType() const { return otLocalReference; }
+    string toString() const { return _symbol->getName(); }
+    size_t getDepth() const { return _depth; }
+    size_t getIndex() const { return _index; }
+    Symbol *getSymbol() const { return _symbol; }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_symbol); }
 
 private:
-    istream *_input;
-    Object *dot;
-    Object *listEnd;
+    friend class ImageReader;
+    friend class ImageWriter;
 
-    void skipWhitespace()
+    size_t _depth;
+    size_t _index;
+    Symbol *_symbol;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// Global variables live in the value cells of their symbols, so the symbols in a form lead straight to their values.
+// The variables of a lambda are kept in slots instead: The arguments come first, followed by the internal definitions
+// of its body, in the order assigned by Interpreter::resolve. A slot is NULL until its variable has been defined.
+//
+// A frame is an environment on the C++ stack, with its slots on the value stack. It has a fixed number of slots and
+// must not be referenced by any heap object, nor by a GcRoot: The slots are marked with the value stack, and the outer
+// environment is kept alive by the lambda being called.
+class Environment: public Object
+{
+public:
+    Environment(): Object(otEnvironment, sizeof(Environment)), _slots(NULL), _slotCount(0), _isFrame(false), _outer(NULL) { }
+
+    Environment(Environment *outer):
+        Object(otEnvironment, sizeof(Environment)), _slots(NULL), _slotCount(0), _isFrame(false), _outer(outer)
     {
-        while (!isEof() && isspace(peekChar()))
-            readChar();
+        gcWriteBarrier(outer);
     }
 
-    void skipComment()
+    Environment(Object **slots, size_t slotCount, Environment *outer):
+        Object(), _slots(slots), _slotCount(slotCount), _isFrame(true), _outer(outer)
     {
-        while (!isEof() && peekChar() != '\n')
-            readChar();
     }
 
-    bool isEof() const
+    ObjectType getType() const { return otEnvironment; }
+    string toString() const { return "<Environment>"; }
+    void getReferences(vector<Object*> *dest) const
     {
-        return _input->peek() == -1;
+        if (_outer == NULL) Symbol::getGlobalValues(dest);
+        dest->insert(dest->end(), _slots, _slots + _slotCount);
+        if (_outer != NULL) dest->push_back(_outer);
     }
 
-    int peekChar() const
+    void define(const string& identifier, Object *value) { define(Symbol::fromString(identifier), value); }
+
+    void define(Symbol *symbol, Object *value)
     {
-        assertNotEof();
-        return _input->peek();
+        const string& identifier = symbol->getName();
+        if (identifier == "if" || identifier == "define" ||identifier == "defmacro" ||identifier == "set!" || identifier == "lambda" ||identifier == "quote" ||identifier == "begin")
+            error("Symbol '" + identifier + "' is constant and must not be changed");
+        else
+            symbol->setGlobalValue(value);
     }
 
-    int readChar()
+    void set(Symbol *symbol, Object *value)
     {
-        assertNotEof();
-        return _input->get();
+        if (symbol->getGlobalValue() == NULL) error("Unknown variable '" + symbol->getName() + "'");
+        symbol->setGlobalValue(value);
     }
 
-    void assertNotEof() const
+    Object* get(Symbol *symbol)
     {
-        if (isEof()) error("Unexpected end of input stream");
+        Object *ret = symbol->getGlobalValue();
+        if (ret == NULL) error("Unknown variable '" + symbol->getName() + "'");
+        return ret;
     }
 
-    Object *readList()
+    void defineSlot(size_t index, Object *value)
     {
-        readChar(); // Opening parenthesis
-        Object *ret = (Object*) Null::getInstance();
-        Object *current = (Object*) Null::getInstance();
-
-        for (;;)
-        {
-            Object *o = read();
-            if (o == listEnd) return ret; // Closing parenthesis
-            if (o == dot)
-            {
-                if (current->getType() == otNull) error("Read error: Invalid dotted list");
-                o = read();
-                ((Pair*)current)->_cdr = o;
-                if (read() != listEnd)error("Read error: Invalid dotted list");
-                return ret;
-            }
-
-            Pair *newPair = new Pair(o, (Object*) Null::getInstance());
-            if (current->getType() == otNull)
-            {
-                ret = current = (Object*) newPair;
-            }
-            else
-            {
-                ((Pair*)current)->_cdr = (Object*) newPair;
-                current = (Object*) newPair;
-            }
-        }
+        if (index >= _slotCount) resizeSlots(index + 1);
+        gcWriteBarrier(value);
+        _slots[index] = value;
     }
 
-    Object *readString()
+    // Returns false if the variable has not been defined yet
+    bool setSlot(size_t depth, size_t index, Object *value)
     {
-        readChar(); // Opening quote
-        vector<int> sb;
-        for (char c = readChar(); c != '"'; c = readChar())
-        {
-            if (c == '\\')
-            {
-                c = readChar();
-                if (c == 'n') c = '\n';
-                if (c == 'r') c = '\r';
-                if (c == 't') c = '\t';
-            }
-            sb.push_back((char)c);
-        }
-        return (Object*) new String(sb);
+        Environment *env = getOuter(depth);
+        if (index >= env->_slotCount || env->_slots[index] == NULL) return false;
+        gcWriteBarrier(value);
+        env->_slots[index] = value;
+        return true;
     }
 
-    Object *readSpecial()
+    // Returns NULL if the variable has not been defined yet
+    Object* getSlot(size_t depth, size_t index)
     {
-        readChar(); // #
-        if (peekChar() == '(') return readVector();
-        if (peekChar() != '\\') return readSymbolOrNumber("#");
-        readChar();
-        return readCharacter();
+        Environment *env = getOuter(depth);
+        return index < env->_slotCount ? env->_slots[index] : NULL;
     }
 
-    Object *readVector()
+    Environment* extendIntoNew(const vector<string> *argumentNames, Object **arguments, size_t count, bool hasRestParameter)
     {
-        readChar(); // Opening parenthesis
-        vector<Object*> ret;
+        Environment *ret = new Environment(this);
 
-        for (;;)
+        if (hasRestParameter)
         {
-            Object *o = read();
-            if (o == listEnd) return (Object*) new Vector(ret); // Closing parenthesis
-            if (o == dot) error("Read error: Dot is invalid inside a vector literal");
-            ret.push_back(o);
+            if (count < argumentNames->size() - 1) error("Invalid parameter count");
+            ret->_heapSlots.assign(arguments, arguments + argumentNames->size() - 1);
+            Object *o = (Object*) Null::getInstance();
+            for (long i = count - 1; i >= (long)argumentNames->size() - 1; --i) o = new Pair(arguments[i], o);
+            ret->_heapSlots.push_back(o);
         }
+        else
+        {
+            if (count != argumentNames->size()) error("Invalid parameter count");
+            ret->_heapSlots.assign(arguments, arguments + count);
+        }
+        ret->resizeSlots(ret->_heapSlots.size());
+        for (size_t i = 0; i < ret->_slotCount; ++i) gcWriteBarrier(ret->_slots[i]);
+        return ret;
     }
 
-    Object *readCharacter()
-    {
-        char c = readChar();
-        if (!isalpha(c)) return (Object*) new Char(c);
+private:
+    friend class ImageReader;
+    friend class ImageWriter;
 
-        stringstream sb;
-        sb << (char)c;
-
-        while (!isEof() && peekChar() != ')' && !isspace(peekChar())) sb << (char)readChar();
-        string name = sb.str();
-        if (name == "newline") return (Object*) new Char(10);
-        if (name == "cr") return (Object*) new Char(13);
-        if (name == "tab") return (Object*) new Char(9);
-        if (name == "space") return (Object*) new Char(32);
-        if (name.length() == 1) return (Object*) new Char(name[0]);
-        error("Read error: Invalid character name: \\" + name);
+    Object **_slots;
+    size_t _slotCount;
+    bool _isFrame;
+    vector<Object*> _heapSlots;
+    Environment *_outer;
+
+    void resizeSlots(size_t count)
+    {
+        if (_isFrame) error("Internal error: Frame too small");
+        _heapSlots.resize(count, NULL);
+        _slots = _heapSlots.empty() ? NULL : &_heapSlots[0];
+        _slotCount = count;
+    }
+
+    Environment* getOuter(size_t depth)
+    {
+        Environment *ret = this;
+        for (; depth > 0; --depth) ret = ret->_outer;
+        return ret;
+    }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// Strings are byte strings, so characters in strings are limited to the codes 0 to 255
+class String: public Object
+{
+public:
+    String(const string& value): Object(otString, sizeof(String)), _value(value) { }
+    String(const long size, char fill = ' '): Object(otString, sizeof(String)), _value(size, fill) { }
+    ObjectType getType() const { return otString; }
+    string toString() const { return _value; }
+    long getLength() const { return _value.size(); }
+    int GetAt(int index) const { return (unsigned char)_value[index]; }
+    void SetAt(int index, int newChar) { _value[index] = (char)newChar; }
+    void fill(char c) { _value.assign(_value.size(), c); }
+    const string& getValue() const { return _value; }
+    void getReferences(vector<Object*> *dest) const { }
+
+private:
+    string _value;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// An output string port collects everything written to it in one buffer, which grows geometrically, so writing n
+// characters takes O(n) time. get-output-string copies the buffer into a new string.
+class StringPort: public Object
+{
+public:
+    StringPort(): Object(otStringPort, sizeof(StringPort)) { }
+    ObjectType getType() const { return otStringPort; }
+    string toString() const { return "<string-port>"; }
+    const string& getValue() const { return _value; }
+    void getReferences(vector<Object*> *dest) const { }
+
+    void write(const char *s, size_t length)
+    {
+        size_t capacity = _value.capacity();
+        _value.append(s, length);
+        if (_value.capacity() != capacity) gcCountAllocations((_value.capacity() - capacity) / GC_PAYLOAD_BYTES);
+    }
+
+private:
+    string _value;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// A file port reads or writes a file descriptor through a buffer of PORT_BUFFER_SIZE bytes, so that most reads and
+// writes only touch the buffer. Output reaches the file when the buffer is full, on flush, on close and on exit. A port
+// that is collected is closed, except for the standard output port, which does not own its descriptor and is never
+// collected.
+class FilePort: public Object
+{
+public:
+    FilePort(int fd, bool input, bool owned): Object(otFilePort, sizeof(FilePort)), _fd(fd), _input(input),
+        _owned(owned), _start(0), _end(0), _buffer(new char[PORT_BUFFER_SIZE])
+    {
+        gcCountAllocations(PORT_BUFFER_SIZE / GC_PAYLOAD_BYTES);
+        if (!input && fd >= 0) openOutputPorts.insert(this);
+    }
+    ~FilePort() { close(); delete[] _buffer; }
+    ObjectType getType() const { return otFilePort; }
+    string toString() const { return _input ? "<input-port>" : "<output-port>"; }
+    void getReferences(vector<Object*> *dest) const { }
+    bool gcIgnore() { return !_owned; }
+    bool isInput() const { return _input; }
+    bool isOpen() const { return _fd >= 0; }
+
+    // Returns the next byte without consuming it, or -1 at the end of the file
+    int peek()
+    {
+        if (_start == _end && !fill()) return -1;
+        return (unsigned char)_buffer[_start];
+    }
+
+    int read()
+    {
+        int ret = peek();
+        if (ret >= 0) ++_start;
+        return ret;
+    }
+
+    // Reads up to the next newline, which is consumed but not stored. Returns false at the end of the file.
+    bool readLine(string *line)
+    {
+        line->clear();
+        if (_start == _end && !fill()) return false;
+        do
+        {
+            const char *newline = (const char*) memchr(_buffer + _start, '\n', _end - _start);
+            if (newline != NULL)
+            {
+                line->append(_buffer + _start, newline - _buffer - _start);
+                _start = newline - _buffer + 1;
+                return true;
+            }
+            line->append(_buffer + _start, _end - _start);
+            _start = _end;
+        } while (fill());
+        return true;
+    }
+
+    // Returns false if the data could not be written
+    bool write(const char *s, size_t length)
+    {
+        if (_end + length > PORT_BUFFER_SIZE && !flush()) return false;
+        if (length >= PORT_BUFFER_SIZE) return writeAll(s, length);
+        memcpy(_buffer + _end, s, length);
+        _end += length;
+        return true;
+    }
+
+    bool flush()
+    {
+        if (_input || _end == 0) return true;
+        size_t length = _end;
+        _end = 0;
+        return writeAll(_buffer, length);
+    }
+
+    bool close()
+    {
+        if (_fd < 0) return true;
+        bool ret = flush();
+        openOutputPorts.erase(this);
+        if (_owned && ::close(_fd) != 0) ret = false;
+        _fd = -1;
+        _start = _end = 0;
+        return ret;
+    }
+
+    static set<FilePort*> openOutputPorts; // Flushed on exit
+
+private:
+    bool fill()
+    {
+        if (_fd < 0) return false;
+        ssize_t count;
+        do count = ::read(_fd, _buffer, PORT_BUFFER_SIZE); while (count < 0 && errno == EINTR);
+        _start = 0;
+        _end = count > 0 ? count : 0;
+        return count > 0;
+    }
+
+    bool writeAll(const char *s, size_t length)
+    {
+        if (_fd < 0) return false;
+        while (length > 0)
+        {
+            ssize_t count = ::write(_fd, s, length);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) return false;
+            s += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    int _fd;
+    bool _input;
+    bool _owned;
+    size_t _start; // For input ports, the buffered bytes not read yet are _buffer[_start] to _buffer[_end - 1]
+    size_t _end; // For output ports, the bytes not written yet are _buffer[0] to _buffer[_end - 1]
+    char *_buffer;
+};
+
+set<FilePort*> FilePort::openOutputPorts;
+
+// Created on first use, since objects can not be allocated during static initialization
+FilePort *getStandardOutput()
+{
+    static FilePort *standardOutput = NULL;
+    if (standardOutput == NULL) standardOutput = new FilePort(1, false, false);
+    return standardOutput;
+}
+
+void flushStandardOutput()
+{
+    getStandardOutput()->flush();
+}
+
+void flushOutputPorts()
+{
+    for (set<FilePort*>::iterator i = FilePort::openOutputPorts.begin(); i != FilePort::openOutputPorts.end(); ++i)
+        (*i)->flush();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+class Boolean
+{
+public:
+    static Object *getTrue() { return (Object*) (1 << 4 | IMMEDIATE_BOOLEAN); }
+    static Object *getFalse() { return (Object*) IMMEDIATE_BOOLEAN; }
+    static Object *valueOf(bool value) { return value ? getTrue() : getFalse(); }
+    static bool getValue(const Object *o) { return o != getFalse(); }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+class Char
+{
+public:
+    static Object *valueOf(int value) { return (Object*) ((size_t)value << 4 | IMMEDIATE_CHAR); }
+    static int getValue(const Object *o) { return (int)((size_t)o >> 4); }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+class Eof
+{
+public:
+    static Object *getInstance() { return (Object*) IMMEDIATE_EOF; }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+string toString(const Object *o)
+{
+    stringstream sb;
+    switch ((size_t)o & 15)
+    {
+    case IMMEDIATE_CHAR: sb << (char)Char::getValue(o); return sb.str();
+    case IMMEDIATE_BOOLEAN: return Boolean::getValue(o) ? "#t" : "#f";
+    case IMMEDIATE_NULL: return "()";
+    case IMMEDIATE_EOF: return "<EOF>";
+    }
+    if (isFixnum(o))
+    {
+        sb << Fixnum::getValue(o);
+        return sb.str();
+    }
+    return o->toString();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// Forms are compiled into trees of nodes once (see compile), which are then executed instead of the forms. A call does
+// not call a lambda itself, it returns NULL and leaves the lambda in tail, with the arguments on the value stack, so
+// that callLambda runs it in a loop. Nodes in tail position pass that on to their caller, so tail calls do not grow
+// the C++ stack.
+class Lambda;
+
+// A lambda to be called by callLambda, with its arguments on the value stack from base up
+struct TailCall
+{
+    Lambda *lambda;
+    size_t base;
+};
+
+class Node: public Object
+{
+public:
+    Node(size_t size): Object(otNode, size) { }
+    ObjectType getType() const { return otNode; }
+    string toString() const { return "<node>"; }
+    virtual Object* exec(Environment *env, TailCall *tail) = 0;
+};
+
+Node* compile(Object *form);
+Object* execute(Node *node, Environment *env);
+Object* callLambda(Lambda *l, size_t base);
+
+struct NativeCode;
+void releaseNativeCode(NativeCode *native);
+
+//----------------------------------------------------------------------------------------------------------------------
+
+class Procedure: public Object
+{
+public:
+    Procedure(const string& name, size_t size): Object(otProcedure, size), _name(name) { }
+    virtual ~Procedure() { }
+    string getName() const { return _name; }
+    ObjectType getType() const { return otProcedure; }
+    string toString() const { return "<procedure " + _name + ">"; }
+    virtual Object* call(Object **arguments, size_t count) = 0;
+    virtual bool isBuiltin() const { return true; }
+    virtual bool isCompiled() const { return false; }
+    virtual bool hasRestParameter() const { return false; }
+    virtual Object* getBody() const { return builtinSymbol; }
+    virtual const vector<string>* getArgumentNames() const { return new vector<string>(); }
+    void getReferences(vector<Object*> *dest) const { }
+    bool gcIgnore() { return true; }
+
+protected:
+    void assertParameterCount(int expected, int got) const
+    {
+        if (expected != got)
+        {
+            stringstream sb;
+            sb << _name << ": Invalid parameter count. Expected: " << expected << ", got " << got;
+            error(sb.str());
+        }
+    }
+
+private:
+    const string _name;
+};
+
+class NullaryProcedure: public Procedure
+{
+public:
+    NullaryProcedure(const string& name, Object *(*f)()): Procedure(name, sizeof(NullaryProcedure)), _f(f) { }
+    Object* call(Object **arguments, size_t count)
+    {
+        assertParameterCount(0, count);
+        return _f();
+    }
+
+private:
+    Object *(*_f)();
+};
+
+class UnaryProcedure: public Procedure
+{
+public:
+    UnaryProcedure(const string& name, Object *(*f)(Object*)): Procedure(name, sizeof(UnaryProcedure)), _f(f) { }
+    Object* call(Object **arguments, size_t count)
+    {
+        assertParameterCount(1, count);
+        return _f(arguments[0]);
+    }
+
+private:
+    Object *(*_f)(Object*);
+};
+
+class BinaryProcedure: public Procedure
+{
+public:
+    BinaryProcedure(const string& name, Object *(*f)(Object*, Object*)): Procedure(name, sizeof(BinaryProcedure)), _f(f) { }
+    Object* call(Object **arguments, size_t count)
+    {
+        assertParameterCount(2, count);
+        return _f(arguments[0], arguments[1]);
+    }
+
+private:
+    Object *(*_f)(Object*, Object*);
+};
+
+class TrinaryProcedure: public Procedure
+{
+public:
+    TrinaryProcedure(const string& name, Object *(*f)(Object*, Object*, Object*)): Procedure(name, sizeof(TrinaryProcedure)), _f(f) { }
+    Object* call(Object **arguments, size_t count)
+    {
+        assertParameterCount(3, count);
+        return _f(arguments[0], arguments[1], arguments[2]);
+    }
+
+private:
+    Object *(*_f)(Object*, Object*, Object*);
+};
+
+// Returns the number of slots of a frame for calls of a lambda with the given body (after Interpreter::resolve), or -1
+// if calls need an environment on the heap. That is the case if the lambda has a rest parameter, or if its body might
+// create a closure capturing the environment, which is assumed for any lambda form in it.
+long computeFrameSize(Object *body, size_t argumentCount, bool hasRestParameter)
+{
+    if (hasRestParameter) return -1;
+    long ret = argumentCount;
+    for (Object *i = body; getType(i) == otPair; i = ((Pair*)i)->_cdr)
+    {
+        Object *o = ((Pair*)i)->_car;
+        if (getType(o) == otLocalReference)
+        {
+            LocalReference *ref = (LocalReference*) o;
+            if (ref->getDepth() == 0 && (long)ref->getIndex() >= ret) ret = ref->getIndex() + 1;
+        }
+        if (getType(o) != otPair) continue;
+        Pair *p = (Pair*) o;
+        if (p->_car == quoteSymbol) continue;
+        if (p->_car == lambdaSymbol) return -1;
+        if (p->_car == defineSymbol && getType(p->_cdr) == otPair && getType(((Pair*)p->_cdr)->_car) == otPair) return -1;
+        long inner = computeFrameSize(o, ret, false);
+        if (inner < 0) return -1;
+        ret = inner;
+    }
+    return ret;
+}
+
+class VariadicProcedure: public Procedure
+{
+public:
+    VariadicProcedure(const string& name, Object *(*f)(Object**, size_t)): Procedure(name, sizeof(VariadicProcedure)), _f(f) { }
+    Object* call(Object **arguments, size_t count) { return _f(arguments, count); }
+
+private:
+    Object *(*_f)(Object**, size_t);
+};
+
+class Lambda: public Procedure
+{
+public:
+    Lambda(const string& name, Object *body, Environment *env, vector<string> argumentNames, bool hasRestParameter, Node *code = NULL, long frameSize = -2):
+        Procedure(name, sizeof(Lambda)),
+        _body(new Pair(beginSymbol, body)),
+        _env(env),
+        _argumentNames(argumentNames),
+        _hasRest(hasRestParameter),
+        _code(code),
+        _frameSize(frameSize),
+        _calls(0),
+        _native(NULL)
+    {
+        gcWriteBarrier(env);
+        gcWriteBarrier(code);
+    }
+
+    ~Lambda() { releaseNativeCode(_native); }
+
+    Object* call(Object **arguments, size_t count)
+    {
+        error("Internal error: Lambda must be called by executing the body in tail position");
         return NULL; // Just to keep the compiler happy
     }
 
-    Object *readSymbolOrNumber(const string& init="")
+    virtual bool isBuiltin() const { return false; }
+    virtual bool hasRestParameter() const { return _hasRest; }
+    virtual Object* getBody() const { return _body; }
+    virtual const vector<string>* getArgumentNames() const { return &_argumentNames; }
+    Environment *getCapturedEnvironment() const { return _env; }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_body); dest->push_back(_env); dest->push_back(_code); }
+    bool gcIgnore() { return false; }
+
+    // Lambdas not created by a LambdaNode, e.g. those read from an image, are compiled on their first call
+    Node* getCode()
+    {
+        if (_code == NULL)
+        {
+            _code = compile(_body);
+            gcWriteBarrier(_code);
+        }
+        return _code;
+    }
+
+    long getFrameSize()
+    {
+        if (_frameSize == -2) _frameSize = computeFrameSize(_body, _argumentNames.size(), _hasRest);
+        return _frameSize;
+    }
+
+private:
+    friend class ImageReader;
+    friend class ImageWriter;
+    friend class JitCompiler;
+    friend Object* jitCall(Lambda *l, Object **arguments, size_t count);
+
+    Object *_body;
+    Environment *_env;
+    vector<string> _argumentNames;
+    bool _hasRest;
+    Node *_code;
+    long _frameSize; // See computeFrameSize; -2 if not computed yet
+    long _calls; // Negative if the lambda can not be compiled to native code
+    NativeCode *_native;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+class Vector: public Object
+{
+public:
+    Vector(vector<Object*> value): Object(otVector, sizeof(Vector)), _value(value) { for (size_t i = 0; i < value.size(); ++i) gcWriteBarrier(value[i]); }
+    Vector(const long size): Object(otVector, sizeof(Vector)) { _value.resize(size, undefinedSymbol); }
+    ObjectType getType() const { return otVector; }
+    long getLength() const { return _value.size(); }
+    Object* GetAt(int index) const { return _value[index]; }
+    void SetAt(int index, Object* newValue) { gcWriteBarrier(newValue); _value[index] = newValue; }
+    void getReferences(vector<Object*> *dest) const
+    {
+        for (vector<Object*>::const_iterator i = _value.begin(); i != _value.end(); ++i)
+            dest->push_back((Object*)*i);
+    }
+    
+    string toString() const
+    {
+        stringstream sb;
+        sb << "#(";
+        for (size_t i=0; i<_value.size(); ++i) sb << ::toString(_value[i]) << " ";
+        string ret = sb.str();
+        ret[ret.length()-1] = ')';
+        return ret;
+    }
+
+private:
+    vector<Object*> _value;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// The homogeneous vectors of SRFI 4 keep their elements unboxed in one block of memory, so they can be processed in
+// bulk. Only f64vector, s32vector and u8vector are supported.
+inline const char *numericVectorTag(ObjectType type) { return type == otF64Vector ? "f64" : type == otS32Vector ? "s32" : "u8"; }
+
+template <class T, ObjectType type> class NumericVector: public Object
+{
+public:
+    typedef T Element;
+    static const ObjectType TYPE = type;
+    NumericVector(size_t length, T fill): Object(type, sizeof(NumericVector)), _elements(length, fill)
+    {
+        gcCountAllocations(length * sizeof(T) / GC_PAYLOAD_BYTES);
+    }
+    ObjectType getType() const { return type; }
+    size_t getLength() const { return _elements.size(); }
+    T GetAt(size_t index) const { return _elements[index]; }
+    void SetAt(size_t index, T value) { _elements[index] = value; }
+    T *getElements() { return _elements.empty() ? NULL : &_elements[0]; }
+    void getReferences(vector<Object*> *dest) const { }
+
+    string toString() const
+    {
+        stringstream sb;
+        sb << '#' << numericVectorTag(type) << '(';
+        for (size_t i = 0; i < _elements.size(); ++i) sb << (i == 0 ? "" : " ") << +_elements[i];
+        sb << ')';
+        return sb.str();
+    }
+
+private:
+    vector<T> _elements;
+};
+
+typedef NumericVector<double, otF64Vector> F64Vector;
+typedef NumericVector<int, otS32Vector> S32Vector;
+typedef NumericVector<unsigned char, otU8Vector> U8Vector;
+
+//----------------------------------------------------------------------------------------------------------------------
+
+class ConstantNode: public Node
+{
+public:
+    ConstantNode(Object *value): Node(sizeof(ConstantNode)), _value(value) { gcWriteBarrier(value); }
+    Object* exec(Environment *env, TailCall *tail) { return _value; }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_value); }
+
+private:
+    friend class JitCompiler;
+
+    Object *_value;
+};
+
+class LocalReferenceNode: public Node
+{
+public:
+    LocalReferenceNode(LocalReference *ref): Node(sizeof(LocalReferenceNode)), _depth(ref->getDepth()), _index(ref->getIndex()), _symbol(ref->getSymbol()) { }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_symbol); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        Object *value = env->getSlot(_depth, _index);
+        if (value == NULL) error("Unknown variable '" + _symbol->getName() + "'");
+        return value;
+    }
+
+private:
+    friend class JitCompiler;
+
+    size_t _depth;
+    size_t _index;
+    Symbol *_symbol;
+};
+
+class GlobalReferenceNode: public Node
+{
+public:
+    GlobalReferenceNode(Symbol *symbol): Node(sizeof(GlobalReferenceNode)), _symbol(symbol) { }
+    Object* exec(Environment *env, TailCall *tail) { return env->get(_symbol); }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_symbol); }
+
+private:
+    friend class JitCompiler;
+
+    Symbol *_symbol;
+};
+
+class DefineLocalNode: public Node
+{
+public:
+    DefineLocalNode(LocalReference *ref, Node *value): Node(sizeof(DefineLocalNode)), _index(ref->getIndex()), _value(value) { gcWriteBarrier(value); }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_value); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        env->defineSlot(_index, execute(_value, env));
+        return undefinedSymbol;
+    }
+
+private:
+    size_t _index;
+    Node *_value;
+};
+
+class DefineGlobalNode: public Node
+{
+public:
+    DefineGlobalNode(Symbol *symbol, Node *value): Node(sizeof(DefineGlobalNode)), _symbol(symbol), _value(value) { gcWriteBarrier(value); }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_symbol); dest->push_back(_value); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        env->define(_symbol, execute(_value, env));
+        return undefinedSymbol;
+    }
+
+private:
+    Symbol *_symbol;
+    Node *_value;
+};
+
+class SetLocalNode: public Node
+{
+public:
+    SetLocalNode(LocalReference *ref, Node *value): Node(sizeof(SetLocalNode)), _depth(ref->getDepth()), _index(ref->getIndex()), _symbol(ref->getSymbol()), _value(value) { gcWriteBarrier(value); }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_symbol); dest->push_back(_value); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        if (!env->setSlot(_depth, _index, execute(_value, env))) error("Unknown variable '" + _symbol->getName() + "'");
+        return undefinedSymbol;
+    }
+
+private:
+    size_t _depth;
+    size_t _index;
+    Symbol *_symbol;
+    Node *_value;
+};
+
+class SetGlobalNode: public Node
+{
+public:
+    SetGlobalNode(Symbol *symbol, Node *value): Node(sizeof(SetGlobalNode)), _symbol(symbol), _value(value) { gcWriteBarrier(value); }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_symbol); dest->push_back(_value); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        env->set(_symbol, execute(_value, env));
+        return undefinedSymbol;
+    }
+
+private:
+    Symbol *_symbol;
+    Node *_value;
+};
+
+class IfNode: public Node
+{
+public:
+    IfNode(Node *condition, Node *thenPart, Node *elsePart):
+        Node(sizeof(IfNode)), _condition(condition), _then(thenPart), _else(elsePart)
+    {
+        gcWriteBarrier(condition);
+        gcWriteBarrier(thenPart);
+        gcWriteBarrier(elsePart);
+    }
+
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_condition); dest->push_back(_then); dest->push_back(_else); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        if (execute(_condition, env) != Boolean::getFalse()) return _then->exec(env, tail);
+        return _else->exec(env, tail);
+    }
+
+private:
+    friend class JitCompiler;
+
+    Node *_condition;
+    Node *_then;
+    Node *_else;
+};
+
+class BeginNode: public Node
+{
+public:
+    BeginNode(const vector<Node*>& forms): Node(sizeof(BeginNode)), _forms(forms) { for (size_t i = 0; i < forms.size(); ++i) gcWriteBarrier(forms[i]); }
+    void getReferences(vector<Object*> *dest) const { dest->insert(dest->end(), _forms.begin(), _forms.end()); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        for (size_t i = 0; i < _forms.size() - 1; ++i) execute(_forms[i], env);
+        return _forms.back()->exec(env, tail);
+    }
+
+private:
+    vector<Node*> _forms;
+};
+
+class LambdaNode: public Node
+{
+public:
+    LambdaNode(const string& name, Object *body, const vector<string>& argumentNames, bool hasRestParameter):
+        Node(sizeof(LambdaNode)),
+        _name(name),
+        _body(body),
+        _argumentNames(argumentNames),
+        _hasRest(hasRestParameter),
+        _code(compile(new Pair(beginSymbol, body))),
+        _frameSize(computeFrameSize(body, argumentNames.size(), hasRestParameter))
+    {
+        gcWriteBarrier(body);
+        gcWriteBarrier(_code);
+    }
+
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_body); dest->push_back(_code); }
+    Object* exec(Environment *env, TailCall *tail) { return new Lambda(_name, _body, env, _argumentNames, _hasRest, _code, _frameSize); }
+
+private:
+    const string _name;
+    Object *_body;
+    vector<string> _argumentNames;
+    bool _hasRest;
+    Node *_code;
+    long _frameSize;
+};
+
+Object* jitCall(Lambda *l, Object **arguments, size_t count);
+
+class CallNode: public Node
+{
+public:
+    CallNode(Node *function, const vector<Node*>& arguments): Node(sizeof(CallNode)), _function(function), _arguments(arguments)
+    {
+        gcWriteBarrier(function);
+        for (size_t i = 0; i < arguments.size(); ++i) gcWriteBarrier(arguments[i]);
+    }
+
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_function); dest->insert(dest->end(), _arguments.begin(), _arguments.end()); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        Object *function = execute(_function, env);
+        GcRoot functionRoot(&function);
+        size_t base = valueStackTop;
+        for (size_t i = 0; i < _arguments.size(); ++i) pushValue(execute(_arguments[i], env));
+
+        if (::getType(function) != otProcedure)
+            error("eval: '" + ::toString(function) + "' is not callable");
+
+        Object *ret;
+        if (((Procedure*)function)->isBuiltin()) ret = ((Procedure*)function)->call(valueStack + base, _arguments.size());
+        else ret = jitCall((Lambda*)function, valueStack + base, _arguments.size());
+        if (ret != NULL)
+        {
+            valueStackTop = base;
+            return ret;
+        }
+
+        // The arguments stay on the value stack for callLambda
+        tail->lambda = (Lambda*)function;
+        tail->base = base;
+        return NULL;
+    }
+
+private:
+    friend class JitCompiler;
+
+    Node *_function;
+    vector<Node*> _arguments;
+};
+
+// A call of one of the builtins below, found in a global variable at compile time. As long as the variable still holds
+// the builtin, the common case is handled right here, without a procedure call; anything else, e.g. an argument of the
+// wrong type, is left to the builtin itself, so the error messages stay the same. Local variables shadowing the builtin
+// have been replaced by LocalReferences, and never become PrimitiveNodes.
+enum Primitive
+{
+    primCar, primCdr, primCons, primEq, primFixPlus, primFixMinus, primFixMult, primFixLt, primFixEq, primFloPlus,
+    primFloMinus, primFloMult, primFloDiv, primFloLt, primFloEq, primVectorRef, primStringRef, primPlus, primMinus,
+    primLt, primGt, primLe, primGe, primNumEq, PRIMITIVES
+};
+
+const char *primitiveNames[PRIMITIVES] =
+{
+    "car", "cdr", "cons", "eq?", "fix+", "fix-", "fix*", "fix<", "fix=", "flo+", "flo-", "flo*", "flo/", "flo<", "flo=",
+    "vector-ref", "string-ref", "+", "-", "<", ">", "<=", ">=", "="
+};
+
+class PrimitiveNode: public Node
+{
+public:
+    PrimitiveNode(Primitive primitive, Symbol *symbol, Procedure *procedure, Node *function, const vector<Node*>& arguments):
+        Node(sizeof(PrimitiveNode)),
+        _primitive(primitive),
+        _symbol(symbol),
+        _procedure(procedure),
+        _first(arguments[0]),
+        _second(arguments.size() > 1 ? arguments[1] : NULL),
+        _call(new CallNode(function, arguments))
+    {
+        gcWriteBarrier(_first);
+        gcWriteBarrier(_second);
+        gcWriteBarrier(_call);
+    }
+
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_symbol); dest->push_back(_first); dest->push_back(_second); dest->push_back(_call); }
+
+    Object* exec(Environment *env, TailCall *tail)
+    {
+        if (_symbol->getGlobalValue() != _procedure) return _call->exec(env, tail);
+
+        size_t base = valueStackTop;
+        pushValue(execute(_first, env));
+        if (_second != NULL) pushValue(execute(_second, env));
+        Object *a = valueStack[base];
+        Object *b = _second != NULL ? valueStack[base + 1] : NULL;
+        Object *ret = NULL;
+
+        switch (_primitive)
+        {
+        case primCar: if (::getType(a) == otPair) ret = ((Pair*)a)->_car; break;
+        case primCdr: if (::getType(a) == otPair) ret = ((Pair*)a)->_cdr; break;
+        case primCons: ret = new Pair(a, b); break;
+        case primEq: ret = Boolean::valueOf(a == b); break;
+        case primFixPlus: if (isFixnum(a) && isFixnum(b)) ret = Fixnum::valueOf(Fixnum::getValue(a) + Fixnum::getValue(b)); break;
+        case primFixMinus: if (isFixnum(a) && isFixnum(b)) ret = Fixnum::valueOf(Fixnum::getValue(a) - Fixnum::getValue(b)); break;
+        case primFixMult: if (isFixnum(a) && isFixnum(b)) ret = Fixnum::valueOf(Fixnum::getValue(a) * Fixnum::getValue(b)); break;
+        case primFixLt: if (isFixnum(a) && isFixnum(b)) ret = Boolean::valueOf(Fixnum::getValue(a) < Fixnum::getValue(b)); break;
+        case primFixEq: if (isFixnum(a) && isFixnum(b)) ret = Boolean::valueOf(a == b); break;
+        case primFloPlus: if (bothFlonums(a, b)) ret = new Flonum(((Flonum*)a)->getValue() + ((Flonum*)b)->getValue()); break;
+        case primFloMinus: if (bothFlonums(a, b)) ret = new Flonum(((Flonum*)a)->getValue() - ((Flonum*)b)->getValue()); break;
+        case primFloMult: if (bothFlonums(a, b)) ret = new Flonum(((Flonum*)a)->getValue() * ((Flonum*)b)->getValue()); break;
+        case primFloDiv: if (bothFlonums(a, b)) ret = new Flonum(((Flonum*)a)->getValue() / ((Flonum*)b)->getValue()); break;
+        case primFloLt: if (bothFlonums(a, b)) ret = Boolean::valueOf(((Flonum*)a)->getValue() < ((Flonum*)b)->getValue()); break;
+        case primFloEq: if (bothFlonums(a, b)) ret = Boolean::valueOf(((Flonum*)a)->getValue() == ((Flonum*)b)->getValue()); break;
+        case primVectorRef:
+            if (::getType(a) == otVector && isFixnum(b) && Fixnum::getValue(b) >= 0 && Fixnum::getValue(b) < ((Vector*)a)->getLength())
+                ret = ((Vector*)a)->GetAt(Fixnum::getValue(b));
+            break;
+        case primStringRef:
+            if (::getType(a) == otString && isFixnum(b) && Fixnum::getValue(b) >= 0 && Fixnum::getValue(b) < ((String*)a)->getLength())
+                ret = Char::valueOf(((String*)a)->GetAt(Fixnum::getValue(b)));
+            break;
+        case primPlus: if (isFixnum(a) && isFixnum(b)) ret = fixnumOrNull(Fixnum::getValue(a) + Fixnum::getValue(b)); break;
+        case primMinus: if (isFixnum(a) && isFixnum(b)) ret = fixnumOrNull(Fixnum::getValue(a) - Fixnum::getValue(b)); break;
+        case primLt: if (isFixnum(a) && isFixnum(b)) ret = Boolean::valueOf(Fixnum::getValue(a) < Fixnum::getValue(b)); break;
+        case primGt: if (isFixnum(a) && isFixnum(b)) ret = Boolean::valueOf(Fixnum::getValue(a) > Fixnum::getValue(b)); break;
+        case primLe: if (isFixnum(a) && isFixnum(b)) ret = Boolean::valueOf(Fixnum::getValue(a) <= Fixnum::getValue(b)); break;
+        case primGe: if (isFixnum(a) && isFixnum(b)) ret = Boolean::valueOf(Fixnum::getValue(a) >= Fixnum::getValue(b)); break;
+        case primNumEq: if (isFixnum(a) && isFixnum(b)) ret = Boolean::valueOf(a == b); break;
+        default: break;
+        }
+
+        if (ret == NULL) ret = _procedure->call(valueStack + base, valueStackTop - base);
+        valueStackTop = base;
+        return ret;
+    }
+
+    static size_t getArity(Primitive primitive) { return primitive == primCar || primitive == primCdr ? 1 : 2; }
+
+private:
+    friend class JitCompiler;
+
+    Primitive _primitive;
+    Symbol *_symbol;
+    Procedure *_procedure;
+    Node *_first;
+    Node *_second; // NULL for unary primitives
+    CallNode *_call; // Used instead once the global variable has changed
+
+    static bool bothFlonums(Object *a, Object *b) { return ::getType(a) == otFlonum && ::getType(b) == otFlonum; }
+
+    // Results out of fixnum range are left to the builtin
+    static Object* fixnumOrNull(long value) { return value < FIXNUM_MIN || value > FIXNUM_MAX ? NULL : Fixnum::valueOf(value); }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void collectGarbageHack();
+
+// The environment is kept alive by the caller; it may be a frame, which must not be registered as a GcRoot
+Object* execute(Node *node, Environment *env)
+{
+    GcRoot nodeRoot((Object**)&node);
+    checkCStack();
+    if (needToRunGC) collectGarbageHack();
+    TailCall tail;
+    Object *ret = node->exec(env, &tail);
+    return ret != NULL ? ret : callLambda(tail.lambda, tail.base);
+}
+
+// Calls a lambda with its arguments on the value stack from base up, and pops them. Tail calls made by the lambda are
+// run by the loop here, so they do not take up any C++ stack. Where computeFrameSize allows, the environment of a call
+// is a frame, keeping the arguments right where they have been pushed, so the call allocates nothing.
+Object* callLambda(Lambda *l, size_t base)
+{
+    checkCStack();
+    GcRoot lambdaRoot((Object**)&l);
+    Environment *env = NULL;
+    GcRoot envRoot((Object**)&env);
+    TailCall tail;
+    size_t argumentsBase = base;
+
+    for (;;)
+    {
+        if (needToRunGC) collectGarbageHack();
+        size_t count = valueStackTop - argumentsBase;
+        long frameSize = l->getFrameSize();
+        Object *ret;
+
+        if (frameSize >= 0 && count == l->getArgumentNames()->size())
+        {
+            if (base + frameSize > VALUE_STACK_SIZE) error("Stack overflow");
+            memmove(valueStack + base, valueStack + argumentsBase, count * sizeof(Object*));
+            for (size_t i = base + count; i < base + frameSize; ++i) valueStack[i] = NULL;
+            valueStackTop = base + frameSize;
+            Environment frame(valueStack + base, frameSize, l->getCapturedEnvironment());
+            env = NULL;
+            ret = l->getCode()->exec(&frame, &tail);
+        }
+        else
+        {
+            env = l->getCapturedEnvironment()->extendIntoNew(l->getArgumentNames(), valueStack + argumentsBase, count, l->hasRestParameter());
+            valueStackTop = base;
+            ret = l->getCode()->exec(env, &tail);
+        }
+
+        if (ret != NULL)
+        {
+            valueStackTop = base;
+            return ret;
+        }
+        l = tail.lambda;
+        argumentsBase = tail.base;
+    }
+}
+
+void parseParameters(const char *form, Object *parameters, vector<string> *argumentNames, bool *hasRestParameter)
+{
+    *hasRestParameter = false;
+    for (Object *i = parameters; ; )
+    {
+        if (getType(i) == otNull) break;
+        if (getType(i) != otPair)
+        {
+            if (getType(i) != otSymbol) error((string)"eval: Invalid " + form + " form");
+            argumentNames->push_back(toString(i));
+            *hasRestParameter = true;
+            break;
+        }
+        Pair *p = (Pair*) i;
+        argumentNames->push_back(toString(p->_car));
+        i = p->_cdr;
+    }
+}
+
+// Takes a form after macro expansion and Interpreter::resolve. The syntax of the special forms is checked here once,
+// instead of on every evaluation.
+Node* compile(Object *form)
+{
+    switch (getType(form))
+    {
+    case otNull:
+        error("eval: Empty list can not be evaluated");
+        return NULL; // Just to keep the compiler happy
+
+    case otVector:
+        error("eval: Vector must be quoted");
+        return NULL; // Just to keep the compiler happy
+
+    case otSymbol:
+        return new GlobalReferenceNode((Symbol*)form);
+
+    case otLocalReference:
+        return new LocalReferenceNode((LocalReference*)form);
+
+    case otPair:
+        break;
+
+    default:
+        return new ConstantNode(form);
+    }
+
+    Pair *asPair = (Pair*) form;
+
+    if (asPair->_car == quoteSymbol)
+    {
+        if (getType(asPair->_cdr) != otPair || getType(((Pair*)asPair->_cdr)->_cdr) != otNull)
+            error("eval: Invalid quote form");
+        return new ConstantNode(((Pair*)asPair->_cdr)->_car);
+    }
+
+    if (asPair->_car == ifSymbol)
+    {
+        if (getType(asPair->_cdr) != otPair) error("eval: Invalid if form");
+        Object *condition = ((Pair*)asPair->_cdr)->_car;
+        Object *rest = ((Pair*)asPair->_cdr)->_cdr;
+        if (getType(rest) != otPair) error("eval: Invalid if form");
+        Pair *restAsPair = (Pair*) rest;
+        Object *thenPart = restAsPair->_car;
+        rest = restAsPair->_cdr;
+        if (getType(rest) != otPair) error("eval: Invalid if form");
+        restAsPair = (Pair*) rest;
+        Object *elsePart = restAsPair->_car;
+        if (getType(restAsPair->_cdr) != otNull) error("eval: Invalid if form");
+        return new IfNode(compile(condition), compile(thenPart), compile(elsePart));
+    }
+
+    if (asPair->_car == beginSymbol)
+    {
+        vector<Node*> forms;
+        for (Object *i = asPair->_cdr; ; i = ((Pair*)i)->_cdr)
+        {
+            if (getType(i) == otNull) break;
+            if (getType(i) != otPair) error("eval: Dotted list not allowed in begin form");
+            forms.push_back(compile(((Pair*)i)->_car));
+        }
+        if (forms.empty()) error("eval: Invalid begin form");
+        return forms.size() == 1 ? forms[0] : new BeginNode(forms);
+    }
+
+    if (asPair->_car == lambdaSymbol)
+    {
+        if (getType(asPair->_cdr) != otPair) error("eval: Invalid lambda form");
+        Pair *parametersAndBody = (Pair*) asPair->_cdr;
+        vector<string> argumentNames;
+        bool hasRestParameter;
+        parseParameters("lambda", parametersAndBody->_car, &argumentNames, &hasRestParameter);
+        return new LambdaNode("lambda", parametersAndBody->_cdr, argumentNames, hasRestParameter);
+    }
+
+    if (asPair->_car == defineSymbol)
+    {
+        if (getType(asPair->_cdr) != otPair) error("eval: Invalid define form");
+        Object *whatToDefine = ((Pair*)asPair->_cdr)->_car;
+        Object *definedAs = ((Pair*)asPair->_cdr)->_cdr;
+        Node *value;
+
+        if (getType(whatToDefine) == otPair)
+        {
+            Object *parameters = ((Pair*)whatToDefine)->_cdr;
+            whatToDefine = ((Pair*)whatToDefine)->_car;
+            if (getType(whatToDefine) != otSymbol && getType(whatToDefine) != otLocalReference) error("eval: Invalid define form");
+            vector<string> argumentNames;
+            bool hasRestParameter;
+            parseParameters("define", parameters, &argumentNames, &hasRestParameter);
+            value = new LambdaNode(toString(whatToDefine), definedAs, argumentNames, hasRestParameter);
+        }
+        else
+        {
+            if (getType(definedAs) != otPair || getType(((Pair*)definedAs)->_cdr) != otNull) error("eval: Invalid define form");
+            value = compile(((Pair*)definedAs)->_car);
+        }
+
+        if (getType(whatToDefine) == otSymbol) return new DefineGlobalNode((Symbol*)whatToDefine, value);
+        if (getType(whatToDefine) == otLocalReference) return new DefineLocalNode((LocalReference*)whatToDefine, value);
+        error("eval: Invalid define form");
+    }
+
+    if (asPair->_car == setSymbol)
+    {
+        if (getType(asPair->_cdr) != otPair) error("eval: Invalid set! form");
+        Object *whatToSet = ((Pair*)asPair->_cdr)->_car;
+        Object *definedAs = ((Pair*)asPair->_cdr)->_cdr;
+        if (getType(definedAs) != otPair || getType(((Pair*)definedAs)->_cdr) != otNull) error("eval: Invalid set! form");
+        if (getType(whatToSet) == otSymbol) return new SetGlobalNode((Symbol*)whatToSet, compile(((Pair*)definedAs)->_car));
+        if (getType(whatToSet) == otLocalReference) return new SetLocalNode((LocalReference*)whatToSet, compile(((Pair*)definedAs)->_car));
+        error("eval: Invalid set! form");
+    }
+
+    Node *function = compile(asPair->_car);
+    vector<Node*> arguments;
+    for (Object *i = asPair->_cdr; ; i = ((Pair*)i)->_cdr)
+    {
+        if (getType(i) == otNull) break;
+        if (getType(i) != otPair) error("eval: Dotted list not allowed in function call");
+        arguments.push_back(compile(((Pair*)i)->_car));
+    }
+
+    Object *value = getType(asPair->_car) == otSymbol ? ((Symbol*)asPair->_car)->getGlobalValue() : NULL;
+    if (value != NULL && getType(value) == otProcedure && ((Procedure*)value)->isBuiltin() && !((Procedure*)value)->isCompiled())
+    {
+        string name = ((Procedure*)value)->getName();
+        for (int i = 0; i < PRIMITIVES; ++i)
+            if (name == primitiveNames[i] && arguments.size() == PrimitiveNode::getArity((Primitive)i))
+                return new PrimitiveNode((Primitive)i, (Symbol*)asPair->_car, (Procedure*)value, function, arguments);
+    }
+    return new CallNode(function, arguments);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// A virtual machine running the register machine code emitted by compile in init.scm, see the description there. The
+// statements are assembled into words: An opcode followed by its operands. Labels become word offsets, and variables
+// are resolved to slots of the environments of the compiled closures where possible, just like Interpreter::resolve
+// does for forms. Before the first run, the opcodes are replaced by the addresses of their implementations, so the
+// main loop dispatches with a single indirect jump (direct threading, with a switch as the fallback where computed
+// goto is not available).
+enum Opcode
+{
+    opArgsToValue, opBranchIfTrue, opCall, opContinue, opDefineLocal, opDefineGlobal, opGetLocal, opGetGlobal,
+    opSetLocal, opSetGlobal, opGoto, opInitArgs, opLoadConstant, opLoadContinue, opMakeClosure, opPushParam,
+    opRestoreRegisters, opSaveRegisters, opValueToArgs, OPCODES
+};
+
+const int opcodeOperands[OPCODES] = { 0, 1, 0, 0, 1, 1, 3, 1, 3, 1, 1, 0, 1, 1, 1, 0, 0, 0, 0 };
+
+struct ClosureTemplate
+{
+    string name;
+    long entry;
+    vector<string> argumentNames;
+    bool hasRest;
+};
+
+class Code: public Object
+{
+public:
+    vector<long> _words;
+    vector<Object*> _constants;
+    vector<ClosureTemplate> _closures;
+    vector<const void*> _threaded;
+
+    Code(): Object(otCode, sizeof(Code)) { }
+    ObjectType getType() const { return otCode; }
+    string toString() const { return "<code>"; }
+    void getReferences(vector<Object*> *dest) const { dest->insert(dest->end(), _constants.begin(), _constants.end()); }
+
+    long addConstant(Object *o)
+    {
+        gcWriteBarrier(o);
+        _constants.push_back(o);
+        return _constants.size() - 1;
+    }
+};
+
+Object* runCode(Code *code, long pc, Environment *env);
+
+// A closure created by make-closure. It is called like a builtin, which runs the virtual machine.
+class CompiledProcedure: public Procedure
+{
+public:
+    CompiledProcedure(const string& name, Code *code, long closure, Environment *env):
+        Procedure(name, sizeof(CompiledProcedure)), _code(code), _closure(closure), _env(env)
+    {
+        gcWriteBarrier(code);
+        gcWriteBarrier(env);
+    }
+
+    Object* call(Object **arguments, size_t count) { return runCode(_code, getTemplate()->entry, extendEnvironment(arguments, count)); }
+
+    Environment* extendEnvironment(Object **arguments, size_t count) const
+    {
+        return _env->extendIntoNew(&getTemplate()->argumentNames, arguments, count, getTemplate()->hasRest);
+    }
+
+    virtual bool isCompiled() const { return true; }
+    virtual bool hasRestParameter() const { return getTemplate()->hasRest; }
+    virtual const vector<string>* getArgumentNames() const { return &getTemplate()->argumentNames; }
+    const ClosureTemplate* getTemplate() const { return &_code->_closures[_closure]; }
+    Code *getCode() const { return _code; }
+    void getReferences(vector<Object*> *dest) const { dest->push_back(_code); dest->push_back(_env); }
+    bool gcIgnore() { return false; }
+
+private:
+    friend class ImageReader;
+    friend class ImageWriter;
+
+    Code *_code;
+    long _closure;
+    Environment *_env;
+};
+
+class Assembler
+{
+public:
+    Assembler(Object *statements)
+    {
+        for (Object *i = statements; getType(i) == otPair; i = ((Pair*)i)->_cdr)
+        {
+            Object *statement = ((Pair*)i)->_car;
+            if (getType(statement) != otPair || getType(((Pair*)statement)->_car) != otSymbol)
+                error("sys:execute: Invalid statement " + toString(statement));
+            _statements.push_back((Pair*)statement);
+            if (getName(_statements.size() - 1) == "label") _labels[getOperand(_statements.size() - 1, 0)] = _statements.size() - 1;
+        }
+    }
+
+    Code* assemble()
+    {
+        _code = new Code();
+        findScopes();
+        for (size_t i = 0; i < _statements.size(); ++i) assembleStatement(i);
+        _code->_words.push_back(opContinue);
+
+        for (size_t i = 0; i < _fixups.size(); ++i) _code->_words[_fixups[i].first] = getLabelOffset(_fixups[i].second);
+        for (size_t i = 0; i < _code->_closures.size(); ++i) _code->_closures[i].entry = getLabelOffset(_closureLabels[i]);
+        return _code;
+    }
+
+private:
+    // The variables of the body of a closure. Its parent is the scope the closure is created in, -1 being global.
+    struct Scope
+    {
+        long parent;
+        vector<Symbol*> variables;
+        Object *endLabel;
+    };
+
+    vector<Pair*> _statements;
+    map<Object*, size_t> _labels;
+    vector<long> _statementScopes;
+    vector<Scope> _scopes;
+    Code *_code;
+    map<Object*, long> _labelOffsets;
+    vector<pair<size_t, Object*> > _fixups;
+    vector<Object*> _closureLabels;
+
+    string getName(size_t statement) { return ((Symbol*)_statements[statement]->_car)->getName(); }
+
+    Object* getOperand(size_t statement, int index)
+    {
+        Object *i = _statements[statement]->_cdr;
+        for (; index > 0 && getType(i) == otPair; --index) i = ((Pair*)i)->_cdr;
+        if (getType(i) != otPair) error("sys:execute: Missing operand in " + toString(_statements[statement]));
+        return ((Pair*)i)->_car;
+    }
+
+    long getLabelOffset(Object *label)
+    {
+        if (!_labelOffsets.count(label)) error("sys:execute: Unknown label " + toString(label));
+        return _labelOffsets[label];
+    }
+
+    // The body of a closure starts at its label and ends at the label after it, which the goto in front of the body
+    // jumps to
+    void findScopes()
+    {
+        map<Object*, pair<long, Object*> > pendingClosures;
+        long current = -1;
+        for (size_t i = 0; i < _statements.size(); ++i)
+        {
+            string name = getName(i);
+            if (name == "label")
+            {
+                Object *label = getOperand(i, 0);
+                if (current >= 0 && _scopes[current].endLabel == label) current = _scopes[current].parent;
+                if (pendingClosures.count(label))
+                {
+                    if (i == 0 || getName(i - 1) != "goto") error("sys:execute: Closure body must follow a goto");
+                    Scope scope;
+                    scope.parent = pendingClosures[label].first;
+                    scope.endLabel = getOperand(i - 1, 0);
+                    for (Object *j = pendingClosures[label].second; getType(j) == otPair; j = ((Pair*)j)->_cdr)
+                        if (getType(((Pair*)j)->_car) == otSymbol) scope.variables.push_back((Symbol*)((Pair*)j)->_car);
+                    _scopes.push_back(scope);
+                    current = _scopes.size() - 1;
+                }
+            }
+            else if (name == "make-closure")
+            {
+                pendingClosures[getOperand(i, 1)] = make_pair(current, getOperand(i, 3));
+            }
+            else if (name == "define-variable" && current >= 0)
+            {
+                Object *variable = getOperand(i, 0);
+                if (getType(variable) != otSymbol) error("sys:execute: Variable name must be a symbol");
+                if (findVariable((Symbol*)variable, &_scopes[current].variables) < 0) _scopes[current].variables.push_back((Symbol*)variable);
+            }
+            _statementScopes.push_back(current);
+        }
+    }
+
+    long findVariable(Symbol *symbol, const vector<Symbol*> *variables)
+    {
+        for (long i = (long)variables->size() - 1; i >= 0; --i)
+            if (variables->at(i) == symbol) return i;
+        return -1;
+    }
+
+    // Emits the local or the global version of an opcode accessing a variable
+    void assembleVariable(size_t statement, Opcode localOpcode, Opcode globalOpcode)
+    {
+        Object *variable = getOperand(statement, 0);
+        if (getType(variable) != otSymbol) error("sys:execute: Variable name must be a symbol");
+
+        long depth = 0;
+        for (long scope = _statementScopes[statement]; scope >= 0; scope = _scopes[scope].parent, ++depth)
+        {
+            long index = findVariable((Symbol*)variable, &_scopes[scope].variables);
+            if (index < 0) continue;
+            _code->_words.push_back(localOpcode);
+            if (localOpcode != opDefineLocal) _code->_words.push_back(depth);
+            _code->_words.push_back(index);
+            if (localOpcode != opDefineLocal) _code->_words.push_back(_code->addConstant(variable));
+            return;
+        }
+        _code->_words.push_back(globalOpcode);
+        _code->_words.push_back(_code->addConstant(variable));
+    }
+
+    void assembleJump(size_t statement, Opcode opcode)
+    {
+        _code->_words.push_back(opcode);
+        _fixups.push_back(make_pair(_code->_words.size(), getOperand(statement, 0)));
+        _code->_words.push_back(0);
+    }
+
+    void assembleStatement(size_t i)
+    {
+        string name = getName(i);
+        vector<long> *words = &_code->_words;
+
+        if (name == "label") _labelOffsets[getOperand(i, 0)] = words->size();
+        else if (name == "args->value") words->push_back(opArgsToValue);
+        else if (name == "branch-if-true") assembleJump(i, opBranchIfTrue);
+        else if (name == "call") words->push_back(opCall);
+        else if (name == "continue") words->push_back(opContinue);
+        else if (name == "define-variable") assembleVariable(i, opDefineLocal, opDefineGlobal);
+        else if (name == "get-variable") assembleVariable(i, opGetLocal, opGetGlobal);
+        else if (name == "set-variable") assembleVariable(i, opSetLocal, opSetGlobal);
+        else if (name == "goto") assembleJump(i, opGoto);
+        else if (name == "init-args") words->push_back(opInitArgs);
+        else if (name == "load-continue") assembleJump(i, opLoadContinue);
+        else if (name == "push-param") words->push_back(opPushParam);
+        else if (name == "restore-registers") words->push_back(opRestoreRegisters);
+        else if (name == "save-registers") words->push_back(opSaveRegisters);
+        else if (name == "value->args") words->push_back(opValueToArgs);
+        else if (name == "load-constant")
+        {
+            words->push_back(opLoadConstant);
+            words->push_back(_code->addConstant(getOperand(i, 0)));
+        }
+        else if (name == "make-closure")
+        {
+            ClosureTemplate closure;
+            Object *closureName = getOperand(i, 0);
+            closure.name = getType(closureName) == otString ? ((String*)closureName)->getValue() : toString(closureName);
+            closure.entry = 0;
+            closure.hasRest = getOperand(i, 2) != Boolean::getFalse();
+            for (Object *j = getOperand(i, 3); getType(j) == otPair; j = ((Pair*)j)->_cdr) closure.argumentNames.push_back(toString(((Pair*)j)->_car));
+            _code->_closures.push_back(closure);
+            _closureLabels.push_back(getOperand(i, 1));
+            words->push_back(opMakeClosure);
+            words->push_back(_code->_closures.size() - 1);
+        }
+        else error("sys:execute: Unknown statement " + name);
+    }
+};
+
+#ifdef __GNUC__
+#define VM_OP(name) name##Label:
+#define VM_NEXT() goto *ops[pc++]
+#else
+#define VM_OP(name) case name:
+#define VM_NEXT() continue
+#endif
+#define VM_OPERAND() ((long)(size_t)ops[pc++])
+
+// Runs code from pc on, until it continues to -1. The args register holds a Scheme list, as push-param builds it.
+Object* runCode(Code *code, long pc, Environment *env)
+{
+#ifdef __GNUC__
+    static const void *labels[OPCODES] =
+    {
+        &&opArgsToValueLabel, &&opBranchIfTrueLabel, &&opCallLabel, &&opContinueLabel, &&opDefineLocalLabel,
+        &&opDefineGlobalLabel, &&opGetLocalLabel, &&opGetGlobalLabel, &&opSetLocalLabel, &&opSetGlobalLabel,
+        &&opGotoLabel, &&opInitArgsLabel, &&opLoadConstantLabel, &&opLoadContinueLabel, &&opMakeClosureLabel,
+        &&opPushParamLabel, &&opRestoreRegistersLabel, &&opSaveRegistersLabel, &&opValueToArgsLabel
+    };
+#endif
+
+    if (code->_threaded.empty())
+    {
+        for (size_t i = 0; i < code->_words.size(); )
+        {
+            long opcode = code->_words[i];
+#ifdef __GNUC__
+            code->_threaded.push_back(labels[opcode]);
+#else
+            code->_threaded.push_back((const void*)(size_t)opcode);
+#endif
+            for (int j = 0; j < opcodeOperands[opcode]; ++j) code->_threaded.push_back((const void*)(size_t)code->_words[i + 1 + j]);
+            i += 1 + opcodeOperands[opcode];
+        }
+    }
+
+    const void * const *ops = &code->_threaded[0];
+    Object *value = undefinedSymbol;
+    Object *args = Null::getInstance();
+    long continueRegister = -1;
+    vector<Object*> stack;
+    vector<long> continueStack;
+    GcRoot codeRoot((Object**)&code);
+    GcRoot envRoot((Object**)&env);
+    GcRoot valueRoot(&value);
+    GcRoot argsRoot(&args);
+    GcParameterRoot stackRoot(&stack);
+
+#ifdef __GNUC__
+    VM_NEXT();
+#else
+    for (;;) switch ((size_t)ops[pc++]) {
+#endif
+
+    VM_OP(opArgsToValue)
+        value = args;
+        VM_NEXT();
+
+    VM_OP(opBranchIfTrue)
+        {
+            long target = VM_OPERAND();
+            if (value != Boolean::getFalse()) pc = target;
+        }
+        VM_NEXT();
+
+    VM_OP(opCall)
+        {
+            if (needToRunGC) collectGarbageHack();
+            if (getType(value) != otProcedure) error("eval: '" + toString(value) + "' is not callable");
+            Procedure *proc = (Procedure*) value;
+            size_t base = valueStackTop;
+            for (Object *i = args; getType(i) == otPair; i = ((Pair*)i)->_cdr) pushValue(((Pair*)i)->_car);
+            size_t count = valueStackTop - base;
+            args = Null::getInstance();
+
+            if (proc->isCompiled() && ((CompiledProcedure*)proc)->getCode() == code)
+            {
+                env = ((CompiledProcedure*)proc)->extendEnvironment(valueStack + base, count);
+                valueStackTop = base;
+                pc = ((CompiledProcedure*)proc)->getTemplate()->entry;
+                VM_NEXT();
+            }
+
+            if (proc->isBuiltin())
+            {
+                value = proc->call(valueStack + base, count);
+                valueStackTop = base;
+            }
+            else
+            {
+                value = callLambda((Lambda*) proc, base);
+            }
+        }
+        goto vmContinue;
+
+    VM_OP(opContinue)
+    vmContinue:
+        if (continueRegister < 0) return value;
+        pc = continueRegister;
+        VM_NEXT();
+
+    VM_OP(opDefineLocal)
+        env->defineSlot(VM_OPERAND(), value);
+        value = undefinedSymbol;
+        VM_NEXT();
+
+    VM_OP(opDefineGlobal)
+        env->define((Symbol*)code->_constants[VM_OPERAND()], value);
+        value = undefinedSymbol;
+        VM_NEXT();
+
+    VM_OP(opGetLocal)
+        {
+            long depth = VM_OPERAND();
+            long index = VM_OPERAND();
+            long symbol = VM_OPERAND();
+            value = env->getSlot(depth, index);
+            if (value == NULL) error("Unknown variable '" + toString(code->_constants[symbol]) + "'");
+        }
+        VM_NEXT();
+
+    VM_OP(opGetGlobal)
+        value = env->get((Symbol*)code->_constants[VM_OPERAND()]);
+        VM_NEXT();
+
+    VM_OP(opSetLocal)
+        {
+            long depth = VM_OPERAND();
+            long index = VM_OPERAND();
+            long symbol = VM_OPERAND();
+            if (!env->setSlot(depth, index, value)) error("Unknown variable '" + toString(code->_constants[symbol]) + "'");
+            value = undefinedSymbol;
+        }
+        VM_NEXT();
+
+    VM_OP(opSetGlobal)
+        env->set((Symbol*)code->_constants[VM_OPERAND()], value);
+        value = undefinedSymbol;
+        VM_NEXT();
+
+    VM_OP(opGoto)
+        {
+            long target = VM_OPERAND();
+            pc = target;
+        }
+        VM_NEXT();
+
+    VM_OP(opInitArgs)
+        args = Null::getInstance();
+        VM_NEXT();
+
+    VM_OP(opLoadConstant)
+        value = code->_constants[VM_OPERAND()];
+        VM_NEXT();
+
+    VM_OP(opLoadContinue)
+        continueRegister = VM_OPERAND();
+        VM_NEXT();
+
+    VM_OP(opMakeClosure)
+        {
+            long closure = VM_OPERAND();
+            value = new CompiledProcedure(code->_closures[closure].name, code, closure, env);
+        }
+        VM_NEXT();
+
+    VM_OP(opPushParam)
+        args = new Pair(value, args);
+        VM_NEXT();
+
+    VM_OP(opRestoreRegisters)
+        if (continueStack.empty()) error("sys:execute: Stack underflow");
+        env = (Environment*) stack.back();
+        stack.pop_back();
+        args = stack.back();
+        stack.pop_back();
+        continueRegister = continueStack.back();
+        continueStack.pop_back();
+        VM_NEXT();
+
+    VM_OP(opSaveRegisters)
+        stack.push_back(args);
+        stack.push_back(env);
+        continueStack.push_back(continueRegister);
+        VM_NEXT();
+
+    VM_OP(opValueToArgs)
+        args = value;
+        VM_NEXT();
+
+#ifndef __GNUC__
+    }
+#endif
+}
+
+#undef VM_OP
+#undef VM_NEXT
+#undef VM_OPERAND
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// A baseline JIT compiler, turning the nodes of a lambda into x86-64 machine code once it has been called
+// JIT_CALL_THRESHOLD times. Only lambdas computing a value from their arguments are compiled: Their bodies may consist
+// of constants, their own arguments, global variables, ifs, calls to themselves, and calls to the builtins fix+, fix-,
+// fix<, fix=, eq?, car, cdr and cons, which are inlined. Such a body has no side effects, so whenever the machine code
+// finds something it does not handle, e.g. an argument of the wrong type or a global variable that has changed, it
+// simply gives up, and the interpreter evaluates the call once more. That is called a deoptimization; after
+// JIT_MAX_DEOPTIMIZATIONS of them, the machine code is thrown away.
+//
+// The machine code is called with a pointer to the arguments, which are kept in that array, not in an environment.
+// Self tail calls overwrite the arguments and jump back to the start of the body. As the code does not call back into
+// the interpreter, no garbage collection can happen while it runs; if one is due at a self tail call, the code returns
+// to the interpreter, which continues with the current arguments. Self calls that are not tail calls nest on the C++
+// stack, so every call compares the stack pointer with cStackLimit and reports a stack overflow like checkCStack.
+bool jitEnabled = true;
+
+typedef Object *(*NativeFunction)(Object **arguments);
+
+struct NativeCode
+{
+    NativeFunction entry;
+    void *memory;
+    size_t size;
+    long deoptimizations;
+};
+
+void releaseNativeCode(NativeCode *native)
+{
+    if (native == NULL) return;
+    munmap(native->memory, native->size);
+    delete native;
+}
+
+// Returned by machine code that stopped for a garbage collection. Deoptimizations return NULL.
+char jitBailoutMarker[8] __attribute__((aligned(8)));
+
+// Returned by machine code whose self calls ran into cStackLimit, the limit checkCStack uses
+char jitStackOverflowMarker[8] __attribute__((aligned(8)));
+
+Object *jitCons(Object *car, Object *cdr) { return new Pair(car, cdr); }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+class JitCompiler
+{
+public:
+    JitCompiler(Lambda *l): _lambda(l), _argumentCount(l->_argumentNames.size()), _pushed(0) { }
+
+    // Returns NULL if the lambda can not be compiled
+    NativeCode* compile()
+    {
+        if (_lambda->_hasRest) return NULL;
+
+        Pair *samplePair = new Pair(NULL, NULL);
+        _pairVtable = *(size_t*)samplePair;
+        _carOffset = (char*)&samplePair->_car - (char*)samplePair;
+        _cdrOffset = (char*)&samplePair->_cdr - (char*)samplePair;
+
+        emit(0x55);                         // push rbp
+        emit(0x48); emit(0x89); emit(0xe5); // mov rbp, rsp
+        emit(0x53);                         // push rbx
+        emit(0x48); emit(0x83); emit(0xec); emit(0x08); // sub rsp, 8 (aligns the stack to 16 bytes)
+        emit(0x48); emit(0x89); emit(0xfb); // mov rbx, rdi
+        moveImmediate((size_t)&cStackLimit);
+        emit(0x48); emit(0x8b); emit(0x00); // mov rax, [rax]
+        emit(0x48); emit(0x39); emit(0xc4); // cmp rsp, rax
+        size_t stackOverflow = jump(0x0f82); // jb
+        _bodyStart = _code.size();
+
+        if (!compileNode(_lambda->getCode(), true)) return NULL;
+
+        size_t epilogue = _code.size();
+        emit(0x48); emit(0x8d); emit(0x65); emit(0xf8); // lea rsp, [rbp - 8]
+        emit(0x5b);                         // pop rbx
+        emit(0x5d);                         // pop rbp
+        emit(0xc3);                         // ret
+
+        for (size_t i = 0; i < _deoptimizations.size(); ++i) patch(_deoptimizations[i]);
+        emit(0x31); emit(0xc0);             // xor eax, eax
+        jump(0xe9, epilogue);
+
+        for (size_t i = 0; i < _bailouts.size(); ++i) patch(_bailouts[i]);
+        moveImmediate((size_t)jitBailoutMarker);
+        jump(0xe9, epilogue);
+
+        patch(stackOverflow);
+        moveImmediate((size_t)jitStackOverflowMarker);
+        jump(0xe9, epilogue);
+        for (size_t i = 0; i < _stackOverflows.size(); ++i) patchTo(_stackOverflows[i], epilogue);
+
+        size_t size = (_code.size() + 4095) / 4096 * 4096;
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return NULL;
+        memcpy(memory, &_code[0], _code.size());
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) { munmap(memory, size); return NULL; }
+
+        NativeCode *ret = new NativeCode();
+        memcpy(&ret->entry, &memory, sizeof(void*));
+        ret->memory = memory;
+        ret->size = size;
+        ret->deoptimizations = 0;
+        return ret;
+    }
+
+private:
+    Lambda *_lambda;
+    size_t _argumentCount;
+    long _pushed; // Words pushed since the prologue, which left the stack aligned
+    vector<unsigned char> _code;
+    size_t _bodyStart;
+    vector<size_t> _deoptimizations;
+    vector<size_t> _bailouts;
+    vector<size_t> _stackOverflows; // Return the marker of a nested call unchanged
+    size_t _pairVtable;
+    long _carOffset;
+    long _cdrOffset;
+
+    void emit(int byte) { _code.push_back((unsigned char)byte); }
+    void emit32(long value) { for (int i = 0; i < 4; ++i) emit((value >> (8 * i)) & 0xff); }
+    void emit64(size_t value) { for (int i = 0; i < 8; ++i) emit((value >> (8 * i)) & 0xff); }
+
+    void moveImmediate(size_t value) { emit(0x48); emit(0xb8); emit64(value); }          // mov rax, value
+    void moveImmediateToRcx(size_t value) { emit(0x48); emit(0xb9); emit64(value); }     // mov rcx, value
+    void push() { emit(0x50); ++_pushed; }                                              // push rax
+    void popRcx() { emit(0x59); --_pushed; }                                            // pop rcx
+    void popRax() { emit(0x58); --_pushed; }                                            // pop rax
+
+    // Emits a jump with a 32 bit displacement, returning the position of the displacement. The opcode is a single
+    // byte, or two bytes (0x0f 0x8?) for conditional jumps.
+    size_t jump(int opcode)
+    {
+        if (opcode > 0xff) emit(opcode >> 8);
+        emit(opcode & 0xff);
+        emit32(0);
+        return _code.size() - 4;
+    }
+
+    void jump(int opcode, size_t target) { patchTo(jump(opcode), target); }
+
+    void patch(size_t displacement) { patchTo(displacement, _code.size()); }
+
+    void patchTo(size_t displacement, size_t target)
+    {
+        long relative = (long)target - (long)(displacement + 4);
+        for (int i = 0; i < 4; ++i) _code[displacement + i] = (relative >> (8 * i)) & 0xff;
+    }
+
+    void deoptimizeIf(int opcode) { _deoptimizations.push_back(jump(opcode)); }
+
+    // Deoptimizes unless the global variable still has the value it had at compile time
+    void guardGlobal(Symbol *symbol, Object *expected)
+    {
+        moveImmediate((size_t)&symbol->_globalValue);
+        emit(0x48); emit(0x8b); emit(0x00); // mov rax, [rax]
+        moveImmediateToRcx((size_t)expected);
+        emit(0x48); emit(0x39); emit(0xc8); // cmp rax, rcx
+        deoptimizeIf(0x0f85);               // jne
+    }
+
+    bool compileNode(Node *node, bool tail)
+    {
+        if (ConstantNode *n = dynamic_cast<ConstantNode*>(node))
+        {
+            moveImmediate((size_t)n->_value);
+            return true;
+        }
+
+        if (LocalReferenceNode *n = dynamic_cast<LocalReferenceNode*>(node))
+        {
+            if (n->_depth != 0 || n->_index >= _argumentCount) return false;
+            emit(0x48); emit(0x8b); emit(0x83); emit32(8 * n->_index); // mov rax, [rbx + 8 * index]
+            return true;
+        }
+
+        if (GlobalReferenceNode *n = dynamic_cast<GlobalReferenceNode*>(node))
+        {
+            moveImmediate((size_t)&n->_symbol->_globalValue);
+            emit(0x48); emit(0x8b); emit(0x00); // mov rax, [rax]
+            emit(0x48); emit(0x85); emit(0xc0); // test rax, rax
+            deoptimizeIf(0x0f84);               // jz
+            return true;
+        }
+
+        if (IfNode *n = dynamic_cast<IfNode*>(node))
+        {
+            if (!compileNode(n->_condition, false)) return false;
+            emit(0x48); emit(0x83); emit(0xf8); emit((size_t)Boolean::getFalse()); // cmp rax, #f
+            size_t toElse = jump(0x0f84);       // je
+            if (!compileNode(n->_then, tail)) return false;
+            size_t toEnd = jump(0xe9);          // jmp
+            patchTo(toElse, _code.size());
+            if (!compileNode(n->_else, tail)) return false;
+            patchTo(toEnd, _code.size());
+            return true;
+        }
+
+        if (PrimitiveNode *n = dynamic_cast<PrimitiveNode*>(node)) return compilePrimitive(n);
+        if (CallNode *n = dynamic_cast<CallNode*>(node)) return compileCall(n, tail);
+
+        return false;
+    }
+
+    bool compileCall(CallNode *n, bool tail)
+    {
+        GlobalReferenceNode *function = dynamic_cast<GlobalReferenceNode*>(n->_function);
+        if (function == NULL || function->_symbol->_globalValue != _lambda) return false;
+        return compileSelfCall(n, function->_symbol, tail);
+    }
+
+    bool compilePrimitive(PrimitiveNode *n)
+    {
+        Primitive primitive = n->_primitive;
+        if (primitive != primCar && primitive != primCdr && primitive != primCons && primitive != primEq &&
+            primitive != primFixPlus && primitive != primFixMinus && primitive != primFixLt && primitive != primFixEq)
+            return false;
+
+        guardGlobal(n->_symbol, n->_procedure);
+
+        if (n->_second == NULL)
+        {
+            if (!compileNode(n->_first, false)) return false;
+            emit(0xa8); emit(0x03);             // test al, 3
+            deoptimizeIf(0x0f85);               // jnz
+            emit(0x48); emit(0xba); emit64(_pairVtable); // mov rdx, vtable of Pair
+            emit(0x48); emit(0x39); emit(0x10); // cmp [rax], rdx
+            deoptimizeIf(0x0f85);               // jne
+            emit(0x48); emit(0x8b); emit(0x80); emit32(primitive == primCar ? _carOffset : _cdrOffset); // mov rax, [rax + offset]
+            return true;
+        }
+
+        if (!compileNode(n->_first, false)) return false;
+        push();
+        if (!compileNode(n->_second, false)) return false;
+        emit(0x48); emit(0x89); emit(0xc1);     // mov rcx, rax
+        popRax();
+
+        if (primitive == primCons)
+        {
+            emit(0x48); emit(0x89); emit(0xce); // mov rsi, rcx
+            emit(0x48); emit(0x89); emit(0xc7); // mov rdi, rax
+            if (_pushed % 2 != 0) { emit(0x48); emit(0x83); emit(0xec); emit(0x08); } // sub rsp, 8
+            moveImmediate((size_t)&jitCons);
+            emit(0xff); emit(0xd0);             // call rax
+            if (_pushed % 2 != 0) { emit(0x48); emit(0x83); emit(0xc4); emit(0x08); } // add rsp, 8
+            return true;
+        }
+
+        if (primitive != primEq)
+        {
+            emit(0x48); emit(0x89); emit(0xc2); // mov rdx, rax
+            emit(0x48); emit(0x21); emit(0xca); // and rdx, rcx
+            emit(0xf6); emit(0xc2); emit(0x01); // test dl, 1
+            deoptimizeIf(0x0f84);               // jz
+        }
+
+        if (primitive == primFixPlus)
+        {
+            emit(0x48); emit(0x01); emit(0xc8); // add rax, rcx
+            emit(0x48); emit(0x83); emit(0xe8); emit(0x01); // sub rax, 1
+        }
+        else if (primitive == primFixMinus)
+        {
+            emit(0x48); emit(0x29); emit(0xc8); // sub rax, rcx
+            emit(0x48); emit(0x83); emit(0xc0); emit(0x01); // add rax, 1
+        }
+        else
+        {
+            emit(0x48); emit(0x39); emit(0xc8); // cmp rax, rcx
+            emit(0x0f); emit(primitive == primFixLt ? 0x9c : 0x94); emit(0xc2); // setl dl / sete dl
+            emit(0x0f); emit(0xb6); emit(0xd2); // movzx edx, dl
+            emit(0xc1); emit(0xe2); emit(0x04); // shl edx, 4
+            emit(0x8d); emit(0x42); emit((size_t)Boolean::getFalse()); // lea eax, [rdx + #f]
+        }
+        return true;
+    }
+
+    // The arguments are evaluated from right to left, so that they end up on the stack in the right order
+    bool compileSelfCall(CallNode *n, Symbol *symbol, bool tail)
+    {
+        size_t count = n->_arguments.size();
+        if (count != _argumentCount) return false;
+        guardGlobal(symbol, _lambda);
+
+        bool padding = !tail && (_pushed + count) % 2 != 0;
+        if (padding) { emit(0x48); emit(0x83); emit(0xec); emit(0x08); ++_pushed; } // sub rsp, 8
+        for (long i = count - 1; i >= 0; --i)
+        {
+            if (!compileNode(n->_arguments[i], false)) return false;
+            push();
+        }
+
+        if (tail)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                popRax();
+                emit(0x48); emit(0x89); emit(0x83); emit32(8 * i); // mov [rbx + 8 * i], rax
+            }
+            moveImmediate((size_t)&needToRunGC);
+            emit(0x80); emit(0x38); emit(0x00); // cmp byte [rax], 0
+            _bailouts.push_back(jump(0x0f85)); // jne
+            jump(0xe9, _bodyStart);
+            return true;
+        }
+
+        emit(0x48); emit(0x89); emit(0xe7);     // mov rdi, rsp
+        jump(0xe8, 0);                          // call (the start of this function)
+        emit(0x48); emit(0x81); emit(0xc4); emit32(8 * (count + padding)); // add rsp, 8 * (count + padding)
+        _pushed -= count + padding;
+        emit(0x48); emit(0x85); emit(0xc0);     // test rax, rax
+        deoptimizeIf(0x0f84);                   // jz
+        moveImmediateToRcx((size_t)jitBailoutMarker);
+        emit(0x48); emit(0x39); emit(0xc8);     // cmp rax, rcx
+        _bailouts.push_back(jump(0x0f84));      // je
+        moveImmediateToRcx((size_t)jitStackOverflowMarker);
+        emit(0x48); emit(0x39); emit(0xc8);     // cmp rax, rcx
+        _stackOverflows.push_back(jump(0x0f84)); // je
+        return true;
+    }
+};
+
+#else
+
+class JitCompiler
+{
+public:
+    JitCompiler(Lambda *l) { }
+    NativeCode* compile() { return NULL; }
+};
+
+#endif
+
+// Runs the native code of a lambda, compiling it first once it is called often enough. Returns NULL if the
+// interpreter has to evaluate the call.
+Object* jitCall(Lambda *l, Object **arguments, size_t count)
+{
+    if (!jitEnabled || l->_calls < 0) return NULL;
+    if (l->_native == NULL)
+    {
+        if (++l->_calls < JIT_CALL_THRESHOLD) return NULL;
+        l->_native = JitCompiler(l).compile();
+        if (l->_native == NULL) { l->_calls = -1; return NULL; }
+    }
+    if (count != l->_argumentNames.size()) return NULL;
+
+    Object *ret = l->_native->entry(arguments);
+    if (ret == (Object*)jitBailoutMarker) return NULL;
+    if (ret == (Object*)jitStackOverflowMarker) error("Stack overflow");
+    if (ret == NULL && ++l->_native->deoptimizations >= JIT_MAX_DEOPTIMIZATIONS)
+    {
+        releaseNativeCode(l->_native);
+        l->_native = NULL;
+        l->_calls = -1;
+    }
+    return ret;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// The reader scans a buffer of bytes in place, usually a mapped source file. Every byte is classified by one table
+// lookup, small integers and flonums are parsed without copying them, and symbols are interned straight from the
+// buffer.
+enum CharacterClass { ccWhitespace = 1, ccTokenEnd = 2, ccDigit = 4, ccPeriod = 8, ccSlash = 16, ccAlpha = 32 };
+
+struct CharacterClasses
+{
+    unsigned char table[256];
+
+    CharacterClasses()
+    {
+        for (int c = 0; c < 256; ++c)
+            table[c] = (isspace(c) ? ccWhitespace | ccTokenEnd : 0) | (c == ')' ? ccTokenEnd : 0) | (isdigit(c) ? ccDigit : 0)
+                | (c == '.' ? ccPeriod : 0) | (c == '/' ? ccSlash : 0) | (isalpha(c) ? ccAlpha : 0);
+    }
+
+    int operator[](char c) const { return table[(unsigned char)c]; }
+} characterClasses;
+
+class Reader
+{
+public:
+    Reader(const char *data, size_t length):
+        _position(data),
+        _end(data + length),
+        dot((Object*) Symbol::fromString(".")),
+        listEnd((Object*) Symbol::fromString(")"))
+    {
+    }
+
+    Object *read(bool throwOnEof = true)
+    {
+        skipWhitespace();
+        
+        if (isEof())
+        {
+            if (throwOnEof) error("Unexpected end of input stream");
+            return (Object*) Eof::getInstance();
+        }
+
+        switch (peekChar())
+        {
+            case ';':
+                skipComment();
+                return read(throwOnEof);
+            case '\'':
+                readChar();
+                return (Object*) new Pair((Object*) quoteSymbol, (Object*) new Pair(read(), (Object*) Null::getInstance()));
+            case '`':
+                readChar();
+                return (Object*) new Pair((Object*) quasiquoteSymbol, (Object*) new Pair(read(), (Object*) Null::getInstance()));
+            case ',':
+                readChar();
+                return (Object*) new Pair((Object*) unquoteSymbol, (Object*) new Pair(read(), (Object*) Null::getInstance()));
+            case '(':
+                return readList();
+            case '"':
+                return readString();
+            case '#':
+                return readSpecial();
+            default:
+                return readSymbolOrNumber(_position);
+        }
+    }
+
+private:
+    const char *_position;
+    const char *_end;
+    Object *dot;
+    Object *listEnd;
+
+    void skipWhitespace()
+    {
+        while (_position != _end && (characterClasses[*_position] & ccWhitespace)) ++_position;
+    }
+
+    void skipComment()
+    {
+        const char *newline = (const char*) memchr(_position, '\n', _end - _position);
+        _position = newline == NULL ? _end : newline;
+    }
+
+    // Advances to the next whitespace or closing parenthesis
+    void skipToken()
+    {
+        while (_position != _end && !(characterClasses[*_position] & ccTokenEnd)) ++_position;
+    }
+
+    bool isEof() const
+    {
+        return _position == _end;
+    }
+
+    int peekChar() const
+    {
+        assertNotEof();
+        return (unsigned char)*_position;
+    }
+
+    int readChar()
+    {
+        assertNotEof();
+        return (unsigned char)*_position++;
+    }
+
+    void assertNotEof() const
+    {
+        if (isEof()) error("Unexpected end of input stream");
+    }
+
+    Object *readList()
+    {
+        readChar(); // Opening parenthesis
+        Object *ret = (Object*) Null::getInstance();
+        Object *current = (Object*) Null::getInstance();
+
+        for (;;)
+        {
+            Object *o = read();
+            if (o == listEnd) return ret; // Closing parenthesis
+            if (o == dot)
+            {
+                if (getType(current) == otNull) error("Read error: Invalid dotted list");
+                o = read();
+                gcWriteBarrier(o);
+                ((Pair*)current)->_cdr = o;
+                if (read() != listEnd)error("Read error: Invalid dotted list");
+                return ret;
+            }
+
+            Pair *newPair = new Pair(o, (Object*) Null::getInstance());
+            if (getType(current) == otNull)
+            {
+                ret = current = (Object*) newPair;
+            }
+            else
+            {
+                gcWriteBarrier((Object*) newPair);
+                ((Pair*)current)->_cdr = (Object*) newPair;
+                current = (Object*) newPair;
+            }
+        }
+    }
+
+    Object *readString()
+    {
+        readChar(); // Opening quote
+        string sb;
+        for (;;)
+        {
+            const char *start = _position;
+            while (_position != _end && *_position != '"' && *_position != '\\') ++_position;
+            sb.append(start, _position - start);
+            int c = readChar();
+            if (c == '"') break;
+
+            c = readChar();
+            if (c == 'n') c = '\n';
+            if (c == 'r') c = '\r';
+            if (c == 't') c = '\t';
+            sb += (char)c;
+        }
+        return (Object*) new String(sb);
+    }
+
+    Object *readSpecial()
+    {
+        readChar(); // #
+        if (peekChar() == '(') return readVector();
+        if (peekChar() != '\\') return readSymbolOrNumber(_position - 1);
+        readChar();
+        return readCharacter();
+    }
+
+    Object *readVector()
+    {
+        readChar(); // Opening parenthesis
+        vector<Object*> ret;
+
+        for (;;)
+        {
+            Object *o = read();
+            if (o == listEnd) return (Object*) new Vector(ret); // Closing parenthesis
+            if (o == dot) error("Read error: Dot is invalid inside a vector literal");
+            ret.push_back(o);
+        }
+    }
+
+    Object *readCharacter()
+    {
+        const char *start = _position;
+        int c = readChar();
+        if (!(characterClasses[c] & ccAlpha)) return Char::valueOf(c);
+
+        skipToken();
+        string name(start, _position - start);
+        if (name == "newline") return Char::valueOf(10);
+        if (name == "cr") return Char::valueOf(13);
+        if (name == "tab") return Char::valueOf(9);
+        if (name == "space") return Char::valueOf(32);
+        if (name.length() == 1) return Char::valueOf(c);
+        error("Read error: Invalid character name: \\" + name);
+        return NULL; // Just to keep the compiler happy
+    }
+
+    // The token starts at start, which is either the current position or the # before it
+    Object *readSymbolOrNumber(const char *start)
+    {
+        if (start == _position && peekChar() == ')')
+        {
+            readChar();
+            return listEnd;
+        }
+
+        int periods = 0, slashes = 0;
+        bool digitsAndPeriodsOnly = true;
+        for (_position = start; _position != _end; ++_position)
+        {
+            int characterClass = characterClasses[*_position];
+            if (characterClass & ccTokenEnd) break;
+            if (characterClass & ccPeriod) ++periods;
+            else if (characterClass & ccSlash) ++slashes;
+            else if (!(characterClass & ccDigit)) digitsAndPeriodsOnly = false;
+        }
+        size_t length = _position - start;
+
+        if (length == 2 && start[0] == '#' && (start[1] == 't' || start[1] == 'f')) return Boolean::valueOf(start[1] == 't');
+
+        if (periods == 0 && slashes < 2 && digitsAndPeriodsOnly)
+        {
+            if (slashes == 0 && length <= 18) return parseFixnum(start, length);
+            Object *ret = parseRational(string(start, length), 10);
+            if (ret) return ret;
+        }
+        if (slashes > 0) return (Object*) Symbol::fromString(start, length);
+        double dValue;
+        if (periods < 2 && digitsAndPeriodsOnly && parseFlonum(start, length, &dValue)) return (Object*) new Flonum(dValue);
+        if (length >= 2 && start[0] == '#' && start[1] == 'x')
+        {
+            Object *ret = parseInteger(string(start + 2, length - 2), 16);
+            if (ret) return ret;
+        }
+        return (Object*) Symbol::fromString(start, length);
+    }
+
+    // Up to 18 decimal digits always fit into a fixnum
+    static Object *parseFixnum(const char *start, size_t length)
+    {
+        long ret = 0;
+        for (size_t i = 0; i < length; ++i) ret = ret * 10 + (start[i] - '0');
+        return Fixnum::valueOf(ret);
+    }
+
+    // Parses digits with at most one period. Up to 15 digits and their power of ten are exact doubles, so a single
+    // division rounds correctly; longer numbers go through strtod.
+    static bool parseFlonum(const char *start, size_t length, double *value)
+    {
+        static const double powersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+                                              1e14, 1e15 };
+        const char *period = (const char*) memchr(start, '.', length);
+        size_t digits = period == NULL ? length : length - 1;
+        if (digits == 0) return false;
+        if (digits > 15)
+        {
+            *value = strtod(string(start, length).c_str(), NULL);
+            return true;
+        }
+
+        long mantissa = 0;
+        for (size_t i = 0; i < length; ++i) if (start + i != period) mantissa = mantissa * 10 + (start[i] - '0');
+        *value = (double)mantissa / powersOfTen[period == NULL ? 0 : start + length - period - 1];
+        return true;
+    }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Object *car(Object *o)
+{
+    assertType("car", o, otPair);
+    return ((Pair*)o)->_car;
+}
+
+Object *cdr(Object *o)
+{
+    assertType("cdr", o, otPair);
+    return ((Pair*)o)->_cdr;
+}
+
+const char *objectTypeNames[OBJECT_TYPES] =
+{
+    "fixnum", "flonum", "symbol", "pair", "string", "boolean", "char", "null", "procedure", "vector", "eof",
+    "environment", "tag", "local-reference", "node", "code", "bignum", "fraction",
+    "f64vector", "s32vector", "u8vector", "string-port", "file-port"
+};
+
+Object *sysType(Object *o)
+{
+    static Symbol *typeSymbols[OBJECT_TYPES];
+    ObjectType type = getType(o);
+    if (typeSymbols[type] == NULL) typeSymbols[type] = Symbol::fromString(objectTypeNames[type]);
+    return typeSymbols[type];
+}
+
+Object *sysTag(Object *o)
+{
+    return new Tag(o);
+}
+
+Object *sysUntag(Object *o)
+{
+    assertType("untag", o, otTag);
+    return ((Tag*)o)->getValue();
+}
+
+Object *integerToChar(Object *o)
+{
+    assertType("integer->char", o, otFixnum);
+    return Char::valueOf(Fixnum::getValue(o));
+}
+
+Object *charToInteger(Object *o)
+{
+    assertType("char->integer", o, otChar);
+    return Fixnum::valueOf(Char::getValue(o));
+}
+
+Object *stringLength(Object *o)
+{
+    assertType("string-length", o, otString);
+    return Fixnum::valueOf(((String*)o)->getLength());
+}
+
+Object *stringToSymbol(Object *o)
+{
+    assertType("string->symbol", o, otString);
+    return (Object*) Symbol::fromString(((String*)o)->getValue());
+}
+
+Object *symbolToString(Object *o)
+{
+    assertType("symbol->string", o, otSymbol);
+    return (Object*) new String(((Symbol*)o)->getName());
+}
+
+Object *vectorLength(Object *o)
+{
+    assertType("vector-length", o, otVector);
+    return Fixnum::valueOf(((Vector*)o)->getLength());
+}
+
+Object *makeVector(Object *o)
+{
+    assertType("make-vector", o, otFixnum);
+    return (Object*) new Vector(Fixnum::getValue(o));
+}
+
+Object *sysDisplayString(Object *o)
+{
+    assertType("display-string", o, otString);
+    const string& value = ((String*)o)->getValue();
+    if (!getStandardOutput()->write(value.data(), value.size())) error("display-string: Could not write to port");
+    return undefinedSymbol;
+}
+
+Object *sysExit(Object *o)
+{
+    assertType("exit", o, otFixnum);
+    stringstream sb;
+    sb << "Execution stopped with error code " << Fixnum::getValue(o);
+    error(sb.str());
+    return NULL; // Just to keep the compiler happy
+}
+
+Object *sysSetGcMaxPause(Object *o)
+{
+    assertType("sys:set-gc-max-pause!", o, otFixnum);
+    if (Fixnum::getValue(o) < 0) error("sys:set-gc-max-pause!: Pause must not be negative");
+    gcMaxPauseMicroseconds = Fixnum::getValue(o);
+    return undefinedSymbol;
+}
+
+// Log messages of the garbage collector go to the given file, to stderr for #t or nowhere for #f
+Object *sysSetGcLog(Object *o)
+{
+    static ofstream logFile;
+    if (logFile.is_open()) logFile.close();
+
+    if (getType(o) == otString)
+    {
+        logFile.open(((String*)o)->getValue().c_str(), ios::app);
+        if (!logFile) error("sys:set-gc-log!: Could not open " + ((String*)o)->getValue());
+        gcLog = &logFile;
+    }
+    else
+    {
+        assertType("sys:set-gc-log!", o, otBoolean);
+        gcLog = Boolean::getValue(o) ? &cerr : NULL;
+    }
+    return undefinedSymbol;
+}
+
+// Runs the statements emitted by compile in init.scm, a list of lists like (load-constant 42)
+Object *sysExecute(Object *o)
+{
+    if (getType(o) != otPair && getType(o) != otNull) error("sys:execute: Invalid argument type");
+    return runCode(Assembler(o).assemble(), 0, new Environment());
+}
+
+Object *sysSetJit(Object *o)
+{
+    assertType("sys:set-jit!", o, otBoolean);
+    jitEnabled = Boolean::getValue(o);
+    return undefinedSymbol;
+}
+
+// The processor time used so far, in microseconds
+Object *sysRuntime()
+{
+    return Fixnum::valueOf((long)((double)clock() * 1000000 / CLOCKS_PER_SEC));
+}
+
+double gcSurvivalRate()
+{
+    long sweptObjects = gcStats.liveObjects + gcStats.freedObjects;
+    return sweptObjects == 0 ? 0 : (double)gcStats.liveObjects / sweptObjects;
+}
+
+// Returns the statistics of the garbage collector as an association list. Pause times are in microseconds, the
+// survival rate is the part of the heap that survived the last collection.
+Object *sysGcStats()
+{
+    Object *allocated = Null::getInstance();
+    for (int i = OBJECT_TYPES - 1; i >= 0; --i)
+    {
+        if (gcStats.objectsAllocated[i] == 0) continue;
+        Object *entry = new Pair(Fixnum::valueOf(gcStats.bytesAllocated[i]), Null::getInstance());
+        entry = new Pair(Fixnum::valueOf(gcStats.objectsAllocated[i]), entry);
+        allocated = new Pair(new Pair(Symbol::fromString(objectTypeNames[i]), entry), allocated);
+    }
+
+    vector<Object*> histogram;
+    for (int i = 0; i < GC_PAUSE_HISTOGRAM_SIZE; ++i) histogram.push_back(Fixnum::valueOf(gcStats.pauseHistogram[i]));
+
+    Object *ret = Null::getInstance();
+    ret = new Pair(new Pair(Symbol::fromString("allocated"), allocated), ret);
+    ret = new Pair(new Pair(Symbol::fromString("survival-rate"), new Flonum(gcSurvivalRate())), ret);
+    ret = new Pair(new Pair(Symbol::fromString("live-bytes"), Fixnum::valueOf(gcStats.liveBytes)), ret);
+    ret = new Pair(new Pair(Symbol::fromString("live-objects"), Fixnum::valueOf(gcStats.liveObjects)), ret);
+    ret = new Pair(new Pair(Symbol::fromString("pause-histogram"), new Vector(histogram)), ret);
+    ret = new Pair(new Pair(Symbol::fromString("max-pause"), Fixnum::valueOf(gcStats.maxPauseMicroseconds)), ret);
+    ret = new Pair(new Pair(Symbol::fromString("total-pause"), Fixnum::valueOf(gcStats.totalPauseMicroseconds)), ret);
+    ret = new Pair(new Pair(Symbol::fromString("steps"), Fixnum::valueOf(gcStats.steps)), ret);
+    ret = new Pair(new Pair(Symbol::fromString("collections"), Fixnum::valueOf(gcStats.cycles)), ret);
+    return ret;
+}
+
+void printGcReport()
+{
+    cerr << "GC statistics:" << endl;
+    cerr << "  Collections: " << gcStats.cycles << " (" << gcStats.steps << " steps)" << endl;
+    cerr << "  Pauses: " << gcStats.totalPauseMicroseconds << "us total, " << gcStats.maxPauseMicroseconds << "us max" << endl;
+    cerr << "  Pause histogram:";
+    for (long i = 0, limit = 10; i < GC_PAUSE_HISTOGRAM_SIZE; ++i, limit *= 10)
+        cerr << " " << (i < GC_PAUSE_HISTOGRAM_SIZE - 1 ? "<" : ">=") << (i < GC_PAUSE_HISTOGRAM_SIZE - 1 ? limit : limit / 10) << "us: " << gcStats.pauseHistogram[i];
+    cerr << endl;
+    cerr << "  Live after last collection: " << gcStats.liveObjects << " objects, " << gcStats.liveBytes << " bytes" << endl;
+    cerr << "  Survival rate of last collection: " << gcSurvivalRate() << endl;
+    for (int i = 0; i < OBJECT_TYPES; ++i)
+        if (gcStats.objectsAllocated[i] > 0)
+            cerr << "  Allocated " << objectTypeNames[i] << ": " << gcStats.objectsAllocated[i] << " objects, " << gcStats.bytesAllocated[i] << " bytes" << endl;
+}
+
+Object *sysFixToFlo(Object *o1)
+{
+    assertType("fix->flo", o1, otFixnum);
+    return (Object*) new Flonum(Fixnum::getValue(o1));
+}
+
+Object *sysStrToFlo(Object *o1)
+{
+    assertType("str->flo", o1, otString);
+    string strValue = ((String*)o1)->getValue();
+    stringstream sb;
+    sb << strValue;
+    // TODO: Make sure the string consists of digits only!
+    double dValue;
+    if (sb >> dValue) return (Object*) new Flonum(dValue);
+    return nanSymbol;
+}
+
+Object *sysFloToStr(Object *o1)
+{
+    stringstream sb;
+    assertType("flo->str", o1, otFlonum);
+
+    sb << ((Flonum*)o1)->getValue();
+    string sValue;
+    sb >> sValue;
+    return (Object*) new String(sValue);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Object *setCar(Object *o, Object *newCar)
+{
+    assertType("set-car!", o, otPair);
+    gcWriteBarrier(newCar);
+    ((Pair*)o)->_car = newCar;
+    return (Object*) undefinedSymbol;
+}
+
+Object *setCdr(Object *o, Object *newCdr)
+{
+    assertType("set-cdr!", o, otPair);
+    gcWriteBarrier(newCdr);
+    ((Pair*)o)->_cdr = newCdr;
+    return (Object*) undefinedSymbol;
+}
+
+long getFix(const char* procedure, Object *o)
+{
+    assertType(procedure, o, otFixnum);
+    return Fixnum::getValue(o);
+}
+
+double getFlo(const char* procedure, Object *o)
+{
+    assertType(procedure, o, otFlonum);
+    return ((Flonum*)o)->getValue();
+}
+
+Object *cons(Object *car, Object *cdr) { return (Object*) new Pair(car, cdr); }
+Object *fixPlus(Object *o1, Object *o2) { return Fixnum::valueOf(getFix("fix+", o1) + getFix("fix+", o2)); }
+Object *fixMinus(Object *o1, Object *o2) { return Fixnum::valueOf(getFix("fix-", o1) - getFix("fix-", o2)); }
+Object *fixMult(Object *o1, Object *o2) { return Fixnum::valueOf(getFix("fix*", o1) * getFix("fix*", o2)); }
+Object *fixDiv(Object *o1, Object *o2) { return Fixnum::valueOf(getFix("fix/", o1) / getFix("fix/", o2)); }
+Object *fixMod(Object *o1, Object *o2) { return Fixnum::valueOf(getFix("fix%", o1) % getFix("fix%", o2)); }
+Object *fixLt(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(getFix("fix<", o1) < getFix("fix<", o2)); }
+Object *fixEq(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(getFix("fix=", o1) == getFix("fix=", o2)); }
+Object *floPlus(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo+", o1) + getFlo("flo+", o2)); }
+Object *floMinus(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo-", o1) - getFlo("flo-", o2)); }
+Object *floMult(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo*", o1) * getFlo("flo*", o2)); }
+Object *floDiv(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo/", o1) / getFlo("flo/", o2)); }
+//TODO Object *floMod(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo%", o1) % getFlo("flo%", o2)); }
+Object *floLt(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(getFlo("flo<", o1) < getFlo("flo<", o2)); }
+Object *floEq(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(getFlo("flo=", o1) == getFlo("flo=", o2)); }
+Object *eq(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(o1 == o2); }
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// The generic arithmetic of the numerical tower: integer => rational => flonum, where integers are fixnums or bignums
+// and rationals are integers or fractions
+string typeName(Object *o)
+{
+    if (getType(o) == otTag && getType(((Tag*)o)->getValue()) == otPair) return toString(((Pair*)((Tag*)o)->getValue())->_car);
+    return objectTypeNames[getType(o)];
+}
+
+void getRational(const char *procedure, Object *o, Object **numerator, Object **denominator)
+{
+    if (isInteger(o))
+    {
+        *numerator = o;
+        *denominator = Fixnum::valueOf(1);
+    }
+    else if (getType(o) == otFraction)
+    {
+        *numerator = ((Fraction*)o)->getNumerator();
+        *denominator = ((Fraction*)o)->getDenominator();
+    }
+    else error((string)procedure + ": Invalid argument type");
+}
+
+double getReal(const char *procedure, Object *o)
+{
+    if (getType(o) == otFlonum) return ((Flonum*)o)->getValue();
+    Object *numerator, *denominator;
+    getRational(procedure, o, &numerator, &denominator);
+    return integerToDouble(numerator) / integerToDouble(denominator);
+}
+
+Object *toInexact(Object *o) { return getType(o) == otFlonum ? o : new Flonum(getReal("exact->inexact", o)); }
+
+Object *arithmetic(const char *procedure, Object *o1, Object *o2)
+{
+    char op = procedure[0];
+    if (isInteger(o1) && isInteger(o2))
+    {
+        switch (op)
+        {
+        case '+': return integerAdd(o1, o2);
+        case '-': return integerAdd(o1, o2, true);
+        case '*': return integerMultiply(o1, o2);
+        default: return makeRational(procedure, o1, o2);
+        }
+    }
+
+    if (getType(o1) == otFlonum || getType(o2) == otFlonum)
+    {
+        double a = getReal(procedure, o1), b = getReal(procedure, o2);
+        switch (op)
+        {
+        case '+': return new Flonum(a + b);
+        case '-': return new Flonum(a - b);
+        case '*': return new Flonum(a * b);
+        default: return new Flonum(a / b);
+        }
+    }
+
+    Object *n1, *d1, *n2, *d2;
+    getRational(procedure, o1, &n1, &d1);
+    getRational(procedure, o2, &n2, &d2);
+    switch (op)
+    {
+    case '+':
+    case '-':
+        return makeRational(procedure, integerAdd(integerMultiply(n1, d2), integerMultiply(n2, d1), op == '-'), integerMultiply(d1, d2));
+    case '*':
+        return makeRational(procedure, integerMultiply(n1, n2), integerMultiply(d1, d2));
+    default:
+        return makeRational(procedure, integerMultiply(n1, d2), integerMultiply(d1, n2));
+    }
+}
+
+// Returns a negative number, zero or a positive number if o1 is less than, equal to or greater than o2
+int compareNumbers(const char *procedure, Object *o1, Object *o2)
+{
+    if (isInteger(o1) && isInteger(o2)) return integerCompare(o1, o2);
+
+    if (getType(o1) != otFlonum && getType(o2) != otFlonum)
+    {
+        Object *n1, *d1, *n2, *d2;
+        getRational(procedure, o1, &n1, &d1);
+        getRational(procedure, o2, &n2, &d2);
+        return integerCompare(integerMultiply(n1, d2), integerMultiply(n2, d1));
+    }
+
+    double a = getReal(procedure, o1), b = getReal(procedure, o2);
+    return a < b ? -1 : a == b ? 0 : 1;
+}
+
+// Combines the arguments from left to right, starting with first
+Object *fold(const char *procedure, Object *first, Object **arguments, size_t count)
+{
+    Object *ret = first;
+    for (size_t i = 0; i < count; ++i) ret = arithmetic(procedure, ret, arguments[i]);
+    return ret;
+}
+
+Object *numberPlus(Object **arguments, size_t count) { return fold("+", Fixnum::valueOf(0), arguments, count); }
+Object *numberMult(Object **arguments, size_t count) { return fold("*", Fixnum::valueOf(1), arguments, count); }
+
+// (- x) and (/ x) are 0-x and 1/x
+Object *numberMinus(Object **arguments, size_t count)
+{
+    if (count == 0) error("-: Called without parameters");
+    if (count == 1) return arithmetic("-", Fixnum::valueOf(0), arguments[0]);
+    return fold("-", arguments[0], arguments + 1, count - 1);
+}
+
+Object *numberDiv(Object **arguments, size_t count)
+{
+    if (count == 0) error("/: Called without parameters");
+    if (count == 1) return arithmetic("/", Fixnum::valueOf(1), arguments[0]);
+    return fold("/", arguments[0], arguments + 1, count - 1);
+}
+
+// Tells whether each argument is related to the next one as requested by the result of compareNumbers
+Object *compareChain(const char *procedure, Object **arguments, size_t count, bool less, bool equal, bool greater)
+{
+    if (count == 0) error((string)procedure + ": Called without parameters");
+    if (count == 1) getReal(procedure, arguments[0]);
+    for (size_t i = 1; i < count; ++i)
+    {
+        int c = compareNumbers(procedure, arguments[i - 1], arguments[i]);
+        if (!(c < 0 ? less : c == 0 ? equal : greater)) return Boolean::getFalse();
+    }
+    return Boolean::getTrue();
+}
+
+Object *numberLt(Object **arguments, size_t count) { return compareChain("<", arguments, count, true, false, false); }
+Object *numberGt(Object **arguments, size_t count) { return compareChain(">", arguments, count, false, false, true); }
+Object *numberLe(Object **arguments, size_t count) { return compareChain("<=", arguments, count, true, true, false); }
+Object *numberGe(Object **arguments, size_t count) { return compareChain(">=", arguments, count, false, true, true); }
+Object *numberEq(Object **arguments, size_t count) { return compareChain("=", arguments, count, false, true, false); }
+
+// The result is inexact if any argument is
+Object *extremum(const char *procedure, Object **arguments, size_t count, int sign)
+{
+    if (count == 0) error((string)procedure + ": Called without parameters");
+    Object *ret = arguments[0];
+    bool inexact = getType(ret) == otFlonum;
+    getReal(procedure, ret);
+    for (size_t i = 1; i < count; ++i)
+    {
+        if (getType(arguments[i]) == otFlonum) inexact = true;
+        if (compareNumbers(procedure, arguments[i], ret) * sign > 0) ret = arguments[i];
+    }
+    return inexact ? toInexact(ret) : ret;
+}
+
+Object *numberMin(Object **arguments, size_t count) { return extremum("min", arguments, count, -1); }
+Object *numberMax(Object **arguments, size_t count) { return extremum("max", arguments, count, 1); }
+
+Object *getInteger(const char *procedure, Object *o)
+{
+    if (!isInteger(o)) error((string)procedure + ": Expected integer argument, got " + typeName(o));
+    return o;
+}
+
+Object *getDivisor(const char *procedure, Object *o)
+{
+    if (getInteger(procedure, o) == Fixnum::valueOf(0)) error((string)procedure + ": Division by zero");
+    return o;
+}
+
+Object *quotient(Object *o1, Object *o2)
+{
+    Object *quotient, *remainder;
+    integerDivide(getInteger("quotient", o1), getDivisor("quotient", o2), &quotient, &remainder);
+    return quotient;
+}
+
+Object *remainder(Object *o1, Object *o2)
+{
+    Object *quotient, *remainder;
+    integerDivide(getInteger("remainder", o1), getDivisor("remainder", o2), &quotient, &remainder);
+    return remainder;
+}
+
+// Unlike the remainder, the modulo has the sign of the divisor
+Object *modulo(Object *o1, Object *o2)
+{
+    Object *quotient, *remainder;
+    integerDivide(getInteger("modulo", o1), getDivisor("modulo", o2), &quotient, &remainder);
+    if (remainder != Fixnum::valueOf(0) && isNegativeInteger(remainder) != isNegativeInteger(o2))
+        remainder = integerAdd(remainder, o2);
+    return remainder;
+}
+
+Object *numerator(Object *o)
+{
+    Object *numerator, *denominator;
+    getRational("numerator", o, &numerator, &denominator);
+    return numerator;
+}
+
+Object *denominator(Object *o)
+{
+    Object *numerator, *denominator;
+    getRational("denominator", o, &numerator, &denominator);
+    return denominator;
+}
+
+Object *numberGcd(Object **arguments, size_t count)
+{
+    Object *ret = Fixnum::valueOf(0);
+    for (size_t i = 0; i < count; ++i) ret = integerGcd(ret, getInteger("gcd", arguments[i]));
+    return ret;
+}
+
+Object *numberLcm(Object **arguments, size_t count)
+{
+    Object *ret = Fixnum::valueOf(1), *remainder;
+    for (size_t i = 0; i < count; ++i)
+    {
+        Object *o = getInteger("lcm", arguments[i]);
+        if (o == Fixnum::valueOf(0)) return o;
+        integerDivide(integerMultiply(ret, isNegativeInteger(o) ? integerNegate(o) : o), integerGcd(ret, o), &ret, &remainder);
+    }
+    return ret;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// Bulk operations on f64vectors. Every kernel exists in plain C++ and, on x86-64, with SSE2 and AVX intrinsics. The
+// best set the processor supports is chosen at startup; (sys:set-simd! #f) switches to the plain kernels. The vector
+// kernels sum in several lanes at once, so their rounding may differ from that of the plain ones.
+enum F64Operation { f64Add, f64Subtract, f64Multiply, f64Divide, f64Min, f64Max };
+
+struct F64Kernels
+{
+    void (*combine)(F64Operation op, double *dest, const double *a, const double *b, size_t count);
+    void (*scale)(double *dest, const double *a, double factor, size_t count);
+    double (*dot)(const double *a, const double *b, size_t count);
+    double (*sum)(const double *a, size_t count);
+    double (*extremum)(const double *a, size_t count, bool maximum); // count must not be zero
+};
+
+void f64CombinePlain(F64Operation op, double *dest, const double *a, const double *b, size_t count)
+{
+    switch (op)
+    {
+    case f64Add: for (size_t i = 0; i < count; ++i) dest[i] = a[i] + b[i]; break;
+    case f64Subtract: for (size_t i = 0; i < count; ++i) dest[i] = a[i] - b[i]; break;
+    case f64Multiply: for (size_t i = 0; i < count; ++i) dest[i] = a[i] * b[i]; break;
+    case f64Divide: for (size_t i = 0; i < count; ++i) dest[i] = a[i] / b[i]; break;
+    case f64Min: for (size_t i = 0; i < count; ++i) dest[i] = a[i] < b[i] ? a[i] : b[i]; break;
+    case f64Max: for (size_t i = 0; i < count; ++i) dest[i] = a[i] > b[i] ? a[i] : b[i]; break;
+    }
+}
+
+void f64ScalePlain(double *dest, const double *a, double factor, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) dest[i] = a[i] * factor;
+}
+
+double f64DotPlain(const double *a, const double *b, size_t count)
+{
+    double ret = 0;
+    for (size_t i = 0; i < count; ++i) ret += a[i] * b[i];
+    return ret;
+}
+
+double f64SumPlain(const double *a, size_t count)
+{
+    double ret = 0;
+    for (size_t i = 0; i < count; ++i) ret += a[i];
+    return ret;
+}
+
+double f64ExtremumPlain(const double *a, size_t count, bool maximum)
+{
+    double ret = a[0];
+    for (size_t i = 1; i < count; ++i) if (maximum ? a[i] > ret : a[i] < ret) ret = a[i];
+    return ret;
+}
+
+F64Kernels f64KernelsPlain = { f64CombinePlain, f64ScalePlain, f64DotPlain, f64SumPlain, f64ExtremumPlain };
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// SSE2 is part of every x86-64 processor
+void f64CombineSse2(F64Operation op, double *dest, const double *a, const double *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128d x = _mm_loadu_pd(a + i), y = _mm_loadu_pd(b + i);
+        switch (op)
+        {
+        case f64Add: x = _mm_add_pd(x, y); break;
+        case f64Subtract: x = _mm_sub_pd(x, y); break;
+        case f64Multiply: x = _mm_mul_pd(x, y); break;
+        case f64Divide: x = _mm_div_pd(x, y); break;
+        case f64Min: x = _mm_min_pd(x, y); break;
+        case f64Max: x = _mm_max_pd(x, y); break;
+        }
+        _mm_storeu_pd(dest + i, x);
+    }
+    f64CombinePlain(op, dest + i, a + i, b + i, count - i);
+}
+
+void f64ScaleSse2(double *dest, const double *a, double factor, size_t count)
+{
+    __m128d f = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) _mm_storeu_pd(dest + i, _mm_mul_pd(_mm_loadu_pd(a + i), f));
+    f64ScalePlain(dest + i, a + i, factor, count - i);
+}
+
+double f64DotSse2(const double *a, const double *b, size_t count)
+{
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+    return lanes[0] + lanes[1] + f64DotPlain(a + i, b + i, count - i);
+}
+
+double f64SumSse2(const double *a, size_t count)
+{
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+    return lanes[0] + lanes[1] + f64SumPlain(a + i, count - i);
+}
+
+double f64ExtremumSse2(const double *a, size_t count, bool maximum)
+{
+    if (count < 2) return a[0];
+    __m128d m = _mm_loadu_pd(a);
+    size_t i = 2;
+    for (; i + 2 <= count; i += 2) m = maximum ? _mm_max_pd(m, _mm_loadu_pd(a + i)) : _mm_min_pd(m, _mm_loadu_pd(a + i));
+    double lanes[3];
+    _mm_storeu_pd(lanes, m);
+    lanes[2] = i < count ? a[i] : lanes[0];
+    return f64ExtremumPlain(lanes, 3, maximum);
+}
+
+F64Kernels f64KernelsSse2 = { f64CombineSse2, f64ScaleSse2, f64DotSse2, f64SumSse2, f64ExtremumSse2 };
+
+// AVX needs to be checked for at runtime. The compiler only uses it inside these functions.
+#define AVX __attribute__((target("avx")))
+
+AVX void f64CombineAvx(F64Operation op, double *dest, const double *a, const double *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(a + i), y = _mm256_loadu_pd(b + i);
+        switch (op)
+        {
+        case f64Add: x = _mm256_add_pd(x, y); break;
+        case f64Subtract: x = _mm256_sub_pd(x, y); break;
+        case f64Multiply: x = _mm256_mul_pd(x, y); break;
+        case f64Divide: x = _mm256_div_pd(x, y); break;
+        case f64Min: x = _mm256_min_pd(x, y); break;
+        case f64Max: x = _mm256_max_pd(x, y); break;
+        }
+        _mm256_storeu_pd(dest + i, x);
+    }
+    f64CombinePlain(op, dest + i, a + i, b + i, count - i);
+}
+
+AVX void f64ScaleAvx(double *dest, const double *a, double factor, size_t count)
+{
+    __m256d f = _mm256_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), f));
+    f64ScalePlain(dest + i, a + i, factor, count - i);
+}
+
+AVX double f64DotAvx(const double *a, const double *b, size_t count)
+{
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + f64DotPlain(a + i, b + i, count - i);
+}
+
+AVX double f64SumAvx(const double *a, size_t count)
+{
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + f64SumPlain(a + i, count - i);
+}
+
+AVX double f64ExtremumAvx(const double *a, size_t count, bool maximum)
+{
+    if (count < 4) return f64ExtremumPlain(a, count, maximum);
+    __m256d m = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= count; i += 4)
+        m = maximum ? _mm256_max_pd(m, _mm256_loadu_pd(a + i)) : _mm256_min_pd(m, _mm256_loadu_pd(a + i));
+    double lanes[7];
+    _mm256_storeu_pd(lanes, m);
+    size_t rest = count - i;
+    for (size_t j = 0; j < rest; ++j) lanes[4 + j] = a[i + j];
+    return f64ExtremumPlain(lanes, 4 + rest, maximum);
+}
+
+F64Kernels f64KernelsAvx = { f64CombineAvx, f64ScaleAvx, f64DotAvx, f64SumAvx, f64ExtremumAvx };
+
+F64Kernels *selectF64Kernels()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") ? &f64KernelsAvx : &f64KernelsSse2;
+}
+#else
+F64Kernels *selectF64Kernels() { return &f64KernelsPlain; }
+#endif
+
+F64Kernels *f64Kernels = selectF64Kernels();
+
+Object *sysSetSimd(Object *o)
+{
+    assertType("sys:set-simd!", o, otBoolean);
+    f64Kernels = Boolean::getValue(o) ? selectF64Kernels() : &f64KernelsPlain;
+    return undefinedSymbol;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// The procedures every kind of homogeneous vector has, e.g. make-f64vector, s32vector-ref or list->u8vector
+template <class V> string numericVectorProcedure(const char *prefix, const char *suffix)
+{
+    return (string)prefix + numericVectorTag(V::TYPE) + "vector" + suffix;
+}
+
+Object *boxElement(double value) { return new Flonum(value); }
+Object *boxElement(int value) { return Fixnum::valueOf(value); }
+Object *boxElement(unsigned char value) { return Fixnum::valueOf(value); }
+
+// Return false if the object is not a number that fits into an element
+bool unboxElement(Object *o, double *dest)
+{
+    if (getType(o) != otFlonum && !isInteger(o) && getType(o) != otFraction) return false;
+    *dest = getReal("", o);
+    return true;
+}
+
+bool unboxElement(Object *o, int *dest)
+{
+    if (!isFixnum(o) || Fixnum::getValue(o) < INT_MIN || Fixnum::getValue(o) > INT_MAX) return false;
+    *dest = (int)Fixnum::getValue(o);
+    return true;
+}
+
+bool unboxElement(Object *o, unsigned char *dest)
+{
+    if (!isFixnum(o) || Fixnum::getValue(o) < 0 || Fixnum::getValue(o) > 255) return false;
+    *dest = (unsigned char)Fixnum::getValue(o);
+    return true;
+}
+
+template <class V> typename V::Element getElement(const string& procedure, Object *o)
+{
+    typename V::Element ret;
+    if (!unboxElement(o, &ret)) error(procedure + ": Invalid element value");
+    return ret;
+}
+
+template <class V> V *getNumericVector(const string& procedure, Object *o)
+{
+    assertType(procedure.c_str(), o, V::TYPE);
+    return (V*)o;
+}
+
+template <class V> size_t getNumericVectorIndex(const string& procedure, V *v, Object *o)
+{
+    long index = getFix(procedure.c_str(), o);
+    if (index < 0 || (size_t)index >= v->getLength()) error(procedure + ": Index out of range");
+    return index;
+}
+
+template <class V> Object *makeNumericVector(Object **arguments, size_t count)
+{
+    static const string procedure = numericVectorProcedure<V>("make-", "");
+    if (count < 1 || count > 2) error(procedure + ": Invalid parameter count");
+    long length = getFix(procedure.c_str(), arguments[0]);
+    if (length < 0) error(procedure + ": Invalid length");
+    return new V(length, count == 2 ? getElement<V>(procedure, arguments[1]) : 0);
+}
+
+template <class V> Object *numericVector(Object **arguments, size_t count)
+{
+    static const string procedure = numericVectorProcedure<V>("", "");
+    V *ret = new V(count, 0);
+    for (size_t i = 0; i < count; ++i) ret->SetAt(i, getElement<V>(procedure, arguments[i]));
+    return ret;
+}
+
+template <class V> Object *numericVectorLength(Object *o)
+{
+    static const string procedure = numericVectorProcedure<V>("", "-length");
+    return Fixnum::valueOf(getNumericVector<V>(procedure, o)->getLength());
+}
+
+template <class V> Object *numericVectorRef(Object *o1, Object *o2)
+{
+    static const string procedure = numericVectorProcedure<V>("", "-ref");
+    V *v = getNumericVector<V>(procedure, o1);
+    return boxElement(v->GetAt(getNumericVectorIndex(procedure, v, o2)));
+}
+
+template <class V> Object *numericVectorSet(Object *o1, Object *o2, Object *o3)
+{
+    static const string procedure = numericVectorProcedure<V>("", "-set!");
+    V *v = getNumericVector<V>(procedure, o1);
+    v->SetAt(getNumericVectorIndex(procedure, v, o2), getElement<V>(procedure, o3));
+    return undefinedSymbol;
+}
+
+template <class V> Object *numericVectorToList(Object *o)
+{
+    static const string procedure = numericVectorProcedure<V>("", "->list");
+    V *v = getNumericVector<V>(procedure, o);
+    Object *ret = Null::getInstance();
+    for (size_t i = v->getLength(); i-- > 0;) ret = new Pair(boxElement(v->GetAt(i)), ret);
+    return ret;
+}
+
+template <class V> Object *listToNumericVector(Object *o)
+{
+    static const string procedure = numericVectorProcedure<V>("list->", "");
+    vector<typename V::Element> elements;
+    for (; getType(o) == otPair; o = ((Pair*)o)->_cdr) elements.push_back(getElement<V>(procedure, ((Pair*)o)->_car));
+    if (getType(o) != otNull) error(procedure + ": Invalid argument type");
+    V *ret = new V(elements.size(), 0);
+    for (size_t i = 0; i < elements.size(); ++i) ret->SetAt(i, elements[i]);
+    return ret;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+F64Vector *getF64Vector(const char *procedure, Object *o)
+{
+    assertType(procedure, o, otF64Vector);
+    return (F64Vector*)o;
+}
+
+F64Vector *getF64VectorLike(const char *procedure, Object *o, F64Vector *v)
+{
+    F64Vector *ret = getF64Vector(procedure, o);
+    if (ret->getLength() != v->getLength()) error((string)procedure + ": Vectors differ in length");
+    return ret;
+}
+
+Object *f64VectorAdd(Object *o1, Object *o2)
+{
+    F64Vector *a = getF64Vector("f64vector-add!", o1), *b = getF64VectorLike("f64vector-add!", o2, a);
+    f64Kernels->combine(f64Add, a->getElements(), a->getElements(), b->getElements(), a->getLength());
+    return a;
+}
+
+Object *f64VectorScale(Object *o1, Object *o2)
+{
+    F64Vector *a = getF64Vector("f64vector-scale!", o1);
+    f64Kernels->scale(a->getElements(), a->getElements(), getReal("f64vector-scale!", o2), a->getLength());
+    return a;
+}
+
+Object *f64VectorDot(Object *o1, Object *o2)
+{
+    F64Vector *a = getF64Vector("f64vector-dot", o1), *b = getF64VectorLike("f64vector-dot", o2, a);
+    return new Flonum(f64Kernels->dot(a->getElements(), b->getElements(), a->getLength()));
+}
+
+Object *f64VectorSum(Object *o)
+{
+    F64Vector *a = getF64Vector("f64vector-sum", o);
+    return new Flonum(f64Kernels->sum(a->getElements(), a->getLength()));
+}
+
+Object *f64VectorExtremum(const char *procedure, Object *o, bool maximum)
+{
+    F64Vector *a = getF64Vector(procedure, o);
+    if (a->getLength() == 0) error((string)procedure + ": Empty vector");
+    return new Flonum(f64Kernels->extremum(a->getElements(), a->getLength(), maximum));
+}
+
+Object *f64VectorMin(Object *o) { return f64VectorExtremum("f64vector-min", o, false); }
+Object *f64VectorMax(Object *o) { return f64VectorExtremum("f64vector-max", o, true); }
+
+// The builtins that have a kernel when mapped over two vectors
+bool getF64Operation(Procedure *proc, F64Operation *op)
+{
+    if (!proc->isBuiltin()) return false;
+    string name = proc->getName();
+    if (name == "+" || name == "flo+") *op = f64Add;
+    else if (name == "-" || name == "flo-") *op = f64Subtract;
+    else if (name == "*" || name == "flo*") *op = f64Multiply;
+    else if (name == "/" || name == "flo/") *op = f64Divide;
+    else if (name == "min") *op = f64Min;
+    else if (name == "max") *op = f64Max;
+    else return false;
+    return true;
+}
+
+// (f64vector-map proc v) or (f64vector-map proc v1 v2) returns a new f64vector. Any procedure may be mapped, but only
+// the arithmetic builtins over two vectors run as a bulk kernel.
+Object *f64VectorMap(Object **arguments, size_t count)
+{
+    if (count < 2 || count > 3) error("f64vector-map: Invalid parameter count");
+    assertType("f64vector-map", arguments[0], otProcedure);
+    Procedure *proc = (Procedure*) arguments[0];
+    F64Vector *a = getF64Vector("f64vector-map", arguments[1]);
+    F64Vector *b = count == 3 ? getF64VectorLike("f64vector-map", arguments[2], a) : NULL;
+    F64Vector *ret = new F64Vector(a->getLength(), 0);
+
+    F64Operation op;
+    if (b != NULL && getF64Operation(proc, &op))
+    {
+        f64Kernels->combine(op, ret->getElements(), a->getElements(), b->getElements(), a->getLength());
+        return ret;
+    }
+
+    GcRoot retRoot((Object**)&ret);
+    for (size_t i = 0; i < a->getLength(); ++i)
+    {
+        size_t base = valueStackTop;
+        pushValue(new Flonum(a->GetAt(i)));
+        if (b != NULL) pushValue(new Flonum(b->GetAt(i)));
+        Object *result;
+        if (proc->isBuiltin())
+        {
+            result = proc->call(valueStack + base, valueStackTop - base);
+            valueStackTop = base;
+        }
+        else result = callLambda((Lambda*) proc, base);
+        ret->SetAt(i, getElement<F64Vector>("f64vector-map", result));
+    }
+    return ret;
+}
+
+Object *apply(Object *o, Object *args)
+{
+    assertType("apply", o, otProcedure);
+    Procedure *proc = (Procedure*) o;
+    if (getType(args) != otNull && getType(args) != otPair) error("apply: Invalid argument type");
+    size_t base = valueStackTop;
+    for (Object *i = args; getType(i) == otPair; i = ((Pair*)i)->_cdr) pushValue(((Pair*)i)->_car);
+
+    if (!proc->isBuiltin()) return callLambda((Lambda*) proc, base);
+    Object *ret = proc->call(valueStack + base, valueStackTop - base);
+    valueStackTop = base;
+    return ret;
+} 
+
+// (sys:error-message thunk) calls thunk and returns the message of the error it raises without printing it, or #f if
+// it returns normally. This lets the self tests of init.scm check error cases.
+Object *sysErrorMessage(Object *o)
+{
+    assertType("sys:error-message", o, otProcedure);
+    size_t base = valueStackTop;
+    stringstream message;
+    streambuf *output = cout.rdbuf(message.rdbuf());
+    try
+    {
+        apply(o, Null::getInstance());
+    }
+    catch (int)
+    {
+        cout.rdbuf(output);
+        valueStackTop = base;
+        string ret = message.str();
+        return (Object*) new String(ret.substr(0, ret.find('\n')));
+    }
+    cout.rdbuf(output);
+    return Boolean::getFalse();
+}
+
+Object *stringRef(Object *o1, Object *o2)
+{
+    assertType("string-ref", o1, otString);
+    assertType("string-ref", o2, otFixnum);
+    return Char::valueOf(((String*)o1)->GetAt(Fixnum::getValue(o2)));
+}
+
+Object *vectorRef(Object *o1, Object *o2)
+{
+    assertType("vector-ref", o1, otVector);
+    assertType("vector-ref", o2, otFixnum);
+    return (Object*) ((Vector*)o1)->GetAt(Fixnum::getValue(o2));
+}
+
+Object *sysStrToFix(Object *o1, Object *o2)
+{
+    assertType("str->fix", o1, otString);
+    assertType("str->fix", o2, otFixnum);
+    string strValue = ((String*)o1)->getValue();
+    long base = Fixnum::getValue(o2);
+    stringstream sb;
+    switch(base)
+    {
+    case 2: error("str->fix: Base 2 not implemented yet"); return NULL; // TODO
+    case 8: sb << oct; break;
+    case 10: sb << dec; break;
+    case 16: sb << hex; break;
+    default: error("str->fix: Invalid base"); return NULL;
+    }
+
+    sb << strValue;
+    long lValue;
+    char c;
+    if (sb >> lValue && !(sb.get(c))) return Fixnum::valueOf(lValue);
+    return nanSymbol;
+}
+
+Object *sysFixToStr(Object *o1, Object *o2)
+{
+    stringstream sb;
+    assertType("fix->str", o1, otFixnum);
+    assertType("fix->str", o2, otFixnum);
+    long base = Fixnum::getValue(o2);
+
+    switch(base)
     {
-        if (init == "" && peekChar() == ')')
-        {
-            readChar();
-            return listEnd;
-        }
+    case 2: error("fix->str: Base 2 not implemented yet"); return NULL; // TODO
+    case 8: sb << oct; break;
+    case 10: sb << dec; break;
+    case 16: sb << hex; break;
+    default: error("fix->str: Invalid base"); return NULL;
+    }
 
-        stringstream sb;
-        sb << init;
-        while (!isEof() && peekChar() != ')' && !isspace(peekChar())) sb << (char)readChar();
-        string symbol = sb.str();
+    sb << Fixnum::getValue(o1);
+    string sValue;
+    sb >> sValue;
+    return (Object*) new String(sValue);
+}
 
-        if (symbol == "#t") return (Object*) Boolean::getTrue();
-        if (symbol == "#f") return (Object*) Boolean::getFalse();
+Object *sysRatToStr(Object *o1, Object *o2)
+{
+    Object *numerator, *denominator;
+    getRational("rat->str", o1, &numerator, &denominator);
+    assertType("rat->str", o2, otFixnum);
+    long base = Fixnum::getValue(o2);
+    if (base < 2 || base > 36) error("rat->str: Invalid base");
+    string sValue = integerToString(numerator, base);
+    if (denominator != Fixnum::valueOf(1)) sValue += "/" + integerToString(denominator, base);
+    return (Object*) new String(sValue);
+}
 
-        int periods = 0;
-        bool digitsAndPeriodsOnly = true;
-        for (size_t i=0; i<symbol.size(); ++i)
-        {
-            if (symbol[i] == '.') ++periods;
-            else if (symbol[i] < '0' || symbol[i] > '9') digitsAndPeriodsOnly = false;
-        }
+Object *sysStrToRat(Object *o1, Object *o2)
+{
+    assertType("str->rat", o1, otString);
+    assertType("str->rat", o2, otFixnum);
+    long base = Fixnum::getValue(o2);
+    if (base < 2 || base > 36) error("str->rat: Invalid base");
+    Object *ret = parseRational(((String*)o1)->getValue(), base);
+    return ret ? ret : nanSymbol;
+}
 
-        long lValue;
-        if (periods == 0 && digitsAndPeriodsOnly && sb >> lValue) return (Object*) new Fixnum(lValue);
-        sb.clear();
-        double dValue;
-        if (periods < 2 && digitsAndPeriodsOnly && sb >> dValue) return (Object*) new Flonum(dValue);
-        sb.clear();
-        if (symbol.substr(0, 2) == "#x")
-        {
-            sb << hex;
-            if (sb >> lValue) return (Object*) new Fixnum(lValue);
-        }
-        return (Object*) Symbol::fromString(symbol);
-    }
-};
+Object *sysBiToFlo(Object *o1) { return (Object*) new Flonum(integerToDouble(getInteger("bi->flo", o1))); }
 
 //----------------------------------------------------------------------------------------------------------------------
 
-Object *car(Object *o)
+// The string library. Strings are byte strings, so comparing and searching them maps to memcmp, memchr and friends.
+String *getString(const char *procedure, Object *o)
 {
-    assertType("car", o, otPair);
-    return ((Pair*)o)->_car;
+    assertType(procedure, o, otString);
+    return (String*)o;
 }
 
-Object *cdr(Object *o)
+char getStringChar(const char *procedure, Object *o)
 {
-    assertType("cdr", o, otPair);
-    return ((Pair*)o)->_cdr;
+    assertType(procedure, o, otChar);
+    int c = Char::getValue(o);
+    if (c < 0 || c > 255) error((string)procedure + ": Character out of range");
+    return (char)c;
 }
 
-Object *sysType(Object *o)
+// The index may be at most max
+size_t getStringIndex(const char *procedure, Object *o, size_t max)
+{
+    long ret = getFix(procedure, o);
+    if (ret < 0 || (size_t)ret > max) error((string)procedure + ": Index out of range");
+    return ret;
+}
+
+// Returns a negative number, zero or a positive number if o1 sorts before, with or after o2. Case insensitive
+// comparisons consider the ASCII letters only, like char-ci<? does.
+int compareStrings(const char *procedure, Object *o1, Object *o2, bool caseInsensitive)
 {
-    switch (o->getType())
+    const string& a = getString(procedure, o1)->getValue();
+    const string& b = getString(procedure, o2)->getValue();
+    size_t length = min(a.size(), b.size());
+    if (!caseInsensitive)
+    {
+        int c = memcmp(a.data(), b.data(), length);
+        if (c != 0) return c;
+    }
+    else for (size_t i = 0; i < length; ++i)
     {
-    case otFixnum: return Symbol::fromString("fixnum");
-    case otFlonum: return Symbol::fromString("flonum");
-    case otSymbol: return Symbol::fromString("symbol");
-    case otPair: return Symbol::fromString("pair");
-    case otString: return Symbol::fromString("string");
-    case otBoolean: return Symbol::fromString("boolean");
-    case otChar: return Symbol::fromString("char");
-    case otNull: return Symbol::fromString("null");
-    case otProcedure: return Symbol::fromString("procedure");
-    case otVector: return Symbol::fromString("vector");
-    case otEof: return Symbol::fromString("eof");
-    case otEnvironment: return Symbol::fromString("environment");
-    case otTag: return Symbol::fromString("tag");
-    default: throw "type: Invalid argument type";
+        int c = tolower((unsigned char)a[i]) - tolower((unsigned char)b[i]);
+        if (c != 0) return c;
     }
+    return a.size() < b.size() ? -1 : a.size() == b.size() ? 0 : 1;
 }
 
-Object *sysTag(Object *o)
+Object *stringEq(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string=?", o1, o2, false) == 0); }
+Object *stringLt(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string<?", o1, o2, false) < 0); }
+Object *stringGt(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string>?", o1, o2, false) > 0); }
+Object *stringLe(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string<=?", o1, o2, false) <= 0); }
+Object *stringGe(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string>=?", o1, o2, false) >= 0); }
+Object *stringCiEq(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string-ci=?", o1, o2, true) == 0); }
+Object *stringCiLt(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string-ci<?", o1, o2, true) < 0); }
+Object *stringCiGt(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string-ci>?", o1, o2, true) > 0); }
+Object *stringCiLe(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string-ci<=?", o1, o2, true) <= 0); }
+Object *stringCiGe(Object *o1, Object *o2) { return Boolean::valueOf(compareStrings("string-ci>=?", o1, o2, true) >= 0); }
+
+Object *substring(Object *o1, Object *o2, Object *o3)
 {
-    return new Tag(o);
+    const string& s = getString("substring", o1)->getValue();
+    size_t end = getStringIndex("substring", o3, s.size());
+    size_t start = getStringIndex("substring", o2, end);
+    return (Object*) new String(s.substr(start, end - start));
 }
 
-Object *sysUntag(Object *o)
+Object *stringCopy(Object *o) { return (Object*) new String(getString("string-copy", o)->getValue()); }
+
+Object *stringFill(Object *o1, Object *o2)
 {
-    assertType("untag", o, otTag);
-    return ((Tag*)o)->getValue();
+    String *s = getString("string-fill!", o1);
+    s->fill(getStringChar("string-fill!", o2));
+    return undefinedSymbol;
 }
 
-Object *integerToChar(Object *o)
+Object *stringToList(Object *o)
 {
-    assertType("integer->char", o, otFixnum);
-    return (Object*) new Char(((Fixnum*)o)->getValue());
+    const string& s = getString("string->list", o)->getValue();
+    Object *ret = Null::getInstance();
+    for (size_t i = s.size(); i-- > 0;) ret = (Object*) new Pair(Char::valueOf((unsigned char)s[i]), ret);
+    return ret;
 }
 
-Object *charToInteger(Object *o)
+Object *listToString(Object *o)
 {
-    assertType("char->integer", o, otChar);
-    return (Object*) new Fixnum(((Char*)o)->getValue());
+    string s;
+    for (; getType(o) == otPair; o = ((Pair*)o)->_cdr) s += getStringChar("list->string", ((Pair*)o)->_car);
+    if (getType(o) != otNull) error("list->string: Invalid argument type");
+    return (Object*) new String(s);
 }
 
-Object *stringLength(Object *o)
+Object *makeString(Object **arguments, size_t count)
 {
-    assertType("string-length", o, otString);
-    return (Object*) new Fixnum(((String*)o)->getLength());
+    if (count < 1 || count > 2) error("make-string: Invalid parameter count");
+    long length = getFix("make-string", arguments[0]);
+    if (length < 0) error("make-string: Invalid length");
+    return (Object*) new String(length, count == 2 ? getStringChar("make-string", arguments[1]) : ' ');
 }
 
-Object *stringToSymbol(Object *o)
+Object *stringOfChars(Object **arguments, size_t count)
 {
-    assertType("string->symbol", o, otString);
-    return (Object*) Symbol::fromString(((String*)o)->getValue());
+    string s;
+    for (size_t i = 0; i < count; ++i) s += getStringChar("string", arguments[i]);
+    return (Object*) new String(s);
 }
 
-Object *symbolToString(Object *o)
+// (string-index s c [start]) returns the index of the first c in s at or after start, or #f
+Object *stringIndex(Object **arguments, size_t count)
 {
-    assertType("symbol->string", o, otSymbol);
-    string symName = ((Symbol*)o)->getName();
-    vector<int> characters;
-    for (size_t i=0; i<symName.size(); ++i) characters.push_back(symName[i]);
-    return (Object*) new String(characters);
+    if (count < 2 || count > 3) error("string-index: Invalid parameter count");
+    const string& s = getString("string-index", arguments[0])->getValue();
+    char c = getStringChar("string-index", arguments[1]);
+    size_t start = count == 3 ? getStringIndex("string-index", arguments[2], s.size()) : 0;
+    const char *found = (const char*) memchr(s.data() + start, c, s.size() - start);
+    return found == NULL ? Boolean::getFalse() : Fixnum::valueOf(found - s.data());
 }
 
-Object *vectorLength(Object *o)
+// (string-search pattern s [start]) returns the index of the first occurrence of pattern in s at or after start, or #f
+Object *stringSearch(Object **arguments, size_t count)
 {
-    assertType("vector-length", o, otVector);
-    return (Object*) new Fixnum(((Vector*)o)->getLength());
+    if (count < 2 || count > 3) error("string-search: Invalid parameter count");
+    const string& pattern = getString("string-search", arguments[0])->getValue();
+    const string& s = getString("string-search", arguments[1])->getValue();
+    size_t start = count == 3 ? getStringIndex("string-search", arguments[2], s.size()) : 0;
+    size_t found = s.find(pattern, start);
+    return found == string::npos ? Boolean::getFalse() : Fixnum::valueOf(found);
 }
 
-Object *makeString(Object *o)
+// (string-split s c) returns the list of the parts of s between the occurrences of c
+Object *stringSplit(Object *o1, Object *o2)
 {
-    assertType("make-string", o, otFixnum);
-    return (Object*) new String(((Fixnum*)o)->getValue());
+    const string& s = getString("string-split", o1)->getValue();
+    char c = getStringChar("string-split", o2);
+    vector<size_t> separators;
+    for (const char *p = s.data(), *end = p + s.size(); (p = (const char*) memchr(p, c, end - p)) != NULL; ++p)
+        separators.push_back(p - s.data());
+
+    Object *ret = Null::getInstance();
+    size_t end = s.size();
+    for (size_t i = separators.size(); i-- > 0;)
+    {
+        ret = (Object*) new Pair(new String(s.substr(separators[i] + 1, end - separators[i] - 1)), ret);
+        end = separators[i];
+    }
+    return (Object*) new Pair(new String(s.substr(0, end)), ret);
 }
 
-Object *makeVector(Object *o)
+// (string-append s ...) allocates the result once, with the summed length of the arguments
+Object *stringAppend(Object **arguments, size_t count)
 {
-    assertType("make-vector", o, otFixnum);
-    return (Object*) new Vector(((Fixnum*)o)->getValue());
+    size_t length = 0;
+    for (size_t i = 0; i < count; ++i) length += getString("string-append", arguments[i])->getLength();
+    string ret;
+    ret.reserve(length);
+    for (size_t i = 0; i < count; ++i) ret += ((String*)arguments[i])->getValue();
+    return (Object*) new String(ret);
 }
 
-Object *sysDisplayString(Object *o)
+//----------------------------------------------------------------------------------------------------------------------
+
+// Ports. Output goes to string ports or file ports, input comes from file ports. Reading or writing a closed port is an
+// error, closing it again is not.
+FilePort *getFilePort(const char *procedure, Object *o, bool input)
 {
-    assertType("display-string", o, otString);
-    cout << ((String*)o)->getValue();
-    return Symbol::fromString("undefined");
+    assertType(procedure, o, otFilePort);
+    FilePort *ret = (FilePort*)o;
+    if (ret->isInput() != input) error((string)procedure + (input ? ": Not an input port" : ": Not an output port"));
+    if (!ret->isOpen()) error((string)procedure + ": Port is closed");
+    return ret;
 }
 
-Object *sysExit(Object *o)
+void writeToPort(const char *procedure, Object *port, const char *s, size_t length)
 {
-    assertType("exit", o, otFixnum);
-    stringstream sb;
-    sb << "Execution stopped with error code " << ((Fixnum*)o)->getValue();
-    error(sb.str());
-    return NULL; // Just to keep the compiler happy
+    if (getType(port) == otStringPort)
+        ((StringPort*)port)->write(s, length);
+    else if (!getFilePort(procedure, port, false)->write(s, length))
+        error((string)procedure + ": Could not write to port");
 }
 
-Object *sysFixToFlo(Object *o1)
+Object *openFile(const char *procedure, Object *o, bool input)
 {
-    assertType("fix->flo", o1, otFixnum);
-    return (Object*) new Flonum(((Fixnum*)o1)->getValue());
+    const string& fileName = getString(procedure, o)->getValue();
+    int fd = input ? open(fileName.c_str(), O_RDONLY) : open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) error((string)procedure + ": Could not open file " + fileName);
+    return (Object*) new FilePort(fd, input, true);
 }
 
-Object *sysStrToFlo(Object *o1)
+// (sys:temporary-file) creates a new, empty file in $TMPDIR or /tmp and returns its name, or #f if it can not be created
+Object *sysTemporaryFile()
 {
-    assertType("str->flo", o1, otString);
-    string strValue = ((String*)o1)->getValue();
-    stringstream sb;
-    sb << strValue;
-    // TODO: Make sure the string consists of digits only!
-    double dValue;
-    if (sb >> dValue) return (Object*) new Flonum(dValue);
-    return Symbol::fromString("nan");
+    const char *directory = getenv("TMPDIR");
+    string pattern = (directory != NULL && *directory != 0 ? string(directory) : string("/tmp")) + "/minscm-XXXXXX";
+    vector<char> name(pattern.begin(), pattern.end());
+    name.push_back(0);
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) return Boolean::getFalse();
+    close(fd);
+    return (Object*) new String(&name[0]);
+}
+
+Object *deleteFile(Object *o)
+{
+    const string& fileName = getString("delete-file", o)->getValue();
+    if (unlink(fileName.c_str()) != 0) error("delete-file: Could not delete file " + fileName);
+    return undefinedSymbol;
+}
+
+Object *openInputFile(Object *o) { return openFile("open-input-file", o, true); }
+Object *openOutputFile(Object *o) { return openFile("open-output-file", o, false); }
+Object *openOutputString() { return (Object*) new StringPort(); }
+Object *currentOutputPort() { return (Object*) getStandardOutput(); }
+Object *isInputPort(Object *o) { return Boolean::valueOf(getType(o) == otFilePort && ((FilePort*)o)->isInput()); }
+
+Object *isOutputPort(Object *o)
+{
+    return Boolean::valueOf(getType(o) == otStringPort || (getType(o) == otFilePort && !((FilePort*)o)->isInput()));
+}
+
+Object *getOutputString(Object *o)
+{
+    assertType("get-output-string", o, otStringPort);
+    return (Object*) new String(((StringPort*)o)->getValue());
+}
+
+Object *readChar(Object *o)
+{
+    int c = getFilePort("read-char", o, true)->read();
+    return c < 0 ? Eof::getInstance() : Char::valueOf(c);
+}
+
+Object *peekChar(Object *o)
+{
+    int c = getFilePort("peek-char", o, true)->peek();
+    return c < 0 ? Eof::getInstance() : Char::valueOf(c);
+}
+
+// (read-line port) returns the next line without its newline, or the eof object
+Object *readLine(Object *o)
+{
+    string line;
+    if (!getFilePort("read-line", o, true)->readLine(&line)) return Eof::getInstance();
+    return (Object*) new String(line);
+}
+
+// (write-char c [port]) and (write-string s [port]) write to the standard output port without a port
+Object *writeChar(Object **arguments, size_t count)
+{
+    if (count < 1 || count > 2) error("write-char: Invalid parameter count");
+    char c = getStringChar("write-char", arguments[0]);
+    writeToPort("write-char", count == 2 ? arguments[1] : (Object*) getStandardOutput(), &c, 1);
+    return undefinedSymbol;
+}
+
+Object *writeString(Object **arguments, size_t count)
+{
+    if (count < 1 || count > 2) error("write-string: Invalid parameter count");
+    const string& s = getString("write-string", arguments[0])->getValue();
+    writeToPort("write-string", count == 2 ? arguments[1] : (Object*) getStandardOutput(), s.data(), s.size());
+    return undefinedSymbol;
+}
+
+Object *flushOutputPort(Object **arguments, size_t count)
+{
+    if (count > 1) error("flush-output-port: Invalid parameter count");
+    Object *port = count == 1 ? arguments[0] : (Object*) getStandardOutput();
+    if (getType(port) == otStringPort) return undefinedSymbol;
+    if (!getFilePort("flush-output-port", port, false)->flush()) error("flush-output-port: Could not write to port");
+    return undefinedSymbol;
+}
+
+Object *closePort(Object *o)
+{
+    if (getType(o) == otStringPort) return undefinedSymbol;
+    assertType("close-port", o, otFilePort);
+    if (!((FilePort*)o)->close()) error("close-port: Could not write to port");
+    return undefinedSymbol;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Object *stringSet(Object *o1, Object *o2, Object *o3)
+{
+    assertType("string-set!", o1, otString);
+    assertType("string-set!", o2, otFixnum);
+    ((String*)o1)->SetAt(Fixnum::getValue(o2), getStringChar("string-set!", o3));
+    return undefinedSymbol;
 }
 
-Object *sysFloToStr(Object *o1)
-{
-    stringstream sb;
-    assertType("flo->str", o1, otFlonum);
+Object *vectorSet(Object *o1, Object *o2, Object *o3)
+{
+    assertType("vector-set!", o1, otVector);
+    assertType("vector-set!", o2, otFixnum);
+    ((Vector*)o1)->SetAt(Fixnum::getValue(o2), o3);
+    return undefinedSymbol;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// Heap images hold everything init.scm leaves behind: The global environment (always object 0), all objects reachable
+// from it and the macros. The image is a sequence of words, starting with the magic and the object count, followed by
+// one record per object and the macro table. A reference to another object is stored as (index + 1) << 2, which has
+// the low bits of a heap pointer, so immediates are stored as they are. Words are written in native byte order; strings
+// are stored as their length followed by their bytes, padded to whole words. File ports can not be saved, they are
+// loaded as closed ports, except for the standard output port.
+#define IMAGE_MAGIC "MinScmI5"
+
+enum ImageProcedureKind { ipLambda, ipBuiltin, ipCompiled };
+
+class ImageWriter
+{
+public:
+    ImageWriter(Environment *global, const map<string, Lambda*> *macros): _global(global), _macros(macros) { }
+
+    void write(ostream *out)
+    {
+        reference(_global);
+        for (map<string, Lambda*>::const_iterator i = _macros->begin(); i != _macros->end(); ++i) reference(i->second);
+        for (size_t i = 0; i < _objects.size(); ++i) writeObject(_objects[i]);
+        writeWord(_macros->size());
+        for (map<string, Lambda*>::const_iterator i = _macros->begin(); i != _macros->end(); ++i)
+        {
+            writeString(i->first);
+            writeWord(reference(i->second));
+        }
+
+        size_t header[2];
+        memcpy(header, IMAGE_MAGIC, sizeof(size_t));
+        header[1] = _objects.size();
+        out->write((const char*)header, sizeof(header));
+        out->write((const char*)&_words[0], _words.size() * sizeof(size_t));
+    }
+
+private:
+    Environment *_global;
+    const map<string, Lambda*> *_macros;
+    vector<Object*> _objects;
+    map<Object*, size_t> _indices;
+    vector<size_t> _words;
+
+    size_t reference(Object *o)
+    {
+        if (o == NULL || !isHeapObject(o)) return (size_t)o;
+        if (!_indices.count(o))
+        {
+            _indices[o] = _objects.size();
+            _objects.push_back(o);
+        }
+        return (_indices[o] + 1) << 2;
+    }
+
+    void writeWord(size_t word) { _words.push_back(word); }
+
+    void writeString(const string& s)
+    {
+        writeWord(s.length());
+        if (s.empty()) return;
+        size_t start = _words.size();
+        _words.resize(start + (s.length() + sizeof(size_t) - 1) / sizeof(size_t), 0);
+        memcpy(&_words[start], s.data(), s.length());
+    }
+
+    void writeObject(Object *o)
+    {
+        writeWord(getType(o));
+        switch (getType(o))
+        {
+        case otPair:
+            writeWord(reference(((Pair*)o)->_car));
+            writeWord(reference(((Pair*)o)->_cdr));
+            break;
+
+        case otVector:
+            writeWord(((Vector*)o)->getLength());
+            for (long i = 0; i < ((Vector*)o)->getLength(); ++i) writeWord(reference(((Vector*)o)->GetAt(i)));
+            break;
+
+        case otString:
+            writeString(((String*)o)->getValue());
+            break;
+
+        case otStringPort:
+            writeString(((StringPort*)o)->getValue());
+            break;
+
+        case otFilePort:
+            writeWord(((FilePort*)o)->isInput());
+            writeWord(o == getStandardOutput());
+            break;
+
+        case otFlonum:
+            {
+                double value = ((Flonum*)o)->getValue();
+                size_t word = 0;
+                memcpy(&word, &value, sizeof(double));
+                writeWord(word);
+            }
+            break;
+
+        case otF64Vector:
+            writeWord(((F64Vector*)o)->getLength());
+            for (size_t i = 0; i < ((F64Vector*)o)->getLength(); ++i)
+            {
+                double value = ((F64Vector*)o)->GetAt(i);
+                size_t word = 0;
+                memcpy(&word, &value, sizeof(double));
+                writeWord(word);
+            }
+            break;
+
+        case otS32Vector:
+            writeWord(((S32Vector*)o)->getLength());
+            for (size_t i = 0; i < ((S32Vector*)o)->getLength(); ++i) writeWord((unsigned int)((S32Vector*)o)->GetAt(i));
+            break;
+
+        case otU8Vector:
+            writeWord(((U8Vector*)o)->getLength());
+            for (size_t i = 0; i < ((U8Vector*)o)->getLength(); ++i) writeWord(((U8Vector*)o)->GetAt(i));
+            break;
+
+        case otBignum:
+            {
+                const Limbs& limbs = ((Bignum*)o)->getLimbs();
+                writeWord(((Bignum*)o)->isNegative());
+                writeWord(limbs.size());
+                for (size_t i = 0; i < limbs.size(); ++i) writeWord(limbs[i]);
+            }
+            break;
+
+        case otSymbol:
+            writeString(((Symbol*)o)->getName());
+            break;
+
+        case otTag:
+            writeWord(reference(((Tag*)o)->_value));
+            break;
+
+        case otFraction:
+            writeWord(reference(((Fraction*)o)->_numerator));
+            writeWord(reference(((Fraction*)o)->_denominator));
+            break;
+
+        case otEnvironment:
+            {
+                Environment *env = (Environment*) o;
+                writeWord(reference(env->_outer));
+                vector<Symbol*> globals;
+                if (env == _global) Symbol::getGlobalSymbols(&globals);
+                writeWord(globals.size());
+                for (size_t i = 0; i < globals.size(); ++i)
+                {
+                    writeWord(reference(globals[i]));
+                    writeWord(reference(globals[i]->getGlobalValue()));
+                }
+                writeWord(env->_slotCount);
+                for (size_t i = 0; i < env->_slotCount; ++i) writeWord(reference(env->_slots[i]));
+            }
+            break;
+
+        case otLocalReference:
+            writeWord(((LocalReference*)o)->_depth);
+            writeWord(((LocalReference*)o)->_index);
+            writeWord(reference(((LocalReference*)o)->_symbol));
+            break;
+
+        case otProcedure:
+            {
+                Procedure *proc = (Procedure*) o;
+                writeWord(proc->isCompiled() ? ipCompiled : proc->isBuiltin() ? ipBuiltin : ipLambda);
+                writeString(proc->getName());
+                if (proc->isCompiled())
+                {
+                    CompiledProcedure *cp = (CompiledProcedure*) o;
+                    writeWord(reference(cp->_code));
+                    writeWord(cp->_closure);
+                    writeWord(reference(cp->_env));
+                    break;
+                }
+                if (proc->isBuiltin()) break;
+
+                Lambda *l = (Lambda*) o;
+                writeWord(reference(l->_body));
+                writeWord(reference(l->_env));
+                writeWord(l->_hasRest);
+                writeWord(l->_argumentNames.size());
+                for (size_t i = 0; i < l->_argumentNames.size(); ++i) writeString(l->_argumentNames[i]);
+            }
+            break;
+
+        case otCode:
+            {
+                Code *code = (Code*) o;
+                writeWord(code->_words.size());
+                for (size_t i = 0; i < code->_words.size(); ++i) writeWord(code->_words[i]);
+                writeWord(code->_closures.size());
+                for (size_t i = 0; i < code->_closures.size(); ++i)
+                {
+                    const ClosureTemplate *closure = &code->_closures[i];
+                    writeString(closure->name);
+                    writeWord(closure->entry);
+                    writeWord(closure->hasRest);
+                    writeWord(closure->argumentNames.size());
+                    for (size_t j = 0; j < closure->argumentNames.size(); ++j) writeString(closure->argumentNames[j]);
+                }
+                writeWord(code->_constants.size());
+                for (size_t i = 0; i < code->_constants.size(); ++i) writeWord(reference(code->_constants[i]));
+            }
+            break;
+
+        default:
+            error("Internal error: Object type can not be written to an image");
+        }
+    }
+};
+
+// Images are read back in two passes: The first one creates all objects, the second one links them.
+class ImageReader
+{
+public:
+    ImageReader(const char *data, size_t size): _words((const size_t*)data), _count(size / sizeof(size_t)), _position(0) { }
+
+    void read(Environment *global, map<string, Lambda*> *macros)
+    {
+        if (_count < 2 || memcmp(_words, IMAGE_MAGIC, sizeof(size_t)) != 0) error("Invalid image file");
+        size_t objectCount = _words[1];
+
+        // Builtin procedures are not part of the image, they are taken from the freshly created global environment
+        vector<Symbol*> globals;
+        Symbol::getGlobalSymbols(&globals);
+        for (size_t i = 0; i < globals.size(); ++i)
+        {
+            Object *value = globals[i]->getGlobalValue();
+            if (getType(value) == otProcedure && ((Procedure*)value)->isBuiltin())
+                _builtins[((Procedure*)value)->getName()] = value;
+        }
+
+        _position = 2;
+        for (size_t i = 0; i < objectCount; ++i)
+        {
+            Object *o = createObject();
+            _objects.push_back(i == 0 ? global : o); // The global environment already exists
+        }
+
+        _position = 2;
+        for (size_t i = 0; i < objectCount; ++i) linkObject(_objects[i]);
+
+        for (size_t i = readWord(); i > 0; --i)
+        {
+            string name = readString();
+            (*macros)[name] = (Lambda*) readReference();
+        }
+    }
+
+private:
+    const size_t *_words;
+    size_t _count;
+    size_t _position;
+    vector<Object*> _objects;
+    map<string, Object*> _builtins;
+
+    size_t readWord()
+    {
+        if (_position >= _count) error("Invalid image file: Unexpected end of file");
+        return _words[_position++];
+    }
+
+    string readString()
+    {
+        size_t length = readWord();
+        size_t words = (length + sizeof(size_t) - 1) / sizeof(size_t);
+        if (length > (_count - _position) * sizeof(size_t)) error("Invalid image file: Unexpected end of file");
+        string ret((const char*)(_words + _position), length);
+        _position += words;
+        return ret;
+    }
+
+    Object *readReference()
+    {
+        size_t word = readWord();
+        if (word == 0 || (word & 3) != 0) return (Object*) word;
+        if ((word >> 2) > _objects.size()) error("Invalid image file: Invalid reference");
+        return _objects[(word >> 2) - 1];
+    }
+
+    void skipWords(size_t count)
+    {
+        if (count > _count - _position) error("Invalid image file: Unexpected end of file");
+        _position += count;
+    }
+
+    Object *createObject()
+    {
+        switch (readWord())
+        {
+        case otPair:
+            skipWords(2);
+            return new Pair(NULL, NULL);
+
+        case otVector:
+            {
+                size_t length = readWord();
+                skipWords(length);
+                return new Vector((long)length);
+            }
+
+        case otString:
+            return new String(readString());
 
-    sb << ((Flonum*)o1)->getValue();
-    string sValue;
-    sb >> sValue;
-    vector<int> characters;
-    for (size_t i=0; i<sValue.size(); ++i) characters.push_back(sValue[i]);
-    return (Object*) new String(characters);
-}
+        case otStringPort:
+            {
+                string value = readString();
+                StringPort *port = new StringPort();
+                port->write(value.data(), value.size());
+                return port;
+            }
 
-//----------------------------------------------------------------------------------------------------------------------
+        case otFilePort:
+            {
+                bool input = readWord() != 0;
+                if (readWord() != 0) return getStandardOutput();
+                return new FilePort(-1, input, true);
+            }
 
-Object *setCar(Object *o, Object *newCar)
-{
-    assertType("set-car!", o, otPair);
-    ((Pair*)o)->_car = newCar;
-    return (Object*) Symbol::fromString("undefined");
-}
+        case otFlonum:
+            {
+                size_t word = readWord();
+                double value;
+                memcpy(&value, &word, sizeof(double));
+                return new Flonum(value);
+            }
 
-Object *setCdr(Object *o, Object *newCdr)
-{
-    assertType("set-cdr!", o, otPair);
-    ((Pair*)o)->_cdr = newCdr;
-    return (Object*) Symbol::fromString("undefined");
-}
+        case otF64Vector:
+            {
+                F64Vector *v = new F64Vector(readWord(), 0);
+                for (size_t i = 0; i < v->getLength(); ++i)
+                {
+                    size_t word = readWord();
+                    double value;
+                    memcpy(&value, &word, sizeof(double));
+                    v->SetAt(i, value);
+                }
+                return v;
+            }
 
-int getFix(const char* procedure, Object *o)
-{
-    assertType(procedure, o, otFixnum);
-    return ((Fixnum*)o)->getValue();
-}
+        case otS32Vector:
+            {
+                S32Vector *v = new S32Vector(readWord(), 0);
+                for (size_t i = 0; i < v->getLength(); ++i) v->SetAt(i, (int)(unsigned int)readWord());
+                return v;
+            }
 
-double getFlo(const char* procedure, Object *o)
-{
-    assertType(procedure, o, otFlonum);
-    return ((Flonum*)o)->getValue();
-}
+        case otU8Vector:
+            {
+                U8Vector *v = new U8Vector(readWord(), 0);
+                for (size_t i = 0; i < v->getLength(); ++i) v->SetAt(i, (unsigned char)readWord());
+                return v;
+            }
 
-Object *cons(Object *car, Object *cdr) { return (Object*) new Pair(car, cdr); }
-Object *fixPlus(Object *o1, Object *o2) { return (Object*) new Fixnum(getFix("fix+", o1) + getFix("fix+", o2)); }
-Object *fixMinus(Object *o1, Object *o2) { return (Object*) new Fixnum(getFix("fix-", o1) - getFix("fix-", o2)); }
-Object *fixMult(Object *o1, Object *o2) { return (Object*) new Fixnum(getFix("fix*", o1) * getFix("fix*", o2)); }
-Object *fixDiv(Object *o1, Object *o2) { return (Object*) new Fixnum(getFix("fix/", o1) / getFix("fix/", o2)); }
-Object *fixMod(Object *o1, Object *o2) { return (Object*) new Fixnum(getFix("fix%", o1) % getFix("fix%", o2)); }
-Object *fixLt(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(getFix("fix<", o1) < getFix("fix<", o2)); }
-Object *fixEq(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(getFix("fix=", o1) == getFix("fix=", o2)); }
-Object *floPlus(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo+", o1) + getFlo("flo+", o2)); }
-Object *floMinus(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo-", o1) - getFlo("flo-", o2)); }
-Object *floMult(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo*", o1) * getFlo("flo*", o2)); }
-Object *floDiv(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo/", o1) / getFlo("flo/", o2)); }
-//TODO Object *floMod(Object *o1, Object *o2) { return (Object*) new Flonum(getFlo("flo%", o1) % getFlo("flo%", o2)); }
-Object *floLt(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(getFlo("flo<", o1) < getFlo("flo<", o2)); }
-Object *floEq(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(getFlo("flo=", o1) == getFlo("flo=", o2)); }
-Object *eq(Object *o1, Object *o2) { return (Object*) Boolean::valueOf(o1 == o2); }
+        case otBignum:
+            {
+                bool negative = readWord() != 0;
+                Limbs limbs(readWord());
+                for (size_t i = 0; i < limbs.size(); ++i) limbs[i] = (unsigned int)readWord();
+                return new Bignum(negative, limbs);
+            }
 
-Object* applyHack(Object *form, Environment *env);
+        case otSymbol:
+            return Symbol::fromString(readString());
 
-Object *apply(Object *o, Object *args)
-{
-    assertType("apply", o, otProcedure);
-    Procedure *proc = (Procedure*) o;
-    vector<Object*> params;
-    if (args->getType() != otNull && args->getType() != otPair) error("apply: Invalid argument type");
-    for (Object *i = args; i->getType() == otPair; i = ((Pair*)i)->_cdr) params.push_back(((Pair*)i)->_car);
+        case otTag:
+            skipWords(1);
+            return new Tag(NULL);
 
-    if (proc->isBuiltin()) return proc->call(&params);
+        case otFraction:
+            skipWords(2);
+            return new Fraction(NULL, NULL);
 
-    Lambda *l = (Lambda*) proc;
-    Environment *expandEnv = l->getCapturedEnvironment()->extendIntoNew(l->getArgumentNames(), &params, l->hasRestParameter());
-    return applyHack(l->getBody(), expandEnv);
-} 
+        case otEnvironment:
+            {
+                skipWords(1);
+                skipWords(2 * readWord());
+                skipWords(readWord());
+                return new Environment(NULL);
+            }
 
-Object *stringRef(Object *o1, Object *o2)
-{
-    assertType("string-ref", o1, otString);
-    assertType("string-ref", o2, otFixnum);
-    return (Object*) new Char(((String*)o1)->GetAt(((Fixnum*)o2)->getValue()));
-}
+        case otLocalReference:
+            {
+                size_t depth = readWord();
+                size_t index = readWord();
+                skipWords(1);
+                return new LocalReference(depth, index, NULL);
+            }
 
-Object *vectorRef(Object *o1, Object *o2)
-{
-    assertType("vector-ref", o1, otVector);
-    assertType("vector-ref", o2, otFixnum);
-    return (Object*) ((Vector*)o1)->GetAt(((Fixnum*)o2)->getValue());
-}
+        case otProcedure:
+            {
+                size_t kind = readWord();
+                string name = readString();
+                if (kind == ipCompiled)
+                {
+                    skipWords(1);
+                    long closure = readWord();
+                    skipWords(1);
+                    return new CompiledProcedure(name, NULL, closure, NULL);
+                }
+                if (kind == ipBuiltin)
+                {
+                    if (!_builtins.count(name)) error("Invalid image file: Unknown builtin procedure " + name);
+                    return _builtins[name];
+                }
 
-Object *sysStrToFix(Object *o1, Object *o2)
-{
-    assertType("str->fix", o1, otString);
-    assertType("str->fix", o2, otFixnum);
-    string strValue = ((String*)o1)->getValue();
-    long base = ((Fixnum*)o2)->getValue();
-    stringstream sb;
-    switch(base)
-    {
-    case 2: error("str->fix: Base 2 not implemented yet"); return NULL; // TODO
-    case 8: sb << oct; break;
-    case 10: sb << dec; break;
-    case 16: sb << hex; break;
-    default: error("str->fix: Invalid base"); return NULL;
-    }
+                skipWords(2);
+                bool hasRest = readWord() != 0;
+                vector<string> argumentNames(readWord());
+                for (size_t i = 0; i < argumentNames.size(); ++i) argumentNames[i] = readString();
+                return new Lambda(name, (Object*) Null::getInstance(), NULL, argumentNames, hasRest);
+            }
 
-    sb << strValue;
-    long lValue;
-    char c;
-    if (sb >> lValue && !(sb.get(c))) return (Object*) new Fixnum(lValue);
-    return Symbol::fromString("nan");
-}
+        case otCode:
+            {
+                Code *code = new Code();
+                code->_words.resize(readWord());
+                for (size_t i = 0; i < code->_words.size(); ++i) code->_words[i] = readWord();
+                code->_closures.resize(readWord());
+                for (size_t i = 0; i < code->_closures.size(); ++i)
+                {
+                    ClosureTemplate *closure = &code->_closures[i];
+                    closure->name = readString();
+                    closure->entry = readWord();
+                    closure->hasRest = readWord() != 0;
+                    closure->argumentNames.resize(readWord());
+                    for (size_t j = 0; j < closure->argumentNames.size(); ++j) closure->argumentNames[j] = readString();
+                }
+                skipWords(readWord());
+                return code;
+            }
 
-Object *sysFixToStr(Object *o1, Object *o2)
-{
-    stringstream sb;
-    assertType("fix->str", o1, otFixnum);
-    assertType("fix->str", o2, otFixnum);
-    long base = ((Fixnum*)o2)->getValue();
+        default:
+            error("Invalid image file: Unknown object type");
+            return NULL; // Just to keep the compiler happy
+        }
+    }
 
-    switch(base)
+    void linkObject(Object *o)
     {
-    case 2: error("fix->str: Base 2 not implemented yet"); return NULL; // TODO
-    case 8: sb << oct; break;
-    case 10: sb << dec; break;
-    case 16: sb << hex; break;
-    default: error("fix->str: Invalid base"); return NULL;
-    }
+        switch (readWord())
+        {
+        case otPair:
+            ((Pair*)o)->_car = readReference();
+            ((Pair*)o)->_cdr = readReference();
+            gcWriteBarrier(((Pair*)o)->_car);
+            gcWriteBarrier(((Pair*)o)->_cdr);
+            break;
 
-    sb << ((Fixnum*)o1)->getValue();
-    string sValue;
-    sb >> sValue;
-    vector<int> characters;
-    for (size_t i=0; i<sValue.size(); ++i) characters.push_back(sValue[i]);
-    return (Object*) new String(characters);
-}
+        case otVector:
+            for (long i = readWord(), j = 0; j < i; ++j) ((Vector*)o)->SetAt(j, readReference());
+            break;
 
-//----------------------------------------------------------------------------------------------------------------------
+        case otString:
+        case otStringPort:
+            readString();
+            break;
 
-Object *stringSet(Object *o1, Object *o2, Object *o3)
-{
-    assertType("string-set!", o1, otString);
-    assertType("string-set!", o2, otFixnum);
-    assertType("string-set!", o3, otChar);
-    ((String*)o1)->SetAt(((Fixnum*)o2)->getValue(), ((Char*)o3)->getValue());
-    return Symbol::fromString("undefined");
-}
+        case otFilePort:
+            skipWords(2);
+            break;
 
-Object *vectorSet(Object *o1, Object *o2, Object *o3)
-{
-    assertType("vector-set!", o1, otVector);
-    assertType("vector-set!", o2, otFixnum);
-    ((Vector*)o1)->SetAt(((Fixnum*)o2)->getValue(), o3);
-    return Symbol::fromString("undefined");
-}
+        case otFlonum:
+            skipWords(1);
+            break;
+
+        case otBignum:
+            skipWords(1);
+            skipWords(readWord());
+            break;
+
+        case otF64Vector:
+        case otS32Vector:
+        case otU8Vector:
+            skipWords(readWord());
+            break;
+
+        case otSymbol:
+            readString();
+            break;
+
+        case otTag:
+            ((Tag*)o)->_value = readReference();
+            gcWriteBarrier(((Tag*)o)->_value);
+            break;
+
+        case otFraction:
+            ((Fraction*)o)->_numerator = readReference();
+            ((Fraction*)o)->_denominator = readReference();
+            gcWriteBarrier(((Fraction*)o)->_numerator);
+            gcWriteBarrier(((Fraction*)o)->_denominator);
+            break;
+
+        case otEnvironment:
+            {
+                Environment *env = (Environment*) o;
+                env->_outer = (Environment*) readReference();
+                gcWriteBarrier(env->_outer);
+                for (size_t i = readWord(); i > 0; --i)
+                {
+                    Symbol *symbol = (Symbol*) readReference();
+                    if (getType(symbol) != otSymbol) error("Invalid image file: Global variable without a name");
+                    symbol->setGlobalValue(readReference());
+                }
+                env->resizeSlots(readWord());
+                for (size_t i = 0; i < env->_slotCount; ++i)
+                {
+                    env->_slots[i] = readReference();
+                    gcWriteBarrier(env->_slots[i]);
+                }
+            }
+            break;
+
+        case otLocalReference:
+            skipWords(2);
+            ((LocalReference*)o)->_symbol = (Symbol*) readReference();
+            break;
+
+        case otProcedure:
+            {
+                size_t kind = readWord();
+                readString();
+                if (kind == ipCompiled)
+                {
+                    CompiledProcedure *cp = (CompiledProcedure*) o;
+                    cp->_code = (Code*) readReference();
+                    skipWords(1);
+                    cp->_env = (Environment*) readReference();
+                    gcWriteBarrier(cp->_code);
+                    gcWriteBarrier(cp->_env);
+                    break;
+                }
+                if (kind == ipBuiltin) break;
+
+                Lambda *l = (Lambda*) o;
+                l->_body = readReference();
+                l->_env = (Environment*) readReference();
+                gcWriteBarrier(l->_body);
+                gcWriteBarrier(l->_env);
+                skipWords(1);
+                for (size_t i = readWord(); i > 0; --i) readString();
+            }
+            break;
+
+        case otCode:
+            {
+                Code *code = (Code*) o;
+                skipWords(readWord());
+                for (size_t i = readWord(); i > 0; --i)
+                {
+                    readString();
+                    skipWords(2);
+                    for (size_t j = readWord(); j > 0; --j) readString();
+                }
+                code->_constants.resize(readWord());
+                for (size_t i = 0; i < code->_constants.size(); ++i)
+                {
+                    code->_constants[i] = readReference();
+                    gcWriteBarrier(code->_constants[i]);
+                }
+            }
+            break;
+        }
+    }
+};
 
 //----------------------------------------------------------------------------------------------------------------------
 
+#define DEFUN0(name, lispName) _global.define(lispName, new NullaryProcedure(lispName, &name))
 #define DEFUN1(name, lispName) _global.define(lispName, new UnaryProcedure(lispName, &name))
 #define DEFUN2(name, lispName) _global.define(lispName, new BinaryProcedure(lispName, &name))
 #define DEFUN3(name, lispName) _global.define(lispName, new TrinaryProcedure(lispName, &name))
+#define DEFUNV(name, lispName) _global.define(lispName, new VariadicProcedure(lispName, &name))
 
-class Interpreter
+class Interpreter: public GcRoots
 {
 public:
     Interpreter()
     {
         _global.define("print-eval-forms", (Object*) Null::getInstance());
 
+        DEFUN0(sysGcStats, "sys:gc-stats");
+        DEFUN0(sysRuntime, "sys:runtime");
+
         DEFUN1(car, "car");
         DEFUN1(cdr, "cdr");
         DEFUN1(sysType, "type");
@@ -1035,13 +5424,19 @@ public:
         DEFUN1(stringToSymbol, "string->symbol");
         DEFUN1(symbolToString, "symbol->string");
         DEFUN1(vectorLength, "vector-length");
-        DEFUN1(makeString, "make-string");
         DEFUN1(makeVector, "make-vector");
         DEFUN1(sysDisplayString, "display-string");
         DEFUN1(sysExit, "exit");
         DEFUN1(sysStrToFlo, "str->flo");
         DEFUN1(sysFloToStr, "flo->str");
         DEFUN1(sysFixToFlo, "fix->flo");
+        DEFUN1(sysBiToFlo, "bi->flo");
+        DEFUN1(numerator, "numerator");
+        DEFUN1(denominator, "denominator");
+        DEFUN1(sysSetGcMaxPause, "sys:set-gc-max-pause!");
+        DEFUN1(sysSetGcLog, "sys:set-gc-log!");
+        DEFUN1(sysExecute, "sys:execute");
+        DEFUN1(sysSetJit, "sys:set-jit!");
 
         DEFUN2(cons, "cons");
         DEFUN2(setCar, "set-car!");
@@ -1062,39 +5457,197 @@ public:
 //TODO        DEFUN2(floMod, "flo%");
         DEFUN2(eq, "eq?");
         DEFUN2(apply, "sys:apply");
+        DEFUN1(sysErrorMessage, "sys:error-message");
         DEFUN2(stringRef, "string-ref");
         DEFUN2(vectorRef, "vector-ref");
         DEFUN2(sysStrToFix, "str->fix");
         DEFUN2(sysFixToStr, "fix->str");
+        DEFUN2(sysStrToRat, "str->rat");
+        DEFUN2(sysRatToStr, "rat->str");
 
         DEFUN3(stringSet, "string-set!");
         DEFUN3(vectorSet, "vector-set!");
 
-        ifstream in("init.scm");
-        evalAll(in);
+        DEFUNV(numberPlus, "+");
+        DEFUNV(numberMinus, "-");
+        DEFUNV(numberMult, "*");
+        DEFUNV(numberDiv, "/");
+        DEFUNV(numberLt, "<");
+        DEFUNV(numberGt, ">");
+        DEFUNV(numberLe, "<=");
+        DEFUNV(numberGe, ">=");
+        DEFUNV(numberEq, "=");
+        DEFUNV(numberMin, "min");
+        DEFUNV(numberMax, "max");
+        DEFUNV(numberGcd, "gcd");
+        DEFUNV(numberLcm, "lcm");
+
+        DEFUN1(sysSetSimd, "sys:set-simd!");
+        DEFUNV(makeNumericVector<F64Vector>, "make-f64vector");
+        DEFUNV(numericVector<F64Vector>, "f64vector");
+        DEFUN1(numericVectorLength<F64Vector>, "f64vector-length");
+        DEFUN2(numericVectorRef<F64Vector>, "f64vector-ref");
+        DEFUN3(numericVectorSet<F64Vector>, "f64vector-set!");
+        DEFUN1(numericVectorToList<F64Vector>, "f64vector->list");
+        DEFUN1(listToNumericVector<F64Vector>, "list->f64vector");
+        DEFUNV(makeNumericVector<S32Vector>, "make-s32vector");
+        DEFUNV(numericVector<S32Vector>, "s32vector");
+        DEFUN1(numericVectorLength<S32Vector>, "s32vector-length");
+        DEFUN2(numericVectorRef<S32Vector>, "s32vector-ref");
+        DEFUN3(numericVectorSet<S32Vector>, "s32vector-set!");
+        DEFUN1(numericVectorToList<S32Vector>, "s32vector->list");
+        DEFUN1(listToNumericVector<S32Vector>, "list->s32vector");
+        DEFUNV(makeNumericVector<U8Vector>, "make-u8vector");
+        DEFUNV(numericVector<U8Vector>, "u8vector");
+        DEFUN1(numericVectorLength<U8Vector>, "u8vector-length");
+        DEFUN2(numericVectorRef<U8Vector>, "u8vector-ref");
+        DEFUN3(numericVectorSet<U8Vector>, "u8vector-set!");
+        DEFUN1(numericVectorToList<U8Vector>, "u8vector->list");
+        DEFUN1(listToNumericVector<U8Vector>, "list->u8vector");
+        DEFUN2(f64VectorAdd, "f64vector-add!");
+        DEFUN2(f64VectorScale, "f64vector-scale!");
+        DEFUN2(f64VectorDot, "f64vector-dot");
+        DEFUN1(f64VectorSum, "f64vector-sum");
+        DEFUN1(f64VectorMin, "f64vector-min");
+        DEFUN1(f64VectorMax, "f64vector-max");
+        DEFUNV(f64VectorMap, "f64vector-map");
+
+        DEFUNV(makeString, "make-string");
+        DEFUNV(stringOfChars, "string");
+        DEFUN1(stringCopy, "string-copy");
+        DEFUN1(stringToList, "string->list");
+        DEFUN1(listToString, "list->string");
+        DEFUN2(stringFill, "string-fill!");
+        DEFUN3(substring, "substring");
+        DEFUN2(stringEq, "string=?");
+        DEFUN2(stringLt, "string<?");
+        DEFUN2(stringGt, "string>?");
+        DEFUN2(stringLe, "string<=?");
+        DEFUN2(stringGe, "string>=?");
+        DEFUN2(stringCiEq, "string-ci=?");
+        DEFUN2(stringCiLt, "string-ci<?");
+        DEFUN2(stringCiGt, "string-ci>?");
+        DEFUN2(stringCiLe, "string-ci<=?");
+        DEFUN2(stringCiGe, "string-ci>=?");
+        DEFUNV(stringIndex, "string-index");
+        DEFUNV(stringSearch, "string-search");
+        DEFUN2(stringSplit, "string-split");
+        DEFUNV(stringAppend, "string-append");
+        DEFUN1(openInputFile, "open-input-file");
+        DEFUN1(openOutputFile, "open-output-file");
+        DEFUN1(deleteFile, "delete-file");
+        DEFUN0(sysTemporaryFile, "sys:temporary-file");
+        DEFUN0(openOutputString, "open-output-string");
+        DEFUN1(getOutputString, "get-output-string");
+        DEFUN0(currentOutputPort, "current-output-port");
+        DEFUN1(isInputPort, "input-port?");
+        DEFUN1(isOutputPort, "output-port?");
+        DEFUN1(readChar, "read-char");
+        DEFUN1(peekChar, "peek-char");
+        DEFUN1(readLine, "read-line");
+        DEFUNV(writeChar, "write-char");
+        DEFUNV(writeString, "write-string");
+        DEFUNV(flushOutputPort, "flush-output-port");
+        DEFUN1(closePort, "close-port");
+        DEFUN2(quotient, "quotient");
+        DEFUN2(remainder, "remainder");
+        DEFUN2(modulo, "modulo");
+    }
+
+    void loadInitFile()
+    {
+        evalFile("init.scm");
         
         ifstream in2("init.scm");
-        vector<int> str;
-        while (in2) str.push_back((int) in2.get());
+        string str;
+        while (in2) str += (char) in2.get();
         _global.define("gaga", new String(str));
     }
 
-    Object* eval(string expression)
+    // Like images, source files are mapped instead of read, so the reader scans the file's pages in place. Anything that
+    // can not be mapped, like a pipe, is read into memory first.
+    void evalFile(const string& fileName)
     {
-        stringstream sb;
-        sb << expression;
-        return evalAll(sb);
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) error("Could not open file " + fileName);
+        struct stat st;
+        void *data = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+            ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (data == MAP_FAILED)
+        {
+            string contents;
+            char buffer[65536];
+            ssize_t count;
+            while ((count = read(fd, buffer, sizeof(buffer))) > 0) contents.append(buffer, count);
+            close(fd);
+            evalAll(contents.data(), contents.size());
+            return;
+        }
+        close(fd);
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+        try
+        {
+            evalAll((const char*)data, st.st_size);
+        }
+        catch (int)
+        {
+            munmap(data, st.st_size);
+            throw;
+        }
+        munmap(data, st.st_size);
+    }
+
+    void dumpImage(const string& fileName)
+    {
+        ofstream out(fileName.c_str(), ios::binary);
+        if (!out) error("Could not create image " + fileName);
+        ImageWriter(&_global, &_macros).write(&out);
+        if (!out) error("Could not write image " + fileName);
+    }
+
+    // The image is mapped instead of read, so only the pages actually needed are touched
+    void loadImage(const string& fileName)
+    {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) error("Could not open image " + fileName);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); error("Invalid image file"); }
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) error("Could not map image " + fileName);
+
+        try
+        {
+            ImageReader((const char*)data, st.st_size).read(&_global, &_macros);
+        }
+        catch (int)
+        {
+            munmap(data, st.st_size);
+            throw;
+        }
+        munmap(data, st.st_size);
+    }
+
+    Object* eval(const string& expression)
+    {
+        return evalAll(expression.data(), expression.size());
     }
 
+    // The original tree walking evaluator, which is only used while print-eval-forms is set. Compiled code runs much
+    // faster, but knows nothing about the forms any more.
     Object* evalExpandedForm(Object *form, Environment *env)
     {
+        GcRoot formRoot(&form);
+        GcRoot envRoot((Object**)&env);
+
 tailCall:
-        if (_global.get("print-eval-forms")->getType() != otNull)
-            cout << "evalExpandedForm: " << form->toString() << endl;
+        if (getType(_global.get(printEvalFormsSymbol)) != otNull)
+            cout << "evalExpandedForm: " << toString(form) << endl;
 
-        if (needToRunGC) gc();
+        if (needToRunGC) collectGarbage();
 
-        switch (form->getType())
+        switch (getType(form))
         {
         case otNull:
             error("eval: Empty list can not be evaluated");
@@ -1105,14 +5658,22 @@ tailCall:
             return NULL; // Just to keep the compiler happy
 
         case otSymbol:
-            return env->get(((Symbol*)form)->getName());
+            return _global.get((Symbol*)form);
+
+        case otLocalReference:
+            {
+                LocalReference *ref = (LocalReference*) form;
+                Object *value = env->getSlot(ref->getDepth(), ref->getIndex());
+                if (value == NULL) error("Unknown variable '" + ref->getSymbol()->getName() + "'");
+                return value;
+            }
 
         case otPair:
             {
                 Pair *asPair = (Pair*) form;
-                if (asPair->_car->getType() == otSymbol)
+                if (getType(asPair->_car) == otSymbol)
                 {
-                    string sym = ((Pair*)form)->_car->toString();
+                    string sym = toString(((Pair*)form)->_car);
                     if (sym == "define") return evalDefine(asPair, env);
                     if (sym == "set!") return evalSet(asPair, env);
                     if (sym == "lambda") return evalLambda(asPair, env);
@@ -1120,20 +5681,20 @@ tailCall:
 
                     if (sym == "if")
                     {
-                        if (asPair->_cdr->getType() != otPair) error("eval: Invalid if form");
+                        if (getType(asPair->_cdr) != otPair) error("eval: Invalid if form");
                         Object *condition = ((Pair*)asPair->_cdr)->_car;
                         Object *rest = ((Pair*)asPair->_cdr)->_cdr;
-                        if (rest->getType() != otPair) error("eval: Invalid if form");
+                        if (getType(rest) != otPair) error("eval: Invalid if form");
                         Pair *restAsPair = (Pair*) rest;
                         Object *thenPart = restAsPair->_car;
                         rest = restAsPair->_cdr;
-                        if (rest->getType() != otPair) error("eval: Invalid if form");
+                        if (getType(rest) != otPair) error("eval: Invalid if form");
                         restAsPair = (Pair*) rest;
                         Object *elsePart = restAsPair->_car;
-                        if (restAsPair->_cdr->getType() != otNull) error("eval: Invalid if form");
+                        if (getType(restAsPair->_cdr) != otNull) error("eval: Invalid if form");
 
                         Object *conditionValue = evalExpandedForm(condition, env);
-                        form = (conditionValue->getType() != otBoolean || ((Boolean*)conditionValue)->getValue()) ? thenPart : elsePart;
+                        form = conditionValue != Boolean::getFalse() ? thenPart : elsePart;
                         goto tailCall;
                     }
 
@@ -1141,12 +5702,12 @@ tailCall:
                     {
                         for (Object *i = asPair->_cdr; ;)
                         {
-                            if (i->getType() == otNull) error("eval: Invalid begin form");
-                            if (i->getType() != otPair) error("eval: Dotted list not allowed in begin form");
+                            if (getType(i) == otNull) error("eval: Invalid begin form");
+                            if (getType(i) != otPair) error("eval: Dotted list not allowed in begin form");
 
                             Pair *p = (Pair*) i;
 
-                            if (p->_cdr->getType() == otNull)
+                            if (getType(p->_cdr) == otNull)
                             {
                                 // Execute last form in tail position
                                 form = ((Pair*)i)->_car;
@@ -1160,29 +5721,32 @@ tailCall:
                 }
 
                 Object *function = evalExpandedForm(asPair->_car, env);
-                vector<Object*> *parameters = new vector<Object*>();
+                GcRoot functionRoot(&function);
+                size_t base = valueStackTop;
 
                 for (Object *i = asPair->_cdr; ;)
                 {
-                    if (i->getType() == otNull) break;
-                    if (i->getType() != otPair) error("eval: Dotted list not allowed in function call");
+                    if (getType(i) == otNull) break;
+                    if (getType(i) != otPair) error("eval: Dotted list not allowed in function call");
                     Pair *p = (Pair*) i;
-                    parameters->push_back(evalExpandedForm(p->_car, env));
+                    pushValue(evalExpandedForm(p->_car, env));
                     i = p->_cdr;
                 }
 
-                if (function->getType() != otProcedure)
-                    error("eval: '" + function->toString() + "' is not callable");
+                if (getType(function) != otProcedure)
+                    error("eval: '" + toString(function) + "' is not callable");
 
+                size_t count = valueStackTop - base;
+                valueStackTop = base;
                 if (((Procedure*)function)->isBuiltin())
                 {
-                    return ((Procedure*)function)->call(parameters);
+                    return ((Procedure*)function)->call(valueStack + base, count);
                 }
                 else
                 {
                     Lambda *l = (Lambda*)function;
                     form = l->getBody();
-                    env =  l->getCapturedEnvironment()->extendIntoNew(l->getArgumentNames(), parameters, l->hasRestParameter());
+                    env =  l->getCapturedEnvironment()->extendIntoNew(l->getArgumentNames(), valueStack + base, count, l->hasRestParameter());
                     goto tailCall;
                 }
             }
@@ -1191,99 +5755,220 @@ tailCall:
         }
     }
 
+    void collectGarbage() { gc(this); }
+
+    void getRoots(vector<Object*> *dest) const
+    {
+        _global.getReferences(dest);
+        for (map<string, Lambda*>::const_iterator i = _macros.begin(); i != _macros.end(); ++i) dest->push_back(i->second);
+    }
+
 private:
     Environment _global;
     map<string, Lambda*> _macros;
 
-    Object *evalAll(istream& in)
+    Object *evalAll(const char *data, size_t length)
     {
-        Reader rd(&in);
+        Reader rd(data, length);
         Object *ret = (Object*) Null::getInstance();
-        for (Object *o=rd.read(false); o->getType() != otEof; o=rd.read(false))
+        Object *o = NULL;
+        GcRoot retRoot(&ret);
+        GcRoot formRoot(&o);
+        for (o=rd.read(false); getType(o) != otEof; o=rd.read(false))
         {
             handleMacros(&o);
-            //cout << endl << "eval: " << o->toString() << endl;
-            ret = evalExpandedForm(o, &_global);
+            vector<vector<Symbol*> > scopes;
+            o = resolve(o, &scopes);
+            //cout << endl << "eval: " << toString(o) << endl;
+            if (getType(_global.get(printEvalFormsSymbol)) != otNull) ret = evalExpandedForm(o, &_global);
+            else ret = execute(compile(o), &_global);
         }
         return ret;
     }
 
     void handleMacros(Object **obj)
     {
-        if ((*obj)->getType() != otPair) return;
+        if (getType(*obj) != otPair) return;
         for (;;) if (!expandMacros(obj)) break;
         Pair *asPair = (Pair*) *obj;
-        if (asPair->_car->getType() != otSymbol) return;
-        if (asPair->_car->toString() != "defmacro") return;
-
-        if (asPair->_cdr->getType() != otPair) error("Invalid defmacro form: Expected (defmacro name (parameters) form ...)");
-        if (((Pair*)asPair->_cdr)->_car->getType() != otSymbol) error("Invalid defmacro form: Name must be a symbol");
-        string name = ((Pair*)asPair->_cdr)->_car->toString();
-        if (((Pair*)asPair->_cdr)->_cdr->getType() != otPair) error("Invalid defmacro form");
-        _macros[name] = (Lambda*) evalLambda((Pair*)((Pair*)asPair->_cdr), &_global);
+        if (getType(asPair->_car) != otSymbol) return;
+        if (toString(asPair->_car) != "defmacro") return;
+
+        if (getType(asPair->_cdr) != otPair) error("Invalid defmacro form: Expected (defmacro name (parameters) form ...)");
+        if (getType(((Pair*)asPair->_cdr)->_car) != otSymbol) error("Invalid defmacro form: Name must be a symbol");
+        string name = toString(((Pair*)asPair->_cdr)->_car);
+        if (getType(((Pair*)asPair->_cdr)->_cdr) != otPair) error("Invalid defmacro form");
+        Pair *nameAndLambda = (Pair*) asPair->_cdr;
+        Pair *parametersAndBody = (Pair*) nameAndLambda->_cdr;
+        vector<vector<Symbol*> > scopes;
+        Object *body = resolveBody(parametersAndBody->_car, parametersAndBody->_cdr, &scopes);
+        _macros[name] = (Lambda*) evalLambda(new Pair(nameAndLambda->_car, new Pair(parametersAndBody->_car, body)), &_global);
         *obj = (Object*) Boolean::getTrue();
     }
 
     bool expandMacros(Object **obj)
     {
-        if ((*obj)->getType() != otPair) return false;
+        if (getType(*obj) != otPair) return false;
         Pair *asPair = (Pair*) *obj;
-        if (asPair->_car == Symbol::fromString("quote")) return false;
+        if (asPair->_car == quoteSymbol) return false;
 
-        for (Object *i = *obj; i->getType() == otPair; i = ((Pair*)i)->_cdr)
+        for (Object *i = *obj; getType(i) == otPair; i = ((Pair*)i)->_cdr)
             if (expandMacros(&((Pair*)i)->_car))
                 return true;
 
-        if (asPair->_car->getType() != otSymbol) return false;
-        string sym = asPair->_car->toString();
+        if (getType(asPair->_car) != otSymbol) return false;
+        string sym = toString(asPair->_car);
         if (!_macros.count(sym)) return false;
 
         Lambda *l = _macros[sym];
-        vector<Object*> params;
-        for (Object *i = asPair->_cdr; i->getType() == otPair; i = ((Pair*)i)->_cdr) params.push_back(((Pair*)i)->_car);
-        Environment *expandEnv = l->getCapturedEnvironment()->extendIntoNew(l->getArgumentNames(), &params, l->hasRestParameter());
-        //cout << endl << "expandMacro: " << l->getBody()->toString() << endl;
-        *obj = evalExpandedForm(l->getBody(), expandEnv);
+        size_t base = valueStackTop;
+        for (Object *i = asPair->_cdr; getType(i) == otPair; i = ((Pair*)i)->_cdr) pushValue(((Pair*)i)->_car);
+        //cout << endl << "expandMacro: " << toString(l->getBody()) << endl;
+        *obj = callLambda(l, base);
+        gcWriteBarrier(*obj);
         return true;
     }
 
+    // Replaces the references to local variables in an expanded form by LocalReferences, so they need not be looked
+    // up by name at runtime. scopes holds the variables of the enclosing lambdas, the innermost one last. Symbols not
+    // found in any of them are left alone and refer to global variables. Malformed special forms are copied as they
+    // are, evalExpandedForm reports them.
+    Object* resolve(Object *form, vector<vector<Symbol*> > *scopes)
+    {
+        if (getType(form) == otSymbol) return resolveVariable(form, scopes);
+        if (getType(form) != otPair) return form;
+
+        Pair *asPair = (Pair*) form;
+        if (asPair->_car == quoteSymbol) return form;
+
+        if (asPair->_car == lambdaSymbol && getType(asPair->_cdr) == otPair)
+        {
+            Pair *parametersAndBody = (Pair*) asPair->_cdr;
+            Object *body = resolveBody(parametersAndBody->_car, parametersAndBody->_cdr, scopes);
+            return new Pair(lambdaSymbol, new Pair(parametersAndBody->_car, body));
+        }
+
+        if (asPair->_car == defineSymbol && getType(asPair->_cdr) == otPair && getType(((Pair*)asPair->_cdr)->_car) == otPair)
+        {
+            Pair *nameAndParameters = (Pair*) ((Pair*)asPair->_cdr)->_car;
+            Object *body = resolveBody(nameAndParameters->_cdr, ((Pair*)asPair->_cdr)->_cdr, scopes);
+            Object *name = resolveVariable(nameAndParameters->_car, scopes);
+            return new Pair(defineSymbol, new Pair(new Pair(name, nameAndParameters->_cdr), body));
+        }
+
+        Object *head = isSpecialForm(asPair->_car) ? asPair->_car : resolve(asPair->_car, scopes);
+        return new Pair(head, resolveList(asPair->_cdr, scopes));
+    }
+
+    Object* resolveList(Object *forms, vector<vector<Symbol*> > *scopes)
+    {
+        if (getType(forms) != otPair) return forms;
+        Object *first = resolve(((Pair*)forms)->_car, scopes);
+        return new Pair(first, resolveList(((Pair*)forms)->_cdr, scopes));
+    }
+
+    // The body of a lambda gets a new scope, holding its parameters and everything it defines
+    Object* resolveBody(Object *parameters, Object *body, vector<vector<Symbol*> > *scopes)
+    {
+        vector<Symbol*> variables;
+        Object *i = parameters;
+        for (; getType(i) == otPair; i = ((Pair*)i)->_cdr)
+            if (getType(((Pair*)i)->_car) == otSymbol) variables.push_back((Symbol*)((Pair*)i)->_car);
+        if (getType(i) == otSymbol) variables.push_back((Symbol*)i);
+        for (i = body; getType(i) == otPair; i = ((Pair*)i)->_cdr) collectDefinitions(((Pair*)i)->_car, &variables);
+
+        scopes->push_back(variables);
+        Object *ret = resolveList(body, scopes);
+        scopes->pop_back();
+        return ret;
+    }
+
+    // A define anywhere in a lambda body, except in nested lambdas, defines a variable of that lambda
+    void collectDefinitions(Object *form, vector<Symbol*> *variables)
+    {
+        if (getType(form) != otPair) return;
+        Pair *asPair = (Pair*) form;
+        if (asPair->_car == quoteSymbol || asPair->_car == lambdaSymbol) return;
+
+        if (asPair->_car == defineSymbol && getType(asPair->_cdr) == otPair)
+        {
+            Object *name = ((Pair*)asPair->_cdr)->_car;
+            bool isProcedure = getType(name) == otPair;
+            if (isProcedure) name = ((Pair*)name)->_car;
+            if (getType(name) == otSymbol && findVariable((Symbol*)name, variables) < 0) variables->push_back((Symbol*)name);
+            if (isProcedure) return;
+        }
+
+        for (Object *i = asPair->_cdr; getType(i) == otPair; i = ((Pair*)i)->_cdr) collectDefinitions(((Pair*)i)->_car, variables);
+    }
+
+    Object* resolveVariable(Object *symbol, vector<vector<Symbol*> > *scopes)
+    {
+        if (getType(symbol) != otSymbol) return symbol;
+        for (size_t depth = 0; depth < scopes->size(); ++depth)
+        {
+            long index = findVariable((Symbol*)symbol, &scopes->at(scopes->size() - 1 - depth));
+            if (index >= 0) return new LocalReference(depth, index, (Symbol*)symbol);
+        }
+        return symbol;
+    }
+
+    // Searches from the back, so that the last of several parameters with the same name wins
+    long findVariable(Symbol *symbol, const vector<Symbol*> *variables)
+    {
+        for (long i = (long)variables->size() - 1; i >= 0; --i)
+            if (variables->at(i) == symbol) return i;
+        return -1;
+    }
+
+    bool isSpecialForm(Object *o)
+    {
+        return o == defineSymbol || o == setSymbol || o == lambdaSymbol || o == quoteSymbol || o == ifSymbol || o == beginSymbol;
+    }
+
     Object* evalDefine(Pair *asPair, Environment *env)
     {
-        if (asPair->_cdr->getType() != otPair) error("eval: Invalid define form");
+        if (getType(asPair->_cdr) != otPair) error("eval: Invalid define form");
         Object *whatToDefine = ((Pair*)asPair->_cdr)->_car;
         Object *definedAs = ((Pair*)asPair->_cdr)->_cdr;
 
-        switch (whatToDefine->getType())
+        switch (getType(whatToDefine))
         {
         case otPair:
             {
                 Object *nameObj = ((Pair*)whatToDefine)->_car;
-                if (nameObj->getType() != otSymbol) error("eval: Invalid define form");
-                string name = nameObj->toString();
+                if (getType(nameObj) != otSymbol && getType(nameObj) != otLocalReference) error("eval: Invalid define form");
+                string name = toString(nameObj);
                 vector<string> parameterNames;
                 bool hasRestParameter = false;
                 for (Object *i = ((Pair*)whatToDefine)->_cdr; ; )
                 {
-                    if (i->getType() == otNull) break;
-                    if (i->getType() != otPair)
+                    if (getType(i) == otNull) break;
+                    if (getType(i) != otPair)
                     {
-                        if (i->getType() != otSymbol) error("eval: Invalid define form");
-                        parameterNames.push_back(i->toString());
+                        if (getType(i) != otSymbol) error("eval: Invalid define form");
+                        parameterNames.push_back(toString(i));
                         hasRestParameter = true;
                         break;
                     }
                     Pair *p = (Pair*) i;
-                    parameterNames.push_back(p->_car->toString());
+                    parameterNames.push_back(toString(p->_car));
                     i = p->_cdr;
                 }
 
-                env->define(name, new Lambda(name, definedAs, env, parameterNames, hasRestParameter));
-                return Symbol::fromString("undefined"); 
+                Lambda *l = new Lambda(name, definedAs, env, parameterNames, hasRestParameter);
+                if (getType(nameObj) == otLocalReference) env->defineSlot(((LocalReference*)nameObj)->getIndex(), l);
+                else env->define((Symbol*)nameObj, l);
+                return undefinedSymbol; 
             }
         case otSymbol:
-            if (definedAs->getType() != otPair || ((Pair*)definedAs)->_cdr->getType() != otNull) error("eval: Invalid define form");
-            env->define(((Symbol*)whatToDefine)->getName(), evalExpandedForm(((Pair*)definedAs)->_car, env));
-            return Symbol::fromString("undefined");
+            if (getType(definedAs) != otPair || getType(((Pair*)definedAs)->_cdr) != otNull) error("eval: Invalid define form");
+            env->define((Symbol*)whatToDefine, evalExpandedForm(((Pair*)definedAs)->_car, env));
+            return undefinedSymbol;
+        case otLocalReference:
+            if (getType(definedAs) != otPair || getType(((Pair*)definedAs)->_cdr) != otNull) error("eval: Invalid define form");
+            env->defineSlot(((LocalReference*)whatToDefine)->getIndex(), evalExpandedForm(((Pair*)definedAs)->_car, env));
+            return undefinedSymbol;
         default:
             error("eval: Invalid define form");
             return NULL; // Just to keep the compiler happy
@@ -1292,45 +5977,52 @@ private:
 
     Object* evalSet(Pair *asPair, Environment *env)
     {
-        if (asPair->_cdr->getType() != otPair) error("eval: Invalid set! form");
+        if (getType(asPair->_cdr) != otPair) error("eval: Invalid set! form");
         Object *whatToSet = ((Pair*)asPair->_cdr)->_car;
         Object *definedAs = ((Pair*)asPair->_cdr)->_cdr;
-        if (whatToSet->getType() != otSymbol) error("eval: Invalid set! form");
-        if (definedAs->getType() != otPair || ((Pair*)definedAs)->_cdr->getType() != otNull) error("eval: Invalid set! form");
-        env->set(((Symbol*)whatToSet)->getName(), evalExpandedForm(((Pair*)definedAs)->_car, env));
-        return Symbol::fromString("undefined");
+        if (getType(definedAs) != otPair || getType(((Pair*)definedAs)->_cdr) != otNull) error("eval: Invalid set! form");
+        if (getType(whatToSet) == otLocalReference)
+        {
+            LocalReference *ref = (LocalReference*) whatToSet;
+            if (!env->setSlot(ref->getDepth(), ref->getIndex(), evalExpandedForm(((Pair*)definedAs)->_car, env)))
+                error("Unknown variable '" + ref->getSymbol()->getName() + "'");
+            return undefinedSymbol;
+        }
+        if (getType(whatToSet) != otSymbol) error("eval: Invalid set! form");
+        env->set((Symbol*)whatToSet, evalExpandedForm(((Pair*)definedAs)->_car, env));
+        return undefinedSymbol;
     }
 
     Object* evalLambda(Pair *asPair, Environment *env)
     {
-        string name = asPair->_car->toString();
-        if (asPair->_cdr->getType() != otPair) error("eval: Invalid lambda form");
+        string name = toString(asPair->_car);
+        if (getType(asPair->_cdr) != otPair) error("eval: Invalid lambda form");
         Pair *parametersAndBody = (Pair*)asPair->_cdr;
         Object *parameters = parametersAndBody->_car;
         Object *body = parametersAndBody->_cdr;
         vector<string> argumentNames;
         bool hasRestParameter = false;
 
-        switch (parameters->getType())
+        switch (getType(parameters))
         {
         case otSymbol: // (lambda a (form) (form) (form))
-            argumentNames.push_back(parameters->toString());
+            argumentNames.push_back(toString(parameters));
             return new Lambda(name, body, env, argumentNames, true);
         case otNull: // (lambda () (form) (form) (form))
             return new Lambda(name, body, env, argumentNames, false);
         case otPair: // (lambda (a b c) (form) (form) (form))
             for (Object *i = parameters; ; )
             {
-                if (i->getType() == otNull) break;
-                if (i->getType() != otPair)
+                if (getType(i) == otNull) break;
+                if (getType(i) != otPair)
                 {
-                    if (i->getType() != otSymbol) error("eval: Invalid lambda form");
-                    argumentNames.push_back(i->toString());
+                    if (getType(i) != otSymbol) error("eval: Invalid lambda form");
+                    argumentNames.push_back(toString(i));
                     hasRestParameter = true;
                     break;
                 }
                 Pair *p = (Pair*) i;
-                argumentNames.push_back(p->_car->toString());
+                argumentNames.push_back(toString(p->_car));
                 i = p->_cdr;
             }
             return new Lambda(name, body, env, argumentNames, hasRestParameter);
@@ -1342,7 +6034,7 @@ private:
 
     Object* evalQuote(Pair *asPair, Environment *env)
     {
-        if (asPair->_cdr->getType() != otPair || ((Pair*)asPair->_cdr)->_cdr->getType() != otNull)
+        if (getType(asPair->_cdr) != otPair || getType(((Pair*)asPair->_cdr)->_cdr) != otNull)
             error("eval: Invalid quote form");
         return ((Pair*)asPair->_cdr)->_car;
     }
@@ -1352,18 +6044,54 @@ private:
 
 Interpreter interp;
 
-Object* applyHack(Object *form, Environment *env)
+void collectGarbageHack()
 {
-    return interp.evalExpandedForm(form, env);
+    interp.collectGarbage();
 }
 
-int main()
+// Usage: minscm [-s] [-i image] [file ...]
+// Without an image, init.scm is evaluated first. Without any files, the REPL is started. -s prints the statistics of
+// the garbage collector on exit.
+int main(int argc, char **argv)
 {
+    char stackTop;
+    initCStackLimit(&stackTop);
+    try
+    {
+        int i = 1;
+        atexit(flushOutputPorts);
+        if (argc >= 2 && (string)argv[1] == "-s")
+        {
+            atexit(printGcReport);
+            i = 2;
+        }
+        if (argc >= i + 2 && (string)argv[i] == "-i")
+        {
+            interp.loadImage(argv[i + 1]);
+            i += 2;
+        }
+        else
+        {
+            interp.loadInitFile();
+        }
+
+        if (i < argc)
+        {
+            for (; i < argc; ++i) interp.evalFile(argv[i]);
+            return 0;
+        }
+    }
+    catch(int message)
+    {
+        return 1;
+    }
+
     for (;;)
     {
         try
         {
             string expression;
+            flushStandardOutput();
             cout << "> " << flush;
             cin.clear();
             getline(cin, expression);
@@ -1371,12 +6099,21 @@ int main()
             if (expression.length() >= 2 && expression[0] == ',')
             {
                 if (expression[1] == 'q') break;
+                if (expression[1] == 'd' && expression.length() > 3)
+                {
+                    interp.dumpImage(expression.substr(3));
+                    cout << "Image written to " << expression.substr(3) << endl;
+                    continue;
+                }
                 // HACK: Add some more
             }
-            cout << interp.eval(expression)->toString() << endl;
+            Object *result = interp.eval(expression);
+            flushStandardOutput();
+            cout << toString(result) << endl;
         }
         catch(int message)
         {
+            valueStackTop = 0;
         }
     }
     return 0;
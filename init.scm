@@ -47,28 +47,74 @@
 
 ; One parameter, working as expected:
 car cdr char->integer integer->char string-length vector-length
-string->symbol symbol->string make-string make-vector
+string->symbol symbol->string make-vector string-copy string->list
+list->string
 
 ; One parameter, special stuff:
 type ; returns the type of the argument as a symbol
 tag ; Create a special object of type 'tag from the value given
 untag ; Return the value stored in a 'tag object
-display-string ; takes a string to output
+display-string ; takes a string to write to the current output port
 exit ; ends the program with the fixnum given as the program's return code
+sys:error-message ; calls a thunk, returns the message of its error or #f
 flo->str ; number -> string
 str->flo ; number -> flonum or 'nan
 fix->flo ; fixnum -> flonum
+bi->flo ; integer -> flonum
+numerator denominator ; of integers and fractions
 
 ; Two parameters:
 cons set-car! set-cdr! eq? sys:apply string-ref vector-ref fix+ fix- fix*
-fix/ fix% fix< fix= flo+ flo- flo* flo/ flo< flo=
+fix/ fix% fix< fix= flo+ flo- flo* flo/ flo< flo= quotient remainder modulo
+string-fill! string=? string<? string>? string<=? string>=? string-ci=?
+string-ci<? string-ci>? string-ci<=? string-ci>=?
+string-split ; string, char -> list of the parts between the chars
+
+; Any number of parameters, on integers, fractions and flonums:
++ - * / < > <= >= = min max gcd lcm
 
 ; Three parameters:
-string-set! vector-set!
+string-set! vector-set! substring
+
+; Optional parameters:
+make-string ; length [char]
+string ; char ...
+string-index ; string, char [start] -> index or #f
+string-search ; pattern, string [start] -> index or #f
+string-append ; string ...
+
+; Ports:
+open-input-file open-output-file ; file name -> port
+delete-file ; file name
+sys:temporary-file ; -> the name of a new, empty file or #f
+open-output-string ; -> a new, empty port
+get-output-string ; port -> string of everything written to the port
+current-output-port ; -> the port of the standard output
+input-port? output-port?
+read-char peek-char ; port -> char or the eof object
+read-line ; port -> string without the newline or the eof object
+write-char ; char [port]
+write-string ; string [port]
+flush-output-port ; [port]
+close-port ; port
+
+; Homogeneous vectors (SRFI 4):
+make-f64vector f64vector f64vector-length f64vector-ref f64vector-set!
+f64vector->list list->f64vector
+make-s32vector s32vector s32vector-length s32vector-ref s32vector-set!
+s32vector->list list->s32vector
+make-u8vector u8vector u8vector-length u8vector-ref u8vector-set!
+u8vector->list list->u8vector
+
+; Bulk operations on f64vectors:
+f64vector-add! f64vector-scale! f64vector-dot f64vector-sum f64vector-min
+f64vector-max f64vector-map
 
 ; Only needed until re-coded in this lib:
 fix->str ; number, base -> string
 str->fix ; number, base -> fixnum or 'nan
+rat->str ; integer or fraction, base -> string
+str->rat ; string, base -> integer, fraction or 'nan
 
 ; ----------------------------------------------------------------------------
 ; LIMITATIONS, MISSING STUFF
@@ -76,7 +122,7 @@ str->fix ; number, base -> fixnum or 'nan
 
 ; - TODO: Add unit tests! Check all of R5RS. Everything working correctly?
 ; - TODO: named let, letrec...
-; - TODO: Signed numbers and rationals in reader
+; - TODO: Signed numbers in reader
 ; - TODO: eval and compile have no macro support yet; eval takes a defmacro, but creates lambdas instead ATM
 ; - TODO: string->number should return #f if argument not a number
 ; - TODO: if form should have an optional else-part
@@ -86,15 +132,16 @@ str->fix ; number, base -> fixnum or 'nan
 ; As of now, deviations from R5RS are:
 ; - Re-defining builtins may (and very probably will) break your program
 ; - No hygienic macros yet
-; - Numerical tower consists of fixnum => rational => flonum, no bigints or
-;   complex numbers yet
+; - Numerical tower consists of integer => rational => flonum, no complex
+;   numbers yet
 ; - Character procedures consider the ASCII charset only
 ; - (append) created lists do not share the last argument, dotted lists
 ;   don't work yet
 ; - (map), (for-each), (filter), (every), (any) take two arguments, not
 ;   an arbitrary number
 ; - No support for nor dependency on call/cc
-; - No Ports yet
+; - Ports read from and write to files and strings, there is no
+;   current-input-port and no read yet
 
 ; For an overview of all procedures currently missing from R5RS, see the
 ; definition of report-procedures further below.
@@ -497,72 +544,38 @@ str->fix ; number, base -> fixnum or 'nan
 
 ; Bigints --------------------------------------------------------------------
 
-; TODO: Implement
-
-(define integer? fixnum?)
-(define bi->str fix->str)
-(define str->bi str->fix)
-(define bi< fix<)
-(define bi= fix=)
-(define bi+ fix+)
-(define bi- fix-)
-(define bi* fix*)
-(define bi/ fix/)
-(define bi% fix%)
-(define bi->flo fix->flo)
+; Bignums are native, and the generic arithmetic switches between them and
+; fixnums as needed.
 
-; Rationals ------------------------------------------------------------------
+(define (bignum? x) (eq? (type x) 'bignum))
 
-(define (gcd-of-two a b)
-  (if (bi= 0 b)
-      a
-      (gcd-of-two b (bi% a b))))
+(define (integer? x)
+  (if (fixnum? x)
+      #t
+      (bignum? x)))
 
-(define (lcm-of-two a b)
-  (bi/ (bi* a b)
-       (gcd-of-two a b)))
+(define bi< <)
+(define bi= =)
+(define bi+ +)
+(define bi- -)
+(define bi* *)
+(define bi/ quotient)
+(define bi% remainder)
 
-(define (gcd . args)
-  (abs
-    (reduce gcd-of-two 0 args)))
+; Rationals ------------------------------------------------------------------
 
-(define (lcm . args)
-  (abs
-    (reduce lcm-of-two 1 args)))
+; Fractions are native too, always in lowest terms. gcd, lcm, numerator and
+; denominator are builtins.
 
-(define (fraction? n)
-  (tagged-type? n 'fraction))
+(define (fraction? n) (eq? (type n) 'fraction))
 
 (define (rational? n)
   (if (fraction? n)
       #t
       (integer? n)))
 
-(define (numerator n)
-  (if (fraction? n)
-      (car (get-tagged-value n 'fraction))
-      n))
-
-(define (denominator n)
-  (if (fraction? n)
-      (cdr (get-tagged-value n 'fraction))
-      1))
-
-(define (fraction->string n)
-  (if (fraction? n)
-      (let ((stream (make-string-writer)))
-        ((stream 'add-number) (numerator n))
-        ((stream 'add-char) #\/)
-        ((stream 'add-number) (denominator n))
-        ((stream 'get)))
-      (error "fraction->string: Object is not of fraction type")))
-
 (define (rational->string n base)
-  (if (fraction? n)
-      (if (bi= base 10)
-          (fraction->string n)
-          (error "rational->string: Only base 10 allowed for fractions")) ; TODO
-      (bi->str n base)))
+  (rat->str n base))
 
 (define (rational->flonum n)
   (if (integer? n)
@@ -570,42 +583,6 @@ str->fix ; number, base -> fixnum or 'nan
       (flo/ (bi->flo (numerator n))
             (bi->flo (denominator n)))))
 
-(define (make-fraction a b)
-  (if (and (integer? a) (integer? b))
-      (let ((g (gcd a b)))
-        (if (bi= b g)
-            (bi/ a g)
-            (make-tagged-value 'fraction
-                               (cons (bi/ a g) ; TODO: Store sign in numerator. Denominator is always positive!
-                                     (bi/ b g)))))
-      (error "make-fraction: Expected two integer values, got " (type-name a) " and " (type-name b))))
-
-(define (frac+ a b)
-  (make-fraction (bi+ (bi* (numerator a) (denominator b))
-                      (bi* (numerator b) (denominator a)))
-                 (bi* (denominator a) (denominator b))))
-
-(define (frac- a b)
-  (make-fraction (bi- (bi* (numerator a) (denominator b))
-                      (bi* (numerator b) (denominator a)))
-                 (bi* (denominator a) (denominator b))))
-
-(define (frac* a b)
-  (make-fraction (bi* (numerator a) (numerator b))
-                 (bi* (denominator a) (denominator b))))
-
-(define (frac/ a b)
-  (make-fraction (bi* (numerator a) (denominator b))
-                 (bi* (denominator a) (numerator b))))
-
-(define (frac< a b)
-  (bi< (bi* (numerator a) (denominator b))
-       (bi* (numerator b) (denominator a))))
-
-(define (frac= a b)
-  (bi= (bi* (numerator a) (denominator b))
-       (bi* (numerator b) (denominator a))))
-
 ; Numerical tower ------------------------------------------------------------
 
 (define (real? x)
@@ -623,60 +600,6 @@ str->fix ; number, base -> fixnum or 'nan
       (rational->flonum x)
       x))
 
-(define (+ a b)
-  (cond ((flonum? a) (flo+ a (exact->inexact b)))
-        ((flonum? b) (flo+ (exact->inexact a) b))
-        (else (frac+ a b))))
-
-(define (- a b)
-  (if (flonum? a)
-      (flo- a (exact->inexact b))
-      (if (flonum? b)
-          (flo- (exact->inexact a) b)
-          (frac- a b))))
-
-(define (* a b)
-  (if (flonum? a)
-      (flo* a (exact->inexact b))
-      (if (flonum? b)
-          (flo* (exact->inexact a) b)
-          (frac* a b))))
-
-(define (/ a b)
-  (if (flonum? a)
-      (flo/ a (exact->inexact b))
-      (if (flonum? b)
-          (flo/ (exact->inexact a) b)
-          (frac/ a b))))
-
-(define (< a b)
-  (if (flonum? a)
-      (flo< a (exact->inexact b))
-      (if (flonum? b)
-          (flo< (exact->inexact a) b)
-          (frac< a b))))
-
-(define (= a b)
-  (if (flonum? a)
-      (flo= a (exact->inexact b))
-      (if (flonum? b)
-          (flo= (exact->inexact a) b)
-          (frac= a b))))
-
-(define (quotient a b)
-  (if (integer? a)
-      (if (integer? b)
-          (bi/ a b)
-          (error "quotient: Expected integer argument, got " (type-name b)))
-      (error "quotient: Expected integer argument, got " (type-name a))))
-
-(define (remainder a b)
-  (if (integer? a)
-      (if (integer? b)
-          (bi% a b)
-          (error "remainder: Expected integer argument, got " (type-name b)))
-      (error "remainder: Expected integer argument, got " (type-name a))))
-
 (define (zero? x)
   (= x 0))
 
@@ -686,17 +609,6 @@ str->fix ; number, base -> fixnum or 'nan
 (define (negative? x)
   (< x 0))
 
-(define (> a b)
-  (if (< a b)
-      #f
-      (not (= a b))))
-
-(define (<= a b)
-  (not (> a b)))
-
-(define (>= a b)
-  (not (< a b)))
-
 (define (abs x)
   (if (positive? x)
       x
@@ -713,21 +625,6 @@ str->fix ; number, base -> fixnum or 'nan
       -1
       1))
 
-(define (modulo a b)
-  (if (= (sign a) (sign b))
-      (remainder a b)
-      (+ b (remainder a b))))
-
-(define (min a b)
-  (if (< a b)
-      a
-      b))
-
-(define (max a b)
-  (if (> a b)
-      a
-      b))
-
 ; Character procedures -------------------------------------------------------
 
 (define (char=? a b)
@@ -851,6 +748,12 @@ str->fix ; number, base -> fixnum or 'nan
                     acc))))
   (iter (- (vector-length v) 1) '()))
 
+; Homogeneous vectors --------------------------------------------------------
+
+(define (f64vector? x) (eq? (type x) 'f64vector))
+(define (s32vector? x) (eq? (type x) 's32vector))
+(define (u8vector? x) (eq? (type x) 'u8vector))
+
 ; String procedures ----------------------------------------------------------
 
 (define (numtostr n base)
@@ -859,7 +762,7 @@ str->fix ; number, base -> fixnum or 'nan
       (flo->str n))) ; TODO
 
 (define (strtonum str base)
-  (let ((ret (str->bi str base))) ; TODO: Rationals
+  (let ((ret (str->rat str base)))
     (if (eq? ret 'nan)
         (str->flo str)
         ret)))
@@ -875,133 +778,6 @@ str->fix ; number, base -> fixnum or 'nan
       (numtostr n (car rest))
       (numtostr n 10)))
 
-(let ((original make-string))
-  (set! make-string
-        (lambda (size . args)
-          (if (null? args)
-              (original size)
-              (let ((v (original size)))
-                   (string-fill! v (car args))
-                   v)))))
-
-(define (string-fill! v obj)
-  (define (iter i len)
-    (if (= i len)
-        'unspecified
-        (begin
-          (string-set! v i obj)
-          (iter (+ i 1) len))))
-  (iter 0 (string-length v)))
-
-(define (list->string lst)
-  (define (iter v di i vals)
-    (string-set! v di (car vals))
-    (if (zero? i)
-        v
-        (iter v (+ di 1) (- i 1) (cdr vals))))
-  (if (null? lst)
-      (make-string 0)
-      (let ((v (make-string (length lst))))
-        (iter v 0 (- (string-length v) 1) lst))))
-
-(define (string . values)
-  (list->string values))
-
-(define (string-copy s)
-  (define (iter dst i max)
-    (if (= i max)
-        dst
-        (begin
-          (string-set! dst i (string-ref s i))
-          (iter dst (+ i 1) max))))
-  (iter (make-string (string-length s))
-        0
-        (string-length s)))
-
-(define (substring str start end)
-  (define (iter v i di)
-    (if (= i end)
-        v
-        (begin
-          (string-set! v di (string-ref str i))
-          (iter v (+ 1 i) (+ 1 di)))))
-  (cond ((> start end) (error "substring: end > start"))
-        ((< start 0) (error "substring: start < 0"))
-        ((> end (string-length str)) (error "substring: end > length"))
-        (else (iter (make-string (- end start)) start 0))))
-
-(define (string-append a b)
-  (define (iter src dst di si max)
-    (if (= si max)
-        dst
-        (begin
-          (string-set! dst di (string-ref src si))
-          (iter src dst (+ di 1) (+ si 1) max))))
-  (let ((ret (make-string (+ (string-length a) (string-length b)))))
-    (iter a ret 0 0 (string-length a))
-    (iter b ret (string-length a) 0 (string-length b))))
-
-(define (string=? a b)
-  (define (iter i max)
-    (cond ((>= i max) #t)
-          ((char=? (string-ref a i) (string-ref b i)) (iter (+ i 1) max))
-          (else #f)))
-  (if (= (string-length a) (string-length b))
-      (iter 0 (string-length a))
-      #f))
-
-(define (string<? a b) ; HACK: Speed up!
-  (define (iter i la lb)
-    (cond ((= i la) (< i lb))
-          ((= i lb) #f)
-          ((char<? (string-ref a i) (string-ref b i)) #t)
-          ((char=? (string-ref a i) (string-ref b i)) (iter (+ i 1) la lb))
-          (else #f)))
-  (iter 0 (string-length a) (string-length b)))
-
-(define string>? (flip string<?))
-
-(define (string>=? a b)
-  (not (string<? a b)))
-
-(define (string<=? a b)
-  (not (string>? a b)))
-
-(define (string-ci=? a b)
-  (define (iter i max)
-    (cond ((>= i max) #t)
-          ((char-ci=? (string-ref a i) (string-ref b i)) (iter (+ i 1) max))
-          (else #f)))
-  (if (= (string-length a) (string-length b))
-      (iter 0 (string-length a))
-      #f))
-
-(define (string-ci<? a b) ; HACK: Speed up!
-  (define (iter i la lb)
-    (cond ((= i la) (< i lb))
-          ((= i lb) #f)
-          ((char-ci<? (string-ref a i) (string-ref b i)) #t)
-          ((char-ci=? (string-ref a i) (string-ref b i)) (iter (+ i 1) la lb))
-          (else #f)))
-  (iter 0 (string-length a) (string-length b)))
-
-(define string-ci>? (flip string-ci<?))
-
-(define (string-ci>=? a b)
-  (not (string-ci<? a b)))
-
-(define (string-ci<=? a b)
-  (not (string-ci>? a b)))
-
-(define (string->list s)
-  (define (iter i acc)
-    (if (< i 0)
-        acc
-        (iter (- i 1)
-              (cons (string-ref s i)
-                    acc))))
-  (iter (- (string-length s) 1) '()))
-
 ; Promises -------------------------------------------------------------------
 
 (define (make-promise f)
@@ -1154,171 +930,107 @@ str->fix ; number, base -> fixnum or 'nan
 
 ; Augment operators to take an arbitrary number of arguments -----------------
 
-(let ((original min))
-  (set! min
-        (lambda args
-          (cond ((null? args) (error "min: Called without parameters"))
-                ((null? (cdr args)) (car args))
-                (else (reduce original 0 args))))))
-
-(let ((original max))
-  (set! max
-        (lambda args
-          (cond ((null? args) (error "max: Called without parameters"))
-                ((null? (cdr args)) (car args))
-                (else (reduce original 0 args))))))
-
-(let ((original +))
-  (set! +
-        (lambda args 
-          (fold original 0 args))))
-
-(let ((original *))
-  (set! *
-        (lambda args
-          (fold original 1 args))))
-
-(let ((original -))
-  (set! -
-        (lambda args
-          (cond ((null? args) (error "-: Called without parameters"))
-                ((null? (cdr args)) (original 0 (car args)))
-                (else (reduce (flip original)
-                              0
-                              args))))))
-
-(let ((original /))
-  (set! /
-        (lambda args
-          (cond ((null? args) (error "/: Called without parameters"))
-                ((null? (cdr args)) (original 1 (car args)))
-                (else (reduce (flip original)
-                              0
-                              args))))))
-
-(let ((original string-append))
-  (set! string-append
-        (lambda args
-          (fold (flip original)
-                ""
-                args))))
-
 ; Writer ----------------------------------------------------------------------
 
-(define (make-string-writer)
-  (let ((value '())
-        (characters 0))
-    (define (add-char c)
-      (set! characters (+ characters 1))
-      (set! value (cons c value)))
-    (define (write-char c)
-      (let ((as-int (char->integer c)))
-        (cond ((= as-int 32) (add-string "#\space"))
-              ((= as-int  9) (add-string "#\tab"))
-              ((= as-int 10) (add-string "#\newline"))
-              ((= as-int 13) (add-string "#\cr"))
-              ((< as-int 32) (add-char #\.))
-              (else (add-char c)))))
-    (define (write-string-char c)
-      (let ((as-int (char->integer c)))
-        (cond ((= as-int 92) (add-string "\\\\"))
-              ((= as-int  9) (add-string "\\t"))
-              ((= as-int 10) (add-string "\\n"))
-              ((= as-int 13) (add-string "\\r"))
-              (else (add-char c)))))
-    (define (write-string s)
-      (define (iter i max)
-        (write-string-char (string-ref s i))
-        (if (= max i)
-            'undefined
-            (iter (+ i 1) max)))
-      (add-char #\")
-      (iter 0 (- (string-length s) 1))
-      (add-char #\"))
-    (define (add-string s)
-      (define (iter i max)
-        (add-char (string-ref s i))
-        (if (= max i)
-            'undefined
-            (iter (+ i 1) max)))
-      (if (zero? (string-length s))
-          'undefined
-          (iter 0 (- (string-length s) 1))))
-    (define (add-number n)
-      (add-string (numtostr n 10)))
-    (define (get-value)
-      (define (iter lst dst count)
-        (string-set! dst count (car lst))
-        (if (zero? count)
-            dst
-            (iter (cdr lst) dst (- count 1))))
-        (if (zero? characters)
-            ""
-           (let ((v (make-string characters)))
-             (iter value v (- characters 1)))))
-    (define (get-reverse)
-      (define (iter lst dst di count)
-        (string-set! dst di (car lst))
-        (if (zero? count)
-            dst
-            (iter (cdr lst) dst (+ di 1) (- count 1))))
-        (if (zero? characters)
-            ""
-           (let ((v (make-string characters)))
-             (iter value v 0 (- characters 1)))))
-    (lambda (command)
-      (cond ((eq? command 'add-char) add-char)
-            ((eq? command 'write-char) write-char)
-            ((eq? command 'add-string) add-string)
-            ((eq? command 'write-string) write-string)
-            ((eq? command 'add-number) add-number)
-            ((eq? command 'get) get-value)
-            ((eq? command 'get-reverse) get-reverse)
-            (else (error "string-writer: Unknown command " command))))))
-
-(define (add-pair-to-string-writer obj stream readable)
+(define (write-readable-char c port)
+  (let ((as-int (char->integer c)))
+    (cond ((= as-int 32) (write-string "#\space" port))
+          ((= as-int  9) (write-string "#\tab" port))
+          ((= as-int 10) (write-string "#\newline" port))
+          ((= as-int 13) (write-string "#\cr" port))
+          ((< as-int 32) (write-char #\. port))
+          (else (write-char c port)))))
+
+(define (write-readable-string s port)
+  (define (write-string-char c)
+    (let ((as-int (char->integer c)))
+      (cond ((= as-int 92) (write-string "\\\\" port))
+            ((= as-int  9) (write-string "\\t" port))
+            ((= as-int 10) (write-string "\\n" port))
+            ((= as-int 13) (write-string "\\r" port))
+            (else (write-char c port)))))
+  (define (iter i max)
+    (if (= i max)
+        'undefined
+        (begin
+          (write-string-char (string-ref s i))
+          (iter (+ i 1) max))))
+  (write-char #\" port)
+  (iter 0 (string-length s))
+  (write-char #\" port))
+
+(define (add-pair-to-port obj port readable)
   (define (iter i)
-    (add-object-to-string-writer (car i) stream readable)
+    (add-object-to-port (car i) port readable)
     (cond ((null? (cdr i)) 'done)
-          ((pair? (cdr i)) ((stream 'add-char) #\space) (iter (cdr i)))
+          ((pair? (cdr i)) (write-char #\space port) (iter (cdr i)))
           (else
-            ((stream 'add-string) " . ") 
-            (add-object-to-string-writer (cdr i) stream readable)
+            (write-string " . " port)
+            (add-object-to-port (cdr i) port readable)
             'done)))
-  ((stream 'add-char) #\()
+  (write-char #\( port)
   (iter obj)
-  ((stream 'add-char) #\)))
-
-(define (add-object-to-string-writer obj stream readable)
-  (cond ((null? obj) ((stream 'add-string) "()"))
-        ((boolean? obj) ((stream 'add-string) (if obj "#t" "#f")))
-        ((fraction? obj) ((stream 'add-string) (fraction->string obj)))
-        ((number? obj) ((stream 'add-number) obj))
-        ((symbol? obj) ((stream 'add-string) (symbol->string obj)))
-        ((char? obj) ((stream (if readable 'write-char 'add-char)) obj))
-        ((string? obj) ((stream (if readable 'write-string 'add-string)) obj))
-        ((pair? obj) (add-pair-to-string-writer obj stream readable))
-        ((vector? obj) ((stream 'add-char) #\#)
-                       (add-object-to-string-writer (vector->list obj)
-                                                       stream
-                                                       readable))
-        ((procedure? obj) ((stream 'add-string) "<procedure>"))
+  (write-char #\) port))
+
+(define (add-object-to-port obj port readable)
+  (cond ((null? obj) (write-string "()" port))
+        ((boolean? obj) (write-string (if obj "#t" "#f") port))
+        ((number? obj) (write-string (numtostr obj 10) port))
+        ((symbol? obj) (write-string (symbol->string obj) port))
+        ((char? obj) ((if readable write-readable-char write-char) obj port))
+        ((string? obj) ((if readable write-readable-string write-string) obj port))
+        ((pair? obj) (add-pair-to-port obj port readable))
+        ((vector? obj) (write-char #\# port)
+                       (add-object-to-port (vector->list obj) port readable))
+        ((f64vector? obj) (write-string "#f64" port)
+                          (add-object-to-port (f64vector->list obj) port readable))
+        ((s32vector? obj) (write-string "#s32" port)
+                          (add-object-to-port (s32vector->list obj) port readable))
+        ((u8vector? obj) (write-string "#u8" port)
+                         (add-object-to-port (u8vector->list obj) port readable))
+        ((procedure? obj) (write-string "<procedure>" port))
+        ((eof-object? obj) (write-string "<EOF>" port))
         (else (error "Unable to create readable representation of object"))))
 
 (define (object->string obj readable)
-  (let ((stream (make-string-writer)))
-    (add-object-to-string-writer obj stream readable)
-    ((stream 'get))))
+  (let ((port (open-output-string)))
+    (add-object-to-port obj port readable)
+    (get-output-string port)))
 
 ; Output functions ------------------------------------------------------------
 
-(define (display value)
-  (display-string (object->string value #f)))
+(define (eof-object? obj) (eq? (type obj) 'eof))
+
+(define (port? obj)
+  (or (input-port? obj) (output-port? obj)))
+
+(define close-input-port close-port)
+(define close-output-port close-port)
+
+(define (call-with-input-file file-name proc)
+  (let* ((port (open-input-file file-name))
+         (ret (proc port)))
+    (close-port port)
+    ret))
 
-(define (write value)
-  (display-string (object->string value #t)))
+(define (call-with-output-file file-name proc)
+  (let* ((port (open-output-file file-name))
+         (ret (proc port)))
+    (close-port port)
+    ret))
 
-(define (newline) (display "\n"))
+(define (display value . port)
+  (add-object-to-port value
+                      (if (pair? port) (car port) (current-output-port))
+                      #f))
+
+(define (write value . port)
+  (add-object-to-port value
+                      (if (pair? port) (car port) (current-output-port))
+                      #t))
+
+(define (newline . port)
+  (write-char #\newline (if (pair? port) (car port) (current-output-port))))
 
 (define (print . args)
   (for-each display (flatten args))
@@ -1343,15 +1055,15 @@ str->fix ; number, base -> fixnum or 'nan
         (set! position (+ position 1))
         ret))
     (define (get-identifier init)
-      (let ((out (make-string-writer)))
-        ((out 'add-string) init)
+      (let ((out (open-output-string)))
+        (write-string init out)
         (define (iter)
           (if (eof?)
-              ((out 'get))
+              (get-output-string out)
               (let ((c (peek-char)))
-                (cond ((char=? c #\)) ((out 'get)))
-                      ((char-whitespace? c) ((out 'get)))
-                      (else ((out 'add-char) (get-char))
+                (cond ((char=? c #\)) (get-output-string out))
+                      ((char-whitespace? c) (get-output-string out))
+                      (else (write-char (get-char) out)
                             (iter))))))
         (if (and (string=? init "") (char=? (peek-char) #\)))
             (begin
@@ -1360,19 +1072,19 @@ str->fix ; number, base -> fixnum or 'nan
             (iter))))
     (define (get-quoted-string)
       (get-char) ; skip opening quote
-      (let ((out (make-string-writer)))
+      (let ((out (open-output-string)))
         (define (iter)
           (let ((c (get-char)))
             (cond ((char=? c #\") 'done)
                   ((char=? c #\\) (set! c (get-char))
-                                  (cond ((char=? c #\n) ((out 'add-char) #\newline) (iter))
-                                        ((char=? c #\r) ((out 'add-char) #\cr) (iter))
-                                        ((char=? c #\t) ((out 'add-char) #\tab) (iter))
-                                        (else ((out 'add-char) c) (iter))))
-                  (else ((out 'add-char) c)
+                                  (cond ((char=? c #\n) (write-char #\newline out) (iter))
+                                        ((char=? c #\r) (write-char #\cr out) (iter))
+                                        ((char=? c #\t) (write-char #\tab out) (iter))
+                                        (else (write-char c out) (iter))))
+                  (else (write-char c out)
                         (iter)))))
         (iter)
-        ((out 'get))))
+        (get-output-string out)))
     (define (skip-whitespace)
       (cond ((eof?) 'eof)
             ((char-whitespace? (peek-char)) (get-char) (skip-whitespace))
@@ -1578,8 +1290,8 @@ str->fix ; number, base -> fixnum or 'nan
         ; TODO: atan
         (list 'boolean? boolean?)
         ; TODO: call-with-current-continuation
-        ; TODO: call-with-input-file
-        ; TODO: call-with-output-file
+        (list 'call-with-input-file call-with-input-file)
+        (list 'call-with-output-file call-with-output-file)
         ; TODO: call-with-values
         (list 'car car)
         (list 'cdr cdr)
@@ -1632,17 +1344,17 @@ str->fix ; number, base -> fixnum or 'nan
         (list 'char>=? char>=?)
         (list 'char>? char>?)
         (list 'char? char?)
-        ; TODO: close-input-port
-        ; TODO: close-output-port
+        (list 'close-input-port close-input-port)
+        (list 'close-output-port close-output-port)
         (list 'complex? complex?)
         (list 'cons cons)
         ; TODO: cos
         ; TODO: current-input-port
-        ; TODO: current-output-port
+        (list 'current-output-port current-output-port)
         (list 'denominator denominator)
         (list 'display display)
         ; TODO: dynamic-wind
-        ; TODO: eof-object?
+        (list 'eof-object? eof-object?)
         (list 'eq? eq?)
         (list 'equal? equal?)
         (list 'eqv? eqv?)
@@ -1658,7 +1370,7 @@ str->fix ; number, base -> fixnum or 'nan
         ; TODO: imag-part
         ; TODO: inexact->exact
         (list 'inexact? inexact?)
-        ; TODO: input-port?
+        (list 'input-port? input-port?)
         (list 'integer->char integer->char)
         (list 'integer? integer?)
         (list 'lcm lcm)
@@ -1690,19 +1402,19 @@ str->fix ; number, base -> fixnum or 'nan
         (list 'number? number?)
         (list 'numerator numerator)
         (list 'odd? odd?)
-        ; TODO: open-input-file
-        ; TODO: open-output-file
-        ; TODO: output-port?
+        (list 'open-input-file open-input-file)
+        (list 'open-output-file open-output-file)
+        (list 'output-port? output-port?)
         (list 'pair? pair?)
-        ; TODO: peek-char
-        ; TODO: port?
+        (list 'peek-char peek-char)
+        (list 'port? port?)
         (list 'positive? positive?)
         (list 'procedure? procedure?)
         (list 'quotient quotient)
         (list 'rational? rational?)
         ; TODO: rationalize
         ; TODO: read
-        ; TODO: read-char
+        (list 'read-char read-char)
         ; TODO: real-part
         (list 'real? real?)
         (list 'remainder remainder)
@@ -1749,7 +1461,7 @@ str->fix ; number, base -> fixnum or 'nan
         (list 'vector-set! vector-set!)
         (list 'vector? vector?)
         (list 'write write)
-        ; TODO: write-char
+        (list 'write-char write-char)
         (list 'zero? zero?)))
 
 (define interaction-procedures
@@ -1858,7 +1570,7 @@ str->fix ; number, base -> fixnum or 'nan
                 (compile-form arg #f)
                 (emit 'push-param))
               (reverse (cdr form)))
-    (compile-form (car form) #t)
+    (compile-form (car form) #f)
     (if tail-position
         (emit 'call)
         (let ((continue-label (make-label)))
@@ -1995,6 +1707,14 @@ str->fix ; number, base -> fixnum or 'nan
             (compiler-loop reader)))))
   (compiler-loop (make-string-reader code)))
 
+; Compiles the Scheme source in the string given and runs the result on the
+; virtual machine built into the interpreter. Macros are not supported, see
+; compile.
+(define (run-compiled code)
+  (let ((statements '()))
+    (compile code (lambda statement (set! statements (cons statement statements))))
+    (sys:execute (reverse statements))))
+
 ; Unit tests ------------------------------------------------------------------
 
 (display "Running self tests...\n")
@@ -2043,6 +1763,17 @@ str->fix ; number, base -> fixnum or 'nan
 
 (assert (= 42 ((eval '(lambda (x) x) (null-environment 5)) 42)))
 
+(define (gc-stat name) (cdr (assq name (sys:gc-stats))))
+
+; Three million pairs are far more than GC_FREQUENCY allocations and, without
+; collecting them, far more than the 16 MB the live heap has to stay below
+(let ((lst (range 1 100)) ; Must survive the garbage collections triggered below
+      (collections (gc-stat 'collections)))
+  (dotimes (i 3000000) (cons i lst))
+  (assert (> (gc-stat 'collections) collections))
+  (assert (= 5050 (fold + 0 lst)))
+  (assert (< (gc-stat 'live-bytes) 16777216)))
+
 (assert (eq? 'ok
              (eval '(begin
                       (define test
@@ -2061,6 +1792,196 @@ str->fix ; number, base -> fixnum or 'nan
          (a 1 2 3 4 5))
       (scheme-report-environment 5))
 
+(assert (= 42 (run-compiled "(define (vm-test-adder n) (lambda (x) (+ x n))) ((vm-test-adder 40) 2)")))
+(assert (equal? '(1 (2 3)) (run-compiled "(define (vm-test-f a . b) (define c (list a b)) c) (vm-test-f 1 2 3)")))
+(assert (= 5050 (run-compiled "(define (vm-test-sum i acc) (if (= i 0) acc (vm-test-sum (- i 1) (+ acc i)))) (vm-test-sum 100 0)")))
+
+; Bignums: Promotion and demotion at the fixnum boundary, Karatsuba above 32
+; limbs, Knuth's division and conversion in all bases
+(define (test-factorial n acc)
+  (if (= n 0) acc (test-factorial (- n 1) (* n acc))))
+
+(define (test-power base n acc)
+  (if (= n 0) acc (test-power base (- n 1) (* base acc))))
+
+(define (test-bases n base)
+  (cond ((> base 36) #t)
+        ((= n (string->number (number->string n base) base)) (test-bases n (+ base 1)))
+        (else #f)))
+
+(define test-max-fixnum (- (test-power 2 62 1) 1))
+(define test-min-fixnum (- 0 (test-power 2 62 1)))
+
+(assert (eq? 'fixnum (type test-max-fixnum)))
+(assert (eq? 'fixnum (type test-min-fixnum)))
+(assert (eq? 'bignum (type (+ test-max-fixnum 1))))
+(assert (eq? 'bignum (type (- 0 test-min-fixnum))))
+(assert (eq? 'fixnum (type (- 0 (- 0 test-min-fixnum)))))
+(assert (= 4611686018427387913 (+ test-max-fixnum 10)))
+(assert (= (- 0 test-min-fixnum) (quotient test-min-fixnum (- 0 1))))
+(assert (= (- 0 1537228672809129304) (quotient (- 0 (+ test-max-fixnum 10)) 3)))
+(assert (= (- 0 1) (remainder (- 0 (+ test-max-fixnum 10)) 3)))
+(assert (= 2 (modulo (- 0 (+ test-max-fixnum 10)) 3)))
+(assert (= (- 0 2) (modulo (+ test-max-fixnum 10) (- 0 3))))
+(assert (= 1 (quotient (- 0 (+ test-max-fixnum 10)) test-min-fixnum)))
+(assert (= (- 0 9) (remainder (- 0 (+ test-max-fixnum 10)) test-min-fixnum)))
+
+(assert (= 16326 (string-length (number->string (test-factorial 5000 1)))))
+(let ((f (test-factorial 1000 1)))
+  (assert (= 5136 (string-length (number->string (* f f)))))
+  (assert (= f (quotient (* f f) f)))
+  (assert (= 955860613004397508326213120000 (quotient f (test-factorial 990 1)))))
+(let ((x (test-power 2 2048 1)))
+  (assert (= (test-power 2 4096 1) (* x x))))
+(let* ((a (+ (test-factorial 1000 1) 12345))
+       (b (+ (test-power 3 700 1) 17))
+       (q (quotient a b))
+       (r (remainder a b)))
+  (assert (= a (+ (* q b) r)))
+  (assert (and (>= r 0) (< r b))))
+
+(assert (string=? "10000000000000000000000000" (number->string (test-power 2 100 1) 16)))
+(assert (string=? "100000000000000000000" (number->string (test-power 36 20 1) 36)))
+(assert (string=? (string-append "-1" (make-string 64 #\0))
+                  (number->string (- 0 (test-power 2 64 1)) 2)))
+(assert (test-bases (test-factorial 100 1) 2))
+(assert (test-bases (- 0 (test-power 7 300 1)) 2))
+
+; Fractions: Reading, normalization, mixed comparisons and other bases
+(assert (eq? 'fraction (type 1/3)))
+(assert (= 1/3 (/ 1 3)))
+(assert (eq? 'fixnum (type 4/2)))
+(assert (= (- 0 3/2) (/ 6 (- 0 4))))
+(assert (= (- 0 3) (numerator (/ 6 (- 0 4)))))
+(assert (= 2 (denominator (/ 6 (- 0 4)))))
+(assert (eq? 'fixnum (type (+ 1/3 2/3))))
+(assert (< 1/3 0.34))
+(assert (> 1/3 0.33))
+(assert (= 1/2 0.5))
+(assert (< (- 0 1/2) (- 0 0.4)))
+(assert (string=? "ff/10" (number->string 255/16 16)))
+(assert (string=? "-101/10" (number->string (/ (- 0 5) 2) 2)))
+(assert (= 255/16 (string->number "ff/10" 16)))
+
+; f64vectors: The SIMD kernels must agree with the plain ones, also on lengths
+; that are not a multiple of the vector width. Sums and dot products are added
+; up in several lanes, so they may only agree up to rounding.
+(define (test-f64vector n step)
+  (let ((v (make-f64vector n 0.0)))
+    (dotimes (i n) (f64vector-set! v i (/ (- (modulo (* i step) 101) 50) 7.0)))
+    v))
+
+(define (test-f64-kernels n)
+  (let ((a (test-f64vector n 37))
+        (b (test-f64vector n 53)))
+    (define (copy v) (list->f64vector (f64vector->list v)))
+    (define (close? x y)
+      (< (abs (- x y)) (* *epsilon* (+ 1 (abs x)))))
+    (define (run simd)
+      (sys:set-simd! simd)
+      (list (if (= n 0) 'empty (f64vector-min a))
+            (if (= n 0) 'empty (f64vector-max a))
+            (f64vector->list (f64vector-add! (copy a) b))
+            (f64vector->list (f64vector-scale! (copy a) 2.5))
+            (map (lambda (op) (f64vector->list (f64vector-map op a b)))
+                 (list + - * / min max))))
+    (define (run-sums simd)
+      (sys:set-simd! simd)
+      (list (f64vector-dot a b) (f64vector-sum a)))
+    (let* ((plain (run #f))
+           (simd (run #t))
+           (plain-sums (run-sums #f))
+           (simd-sums (run-sums #t)))
+      (and (equal? plain simd)
+           (close? (car plain-sums) (car simd-sums))
+           (close? (cadr plain-sums) (cadr simd-sums))))))
+
+(assert (test-f64-kernels 0))
+(assert (test-f64-kernels 1))
+(assert (test-f64-kernels 3))
+(assert (test-f64-kernels 7))
+(assert (test-f64-kernels 13))
+(assert (test-f64-kernels 1027))
+(assert (= 0.0 (f64vector-sum (make-f64vector 0 1.0))))
+(assert (string=? "f64vector-min: Empty vector"
+                  (sys:error-message (lambda () (f64vector-min (make-f64vector 0 1.0))))))
+(assert (string=? "f64vector-max: Empty vector"
+                  (sys:error-message (lambda () (f64vector-max (make-f64vector 0 1.0))))))
+(assert (string=? "f64vector-add!: Vectors differ in length"
+                  (sys:error-message (lambda () (f64vector-add! (make-f64vector 3 1.0)
+                                                                (make-f64vector 4 1.0))))))
+(assert (string=? "f64vector-dot: Vectors differ in length"
+                  (sys:error-message (lambda () (f64vector-dot (make-f64vector 5 1.0)
+                                                               (make-f64vector 4 1.0))))))
+(assert (string=? "f64vector-map: Vectors differ in length"
+                  (sys:error-message (lambda () (f64vector-map + (make-f64vector 5 1.0)
+                                                               (make-f64vector 0 1.0))))))
+(assert (not (sys:error-message (lambda () (f64vector-sum (make-f64vector 4 1.0))))))
+
+; Strings
+(assert (equal? '("a" "" "b" "") (string-split "a,,b," #\,)))
+(assert (equal? '("" "a") (string-split ",a" #\,)))
+(assert (equal? '("") (string-split "" #\,)))
+(assert (equal? '("abc") (string-split "abc" #\,)))
+(assert (= 1 (string-index "abcabc" #\b)))
+(assert (= 4 (string-index "abcabc" #\b 2)))
+(assert (not (string-index "abcabc" #\x)))
+(assert (not (string-index "abc" #\a 3)))
+(assert (= 0 (string-search "" "abc")))
+(assert (= 3 (string-search "" "abc" 3)))
+(assert (= 2 (string-search "ca" "abcab")))
+(assert (= 3 (string-search "ab" "abcab" 1)))
+(assert (not (string-search "abcd" "abc")))
+(assert (string=? "substring: Index out of range"
+                  (sys:error-message (lambda () (substring "abc" 2 5)))))
+(assert (string<? "abc" "abcd"))
+(assert (string>? "abd" "abcd"))
+(assert (string<=? "abc" "abc"))
+(assert (not (string<? "apple" "BANANA")))
+(assert (string<? "a" (string (integer->char 200))))
+(assert (string-ci=? "HeLLo" "hello"))
+(assert (string-ci<? "apple" "BANANA"))
+(assert (string-ci>? "Cherry" "banana"))
+(assert (string-ci<=? "ABC" "abc"))
+(assert (string-ci>=? "abc" "ABC"))
+(assert (not (string-ci=? "abc" "abcd")))
+
+; Deep recursion in machine code stops at the same stack limit as the
+; interpreter does
+(define (test-count-up n)
+  (if (fix= n 0) 0 (fix+ 1 (test-count-up (fix- n 1)))))
+(dotimes (i 2000) (test-count-up 10))
+(assert (= 10000 (test-count-up 10000)))
+(assert (string=? "Stack overflow"
+                  (sys:error-message (lambda () (test-count-up 1000000)))))
+(assert (= 100 (test-count-up 100)))
+
+; File ports: Written to a temporary file, which is read back and deleted.
+; Where no temporary file can be created, there is nothing to test.
+(define (test-file-ports name)
+  (let ((out (open-output-file name)))
+    (write-string "first line" out)
+    (newline out)
+    (write (list 1 "two" 3) out)
+    (close-port out))
+  (let ((in (open-input-file name)))
+    (assert (input-port? in))
+    (assert (char=? #\f (peek-char in)))
+    (assert (char=? #\f (read-char in)))
+    (assert (string=? "irst line" (read-line in)))
+    (assert (string=? "(1 \"two\" 3)" (read-line in)))
+    (assert (eof-object? (read-line in)))
+    (assert (eof-object? (read-char in)))
+    (assert (string=? "<EOF>" (object->string (peek-char in) #t)))
+    (close-port in)
+    (assert (string=? "read-char: Port is closed"
+                      (sys:error-message (lambda () (read-char in))))))
+  (delete-file name)
+  (assert (string? (sys:error-message (lambda () (open-input-file name))))))
+
+(let ((name (sys:temporary-file)))
+  (if name (test-file-ports name) #f))
+
 (eval '(display "OK\n")
       (scheme-report-environment 5))
 
@@ -0,0 +1,1060 @@
+/* vim:et
+*
+* memory.c
+* Memory management functions
+*
+* This file is part of MinScheme, an experimental compiler/interpreter/runtime
+* combination for a subset of the Scheme programming language
+* Copyright (c) 2013, Leif Bruder <leifbruder@gmail.com>
+*
+* Permission to use, copy, modify, and/or distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "structures.h"
+#include "memory.h"
+
+/* The heap is a single contiguous array, aligned to 8 bytes. Position 0 is
+ * never used for an object, so it can mark "no object" (e.g. an empty
+ * subtree). The array starts with the nursery, which holds the young
+ * objects, followed by the old space, which grows at its end.
+ *
+ * Objects are allocated by bumping nursery_top. When the nursery is full,
+ * its live objects are copied to the end of the old space (see
+ * collect_nursery). Symbols, keepalive objects and large objects are
+ * allocated in the old space directly.
+ *
+ * The old space is collected by a Lisp-2 style mark-compact collector:
+ * 1. MARK: Set the L flag on every object reachable from the roots.
+ * 2. COMPUTE: Walk the heap, storing the new position of every live object
+ *    in its gc_target_position field.
+ * 3. RELOCATE: Update every reference held by a live object or a root.
+ * 4. SLIDE: Move the live objects to their new positions.
+ * Objects keep their relative order, so the binary trees ordered by
+ * position of a symbol (environments) stay valid. Objects with the K flag
+ * set are roots and are never moved. */
+
+#define GC_FLAG_LIVE       0x80
+#define GC_FLAG_KEEPALIVE  0x40
+#define GC_FLAG_REMEMBERED 0x20
+#define TYPE_MASK          0x0f
+
+#define ALIGNMENT 8
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(uint32_t)(ALIGNMENT - 1))
+
+#define NURSERY_SIZE (1024 * 1024)
+#define NURSERY_END (ALIGNMENT + NURSERY_SIZE)
+#define MAX_YOUNG_OBJECT_SIZE (NURSERY_SIZE / 8)
+#define IS_YOUNG(pos) ((pos) < NURSERY_END)
+
+#define MAX_PROTECTED_POSITIONS 8
+#define MAX_GC_THREADS 64
+
+#define OBJECT(pos)           ((struct Object*)(heap + (pos)))
+#define FIXNUM(pos)           ((struct Fixnum*)(heap + (pos)))
+#define FLONUM(pos)           ((struct Flonum*)(heap + (pos)))
+#define SYMBOL(pos)           ((struct Symbol*)(heap + (pos)))
+#define PAIR(pos)             ((struct Pair*)(heap + (pos)))
+#define STRING(pos)           ((struct String*)(heap + (pos)))
+#define CHAR(pos)             ((struct Char*)(heap + (pos)))
+#define BUILTIN_FUNCTION(pos) ((struct BuiltinFunction*)(heap + (pos)))
+#define CLOSURE(pos)          ((struct Closure*)(heap + (pos)))
+#define VECTOR(pos)           ((struct Vector*)(heap + (pos)))
+#define ENVIRONMENT(pos)      ((struct Environment*)(heap + (pos)))
+#define ENVIRONMENT_NODE(pos) ((struct Environment_Node*)(heap + (pos)))
+#define TAGGED_VALUE(pos)     ((struct Tagged_Value*)(heap + (pos)))
+
+#define SYMBOL_NAME(pos)   (heap + (pos) + sizeof(struct Symbol))
+#define STRING_VALUE(pos)  (heap + (pos) + sizeof(struct String))
+#define VECTOR_VALUES(pos) ((position_t*)(heap + (pos) + sizeof(struct Vector)))
+
+static uint8_t *heap;
+static uint32_t heap_size;
+static position_t heap_top;
+static position_t nursery_top;
+static uint32_t old_space_limit;
+static uint32_t initial_old_space_size;
+
+static position_t true_object;
+static position_t false_object;
+static position_t null_object;
+static position_t eof_object;
+static position_t builtin_functions[256];
+
+/* Symbols are interned in an open addressing hash table with linear
+ * probing. Its size is a power of two, and it is at most half full. */
+static position_t *symbol_table;
+static uint32_t symbol_table_size;
+static uint32_t symbol_count;
+
+/* Positions passed into an allocating function must survive a collection
+ * triggered by the allocation, so they are registered here for its duration */
+static position_t *protected_positions[MAX_PROTECTED_POSITIONS];
+static int protected_count;
+
+struct Position_List {
+        position_t *values;
+        uint32_t size;
+        uint32_t count;
+};
+
+/* Each marking thread works on its private stack. When other threads run
+ * out of work, it moves half of it to its shared stack, from which the
+ * others steal. The shared stack is only touched under the lock; its size
+ * is published in shared_count, which may be read atomically without it. */
+struct Mark_Worker {
+        struct Position_List stack;
+        struct Position_List shared;
+        uint32_t shared_count;
+        pthread_mutex_t lock;
+        pthread_t thread;
+};
+
+static struct Mark_Worker mark_workers[MAX_GC_THREADS];
+static int mark_workers_initialized;
+static int gc_thread_count = 1;
+static int idle_mark_workers; /* Only accessed atomically while marking */
+
+static struct Position_List remembered_set;
+static struct Position_List young_keepalives;
+static int young_reference_left;
+
+/* ------------------------------------------------------------------------ */
+
+static void runtime_error(const char *message)
+{
+        fprintf(stderr, "%s\n", message);
+        exit(1);
+}
+
+static void assert_type(const char *function, position_t object, enum ObjectType expected_type)
+{
+        if (get_object_type(object) != expected_type) {
+                fprintf(stderr, "%s: Invalid argument type\n", function);
+                exit(1);
+        }
+}
+
+static void protect(position_t *position)
+{
+        if (protected_count == MAX_PROTECTED_POSITIONS) runtime_error("Internal error: Too many protected positions");
+        protected_positions[protected_count++] = position;
+}
+
+static void unprotect(int count)
+{
+        protected_count -= count;
+}
+
+static uint32_t get_object_size(position_t object)
+{
+        switch (get_object_type(object)) {
+        case T_FIXNUM:           return ALIGN(sizeof(struct Fixnum));
+        case T_FLONUM:           return ALIGN(sizeof(struct Flonum));
+        case T_SYMBOL:           return ALIGN(sizeof(struct Symbol) + SYMBOL(object)->name_length);
+        case T_PAIR:             return ALIGN(sizeof(struct Pair));
+        case T_STRING:           return ALIGN(sizeof(struct String) + STRING(object)->value_length);
+        case T_TRUE:             return ALIGN(sizeof(struct True));
+        case T_FALSE:            return ALIGN(sizeof(struct False));
+        case T_CHAR:             return ALIGN(sizeof(struct Char));
+        case T_NULL:             return ALIGN(sizeof(struct Null));
+        case T_BUILTIN_FUNCTION: return ALIGN(sizeof(struct BuiltinFunction));
+        case T_CLOSURE:          return ALIGN(sizeof(struct Closure));
+        case T_VECTOR:           return ALIGN(sizeof(struct Vector) + VECTOR(object)->length * sizeof(position_t));
+        case T_EOF:              return ALIGN(sizeof(struct Eof));
+        case T_ENVIRONMENT:      return ALIGN(sizeof(struct Environment));
+        case T_ENVIRONMENT_NODE: return ALIGN(sizeof(struct Environment_Node));
+        case T_TAGGED_VALUE:     return ALIGN(sizeof(struct Tagged_Value));
+        }
+        runtime_error("Internal error: Invalid object type");
+        return 0;
+}
+
+/* Calls f for every slot of the object holding a reference to another
+ * object. Empty slots (position 0) are skipped. */
+static void for_each_reference(position_t object, void (*f)(position_t *slot, void *context), void *context)
+{
+        uint32_t i;
+
+        switch (get_object_type(object)) {
+        case T_PAIR:
+                f(&PAIR(object)->car, context);
+                f(&PAIR(object)->cdr, context);
+                break;
+        case T_CLOSURE:
+                f(&CLOSURE(object)->symbol, context);
+                f(&CLOSURE(object)->captured_environment, context);
+                f(&CLOSURE(object)->body, context);
+                break;
+        case T_VECTOR:
+                for (i = 0; i < VECTOR(object)->length; ++i) f(&VECTOR_VALUES(object)[i], context);
+                break;
+        case T_ENVIRONMENT:
+                if (ENVIRONMENT(object)->outer) f(&ENVIRONMENT(object)->outer, context);
+                if (ENVIRONMENT(object)->root_node) f(&ENVIRONMENT(object)->root_node, context);
+                break;
+        case T_ENVIRONMENT_NODE:
+                f(&ENVIRONMENT_NODE(object)->symbol, context);
+                f(&ENVIRONMENT_NODE(object)->value, context);
+                if (ENVIRONMENT_NODE(object)->left_tree) f(&ENVIRONMENT_NODE(object)->left_tree, context);
+                if (ENVIRONMENT_NODE(object)->right_tree) f(&ENVIRONMENT_NODE(object)->right_tree, context);
+                break;
+        case T_TAGGED_VALUE:
+                f(&TAGGED_VALUE(object)->value, context);
+                break;
+        default:
+                break;
+        }
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void push_position(struct Position_List *list, position_t value)
+{
+        if (list->count == list->size) {
+                list->size = list->size ? list->size * 2 : 1024;
+                list->values = realloc(list->values, list->size * sizeof(position_t));
+                if (!list->values) runtime_error("Out of memory");
+        }
+        list->values[list->count++] = value;
+}
+
+static void remember(position_t object)
+{
+        if (OBJECT(object)->type_and_gc_flags & GC_FLAG_REMEMBERED) return;
+        OBJECT(object)->type_and_gc_flags |= GC_FLAG_REMEMBERED;
+        push_position(&remembered_set, object);
+}
+
+/* Must be called whenever a reference to value is stored into object */
+static void write_barrier(position_t object, position_t value)
+{
+        if (!IS_YOUNG(object) && IS_YOUNG(value)) remember(object);
+}
+
+static void reserve_heap(uint32_t required_size)
+{
+        uint64_t new_size = heap_size;
+        if ((uint64_t)heap_top + required_size <= heap_size) return;
+
+        while (new_size < (uint64_t)heap_top + required_size) new_size *= 2;
+        if (new_size > UINT32_MAX) new_size = UINT32_MAX;
+        if (new_size < (uint64_t)heap_top + required_size) runtime_error("Out of memory");
+
+        heap = realloc(heap, new_size);
+        if (!heap) runtime_error("Out of memory");
+        heap_size = (uint32_t)new_size;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* MINOR COLLECTION: Copy every live young object to the end of the old
+ * space (Cheney style, the copied objects are scanned like a queue). Roots
+ * are the protected positions, the young keepalive objects (which are not
+ * moved) and the old objects in the remembered set. An old object remains
+ * in the remembered set as long as it references a young keepalive object. */
+
+static void evacuate_slot(position_t *slot, void *context)
+{
+        position_t object = *slot;
+        uint32_t size;
+
+        (void)context;
+        if (!IS_YOUNG(object)) return;
+        if (OBJECT(object)->type_and_gc_flags & GC_FLAG_LIVE) {
+                /* Already copied, the L flag marks a forwarded object here */
+                *slot = OBJECT(object)->gc_target_position;
+                return;
+        }
+        if (OBJECT(object)->type_and_gc_flags & GC_FLAG_KEEPALIVE) {
+                young_reference_left = 1;
+                return;
+        }
+
+        size = get_object_size(object);
+        memcpy(heap + heap_top, heap + object, size);
+        OBJECT(object)->type_and_gc_flags |= GC_FLAG_LIVE;
+        OBJECT(object)->gc_target_position = heap_top;
+        *slot = heap_top;
+        heap_top += size;
+}
+
+static void scan_old_object(position_t object)
+{
+        young_reference_left = 0;
+        for_each_reference(object, evacuate_slot, NULL);
+        if (young_reference_left) remember(object);
+}
+
+static void collect_nursery(void)
+{
+        position_t scan;
+        uint32_t i, count;
+        int j;
+
+        /* Copying must not reallocate the heap, as evacuate_slot may be
+         * working on a slot inside of it */
+        reserve_heap(nursery_top - ALIGNMENT);
+        scan = heap_top;
+
+        for (i = count = 0; i < young_keepalives.count; ++i)
+                if (OBJECT(young_keepalives.values[i])->type_and_gc_flags & GC_FLAG_KEEPALIVE)
+                        young_keepalives.values[count++] = young_keepalives.values[i];
+        young_keepalives.count = count;
+
+        for (j = 0; j < protected_count; ++j) evacuate_slot(protected_positions[j], NULL);
+        for (i = 0; i < young_keepalives.count; ++i) for_each_reference(young_keepalives.values[i], evacuate_slot, NULL);
+
+        count = remembered_set.count;
+        remembered_set.count = 0;
+        for (i = 0; i < count; ++i) {
+                OBJECT(remembered_set.values[i])->type_and_gc_flags &= ~GC_FLAG_REMEMBERED;
+                scan_old_object(remembered_set.values[i]);
+        }
+
+        while (scan < heap_top) {
+                scan_old_object(scan);
+                scan += get_object_size(scan);
+        }
+
+        nursery_top = ALIGNMENT;
+        for (i = 0; i < young_keepalives.count; ++i) {
+                position_t end = young_keepalives.values[i] + get_object_size(young_keepalives.values[i]);
+                if (end > nursery_top) nursery_top = end;
+        }
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* MAJOR COLLECTION: Mark-compact the old space. The nursery has just been
+ * collected, so it only contains young keepalive objects. The MARK phase
+ * runs on gc_thread_count threads, which set the L flags atomically. */
+
+static void mark_slot(position_t *slot, void *context)
+{
+        uint8_t *flags;
+
+        if (IS_YOUNG(*slot)) return;
+        flags = &OBJECT(*slot)->type_and_gc_flags;
+        if (__atomic_load_n(flags, __ATOMIC_RELAXED) & GC_FLAG_LIVE) return;
+        if (__atomic_fetch_or(flags, GC_FLAG_LIVE, __ATOMIC_RELAXED) & GC_FLAG_LIVE) return;
+        push_position(&((struct Mark_Worker*)context)->stack, *slot);
+}
+
+static void share_work(struct Mark_Worker *worker)
+{
+        uint32_t count = worker->stack.count / 2;
+
+        pthread_mutex_lock(&worker->lock);
+        while (count-- > 0) push_position(&worker->shared, worker->stack.values[--worker->stack.count]);
+        __atomic_store_n(&worker->shared_count, worker->shared.count, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&worker->lock);
+}
+
+static int steal_work(struct Mark_Worker *thief)
+{
+        int i;
+        uint32_t count;
+
+        for (i = 0; i < gc_thread_count; ++i) {
+                struct Mark_Worker *victim = &mark_workers[i];
+                if (__atomic_load_n(&victim->shared_count, __ATOMIC_SEQ_CST) == 0) continue;
+
+                pthread_mutex_lock(&victim->lock);
+                count = (victim->shared.count + 1) / 2;
+                while (count-- > 0) push_position(&thief->stack, victim->shared.values[--victim->shared.count]);
+                __atomic_store_n(&victim->shared_count, victim->shared.count, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&victim->lock);
+                if (thief->stack.count > 0) return 1;
+        }
+        return 0;
+}
+
+static int work_available(void)
+{
+        int i;
+
+        for (i = 0; i < gc_thread_count; ++i)
+                if (__atomic_load_n(&mark_workers[i].shared_count, __ATOMIC_SEQ_CST) > 0) return 1;
+        return 0;
+}
+
+/* Marks everything reachable from the worker's stack. Returns when all
+ * workers are out of work. */
+static void *mark_worker(void *context)
+{
+        struct Mark_Worker *worker = context;
+
+        for (;;) {
+                while (worker->stack.count > 0) {
+                        if (__atomic_load_n(&idle_mark_workers, __ATOMIC_SEQ_CST) > 0 && worker->stack.count > 1
+                            && __atomic_load_n(&worker->shared_count, __ATOMIC_SEQ_CST) == 0) share_work(worker);
+                        for_each_reference(worker->stack.values[--worker->stack.count], mark_slot, worker);
+                }
+                if (steal_work(worker)) continue;
+
+                __atomic_fetch_add(&idle_mark_workers, 1, __ATOMIC_SEQ_CST);
+                for (;;) {
+                        if (__atomic_load_n(&idle_mark_workers, __ATOMIC_SEQ_CST) == gc_thread_count) return NULL;
+                        if (work_available()) break;
+                        sched_yield();
+                }
+                __atomic_fetch_sub(&idle_mark_workers, 1, __ATOMIC_SEQ_CST);
+        }
+}
+
+static void relocate_slot(position_t *slot, void *context)
+{
+        (void)context;
+        if (IS_YOUNG(*slot)) return;
+        *slot = OBJECT(*slot)->gc_target_position;
+}
+
+/* Marks the gap between two objects left by the compaction as a dead object
+ * so that the heap can still be walked object by object */
+static void fill_gap(position_t start, uint32_t size)
+{
+        memset(heap + start, 0, size);
+        if (size == ALIGN(sizeof(struct Null))) {
+                OBJECT(start)->type_and_gc_flags = T_NULL;
+        } else {
+                OBJECT(start)->type_and_gc_flags = T_STRING;
+                STRING(start)->value_length = size - sizeof(struct String);
+        }
+}
+
+static void mark(void)
+{
+        struct Mark_Worker *main_worker = &mark_workers[0];
+        position_t i;
+        uint32_t j;
+        int k;
+
+        for (i = NURSERY_END; i < heap_top; i += get_object_size(i))
+                if (OBJECT(i)->type_and_gc_flags & GC_FLAG_KEEPALIVE) mark_slot(&i, main_worker);
+        for (j = 0; j < young_keepalives.count; ++j) for_each_reference(young_keepalives.values[j], mark_slot, main_worker);
+        for (k = 0; k < protected_count; ++k) mark_slot(protected_positions[k], main_worker);
+        for (j = 0; j < symbol_table_size; ++j) if (symbol_table[j]) mark_slot(&symbol_table[j], main_worker);
+
+        idle_mark_workers = 0;
+        for (k = 1; k < gc_thread_count; ++k)
+                if (pthread_create(&mark_workers[k].thread, NULL, mark_worker, &mark_workers[k]))
+                        runtime_error("Could not start garbage collector thread");
+        mark_worker(main_worker);
+        for (k = 1; k < gc_thread_count; ++k) pthread_join(mark_workers[k].thread, NULL);
+}
+
+static void compute_target_positions(void)
+{
+        position_t i;
+        position_t free_position = NURSERY_END;
+
+        for (i = NURSERY_END; i < heap_top; i += get_object_size(i)) {
+                if (!(OBJECT(i)->type_and_gc_flags & GC_FLAG_LIVE)) continue;
+                if (OBJECT(i)->type_and_gc_flags & GC_FLAG_KEEPALIVE) {
+                        OBJECT(i)->gc_target_position = i;
+                        free_position = i + get_object_size(i);
+                } else {
+                        OBJECT(i)->gc_target_position = free_position;
+                        free_position += get_object_size(i);
+                }
+        }
+}
+
+static void relocate(void)
+{
+        position_t i;
+        uint32_t j, count;
+        int k;
+
+        for (i = NURSERY_END; i < heap_top; i += get_object_size(i))
+                if (OBJECT(i)->type_and_gc_flags & GC_FLAG_LIVE) for_each_reference(i, relocate_slot, NULL);
+        for (j = 0; j < young_keepalives.count; ++j) for_each_reference(young_keepalives.values[j], relocate_slot, NULL);
+        for (k = 0; k < protected_count; ++k) relocate_slot(protected_positions[k], NULL);
+        for (j = 0; j < symbol_table_size; ++j) if (symbol_table[j]) relocate_slot(&symbol_table[j], NULL);
+
+        for (j = count = 0; j < remembered_set.count; ++j)
+                if (OBJECT(remembered_set.values[j])->type_and_gc_flags & GC_FLAG_LIVE)
+                        remembered_set.values[count++] = OBJECT(remembered_set.values[j])->gc_target_position;
+        remembered_set.count = count;
+}
+
+static void slide(void)
+{
+        position_t i = NURSERY_END;
+        position_t free_position = NURSERY_END;
+
+        while (i < heap_top) {
+                uint32_t size = get_object_size(i);
+                position_t target = OBJECT(i)->gc_target_position;
+
+                if (OBJECT(i)->type_and_gc_flags & GC_FLAG_LIVE) {
+                        if (target != free_position) fill_gap(free_position, target - free_position);
+                        OBJECT(i)->type_and_gc_flags &= ~GC_FLAG_LIVE;
+                        if (target != i) memmove(heap + target, heap + i, size);
+                        free_position = target + size;
+                }
+                i += size;
+        }
+
+        heap_top = free_position;
+}
+
+static void collect_old_space(void)
+{
+        uint32_t live_size;
+
+        mark();
+        compute_target_positions();
+        relocate();
+        slide();
+
+        /* Let the old space grow to twice its live size before the next
+         * major collection, to avoid collecting over and over again */
+        live_size = heap_top - NURSERY_END;
+        old_space_limit = heap_top + (live_size > initial_old_space_size ? live_size : initial_old_space_size);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static position_t allocate_old(uint32_t size, enum ObjectType type)
+{
+        position_t ret;
+
+        size = ALIGN(size);
+        if ((uint64_t)heap_top + size > old_space_limit) gc();
+        reserve_heap(size);
+
+        ret = heap_top;
+        heap_top += size;
+        memset(heap + ret, 0, size);
+        OBJECT(ret)->type_and_gc_flags = type;
+        /* The constructors store their arguments without a write barrier */
+        remember(ret);
+        return ret;
+}
+
+static position_t allocate(uint32_t size, enum ObjectType type)
+{
+        position_t ret;
+
+        size = ALIGN(size);
+        if (size > MAX_YOUNG_OBJECT_SIZE) return allocate_old(size, type);
+
+        if (nursery_top + size > NURSERY_END) {
+                collect_nursery();
+                if (heap_top > old_space_limit) collect_old_space();
+                /* Young keepalive objects may still block the nursery */
+                if (nursery_top + size > NURSERY_END) return allocate_old(size, type);
+        }
+
+        ret = nursery_top;
+        nursery_top += size;
+        memset(heap + ret, 0, size);
+        OBJECT(ret)->type_and_gc_flags = type;
+        return ret;
+}
+
+static position_t allocate_keepalive(uint32_t size, enum ObjectType type)
+{
+        position_t ret = allocate_old(size, type);
+        OBJECT(ret)->type_and_gc_flags |= GC_FLAG_KEEPALIVE;
+        return ret;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void init_memory(uint32_t initial_heap_size)
+{
+        int i;
+
+        initial_old_space_size = ALIGN(initial_heap_size < 1024 ? 1024 : initial_heap_size);
+        heap_size = NURSERY_END + initial_old_space_size;
+        heap = malloc(heap_size);
+        if (!heap) runtime_error("Out of memory");
+        nursery_top = ALIGNMENT;
+        heap_top = NURSERY_END;
+        old_space_limit = heap_size;
+        symbol_table_size = 1024;
+        symbol_count = 0;
+        free(symbol_table);
+        symbol_table = calloc(symbol_table_size, sizeof(position_t));
+        if (!symbol_table) runtime_error("Out of memory");
+        protected_count = 0;
+        remembered_set.count = 0;
+        young_keepalives.count = 0;
+        memset(builtin_functions, 0, sizeof(builtin_functions));
+
+        if (!mark_workers_initialized) {
+                for (i = 0; i < MAX_GC_THREADS; ++i) pthread_mutex_init(&mark_workers[i].lock, NULL);
+                mark_workers_initialized = 1;
+        }
+
+        true_object = allocate_keepalive(sizeof(struct True), T_TRUE);
+        false_object = allocate_keepalive(sizeof(struct False), T_FALSE);
+        null_object = allocate_keepalive(sizeof(struct Null), T_NULL);
+        eof_object = allocate_keepalive(sizeof(struct Eof), T_EOF);
+}
+
+void set_gc_threads(int count)
+{
+        if (count < 1 || count > MAX_GC_THREADS) runtime_error("set_gc_threads: Invalid thread count");
+        gc_thread_count = count;
+}
+
+void gc()
+{
+        collect_nursery();
+        collect_old_space();
+}
+
+void gc_nursery()
+{
+        collect_nursery();
+}
+
+enum ObjectType get_object_type(position_t object)
+{
+        return (enum ObjectType)(OBJECT(object)->type_and_gc_flags & TYPE_MASK);
+}
+
+void set_keepalive(position_t object, uint8_t keepalive)
+{
+        if (!keepalive) {
+                OBJECT(object)->type_and_gc_flags &= ~GC_FLAG_KEEPALIVE;
+        } else if (!(OBJECT(object)->type_and_gc_flags & GC_FLAG_KEEPALIVE)) {
+                OBJECT(object)->type_and_gc_flags |= GC_FLAG_KEEPALIVE;
+                if (IS_YOUNG(object)) push_position(&young_keepalives, object);
+        }
+}
+
+/* ------------------------------------------------------------------------ */
+
+position_t new_fixnum(uint32_t value)
+{
+        position_t ret = allocate(sizeof(struct Fixnum), T_FIXNUM);
+        FIXNUM(ret)->value = (int32_t)value;
+        return ret;
+}
+
+uint32_t get_fixnum_value(position_t fixnum)
+{
+        assert_type("get_fixnum_value", fixnum, T_FIXNUM);
+        return (uint32_t)FIXNUM(fixnum)->value;
+}
+
+position_t new_flonum(double value)
+{
+        position_t ret = allocate(sizeof(struct Flonum), T_FLONUM);
+        FLONUM(ret)->value = value;
+        return ret;
+}
+
+double get_flonum_value(position_t flonum)
+{
+        assert_type("get_flonum_value", flonum, T_FLONUM);
+        return FLONUM(flonum)->value;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* FNV-1a */
+static uint32_t hash_name(uint32_t name_length, const uint8_t name[])
+{
+        uint32_t ret = 2166136261u;
+        uint32_t i;
+
+        for (i = 0; i < name_length; ++i) ret = (ret ^ name[i]) * 16777619u;
+        return ret;
+}
+
+static position_t *find_symbol_slot(uint32_t hash, uint32_t name_length, const uint8_t name[])
+{
+        uint32_t i = hash & (symbol_table_size - 1);
+
+        while (symbol_table[i]) {
+                position_t symbol = symbol_table[i];
+                if (SYMBOL(symbol)->hash == hash && SYMBOL(symbol)->name_length == name_length
+                    && memcmp(SYMBOL_NAME(symbol), name, name_length) == 0) break;
+                i = (i + 1) & (symbol_table_size - 1);
+        }
+        return &symbol_table[i];
+}
+
+static void grow_symbol_table(void)
+{
+        position_t *old_table = symbol_table;
+        uint32_t old_size = symbol_table_size;
+        uint32_t i, j;
+
+        symbol_table_size *= 2;
+        symbol_table = calloc(symbol_table_size, sizeof(position_t));
+        if (!symbol_table) runtime_error("Out of memory");
+
+        for (i = 0; i < old_size; ++i) {
+                if (!old_table[i]) continue;
+                j = SYMBOL(old_table[i])->hash & (symbol_table_size - 1);
+                while (symbol_table[j]) j = (j + 1) & (symbol_table_size - 1);
+                symbol_table[j] = old_table[i];
+        }
+        free(old_table);
+}
+
+position_t get_symbol_from_string(uint32_t name_length, uint8_t name[])
+{
+        uint32_t hash = hash_name(name_length, name);
+        position_t ret = *find_symbol_slot(hash, name_length, name);
+        uint8_t *name_copy;
+
+        if (ret) return ret;
+
+        /* name might point into the heap, which the allocation can move */
+        name_copy = malloc(name_length ? name_length : 1);
+        if (!name_copy) runtime_error("Out of memory");
+        memcpy(name_copy, name, name_length);
+
+        ret = allocate_old(sizeof(struct Symbol) + name_length, T_SYMBOL);
+        SYMBOL(ret)->hash = hash;
+        SYMBOL(ret)->name_length = name_length;
+        memcpy(SYMBOL_NAME(ret), name_copy, name_length);
+        free(name_copy);
+
+        if (2 * (symbol_count + 1) > symbol_table_size) grow_symbol_table();
+        *find_symbol_slot(hash, name_length, SYMBOL_NAME(ret)) = ret;
+        ++symbol_count;
+        return ret;
+}
+
+position_t get_string_from_symbol(position_t symbol)
+{
+        position_t ret;
+
+        assert_type("get_string_from_symbol", symbol, T_SYMBOL);
+        protect(&symbol);
+        ret = new_string(SYMBOL(symbol)->name_length);
+        unprotect(1);
+        memcpy(STRING_VALUE(ret), SYMBOL_NAME(symbol), SYMBOL(symbol)->name_length);
+        return ret;
+}
+
+/* ------------------------------------------------------------------------ */
+
+position_t new_pair(position_t car, position_t cdr)
+{
+        position_t ret;
+
+        protect(&car);
+        protect(&cdr);
+        ret = allocate(sizeof(struct Pair), T_PAIR);
+        unprotect(2);
+        PAIR(ret)->car = car;
+        PAIR(ret)->cdr = cdr;
+        return ret;
+}
+
+position_t get_car(position_t pair)
+{
+        assert_type("get_car", pair, T_PAIR);
+        return PAIR(pair)->car;
+}
+
+position_t get_cdr(position_t pair)
+{
+        assert_type("get_cdr", pair, T_PAIR);
+        return PAIR(pair)->cdr;
+}
+
+void set_car(position_t pair, position_t new_car)
+{
+        assert_type("set_car", pair, T_PAIR);
+        write_barrier(pair, new_car);
+        PAIR(pair)->car = new_car;
+}
+
+void set_cdr(position_t pair, position_t new_cdr)
+{
+        assert_type("set_cdr", pair, T_PAIR);
+        write_barrier(pair, new_cdr);
+        PAIR(pair)->cdr = new_cdr;
+}
+
+/* ------------------------------------------------------------------------ */
+
+position_t new_string(uint32_t value_length)
+{
+        position_t ret = allocate(sizeof(struct String) + value_length, T_STRING);
+        STRING(ret)->value_length = value_length;
+        return ret;
+}
+
+uint32_t get_string_length(position_t string)
+{
+        assert_type("get_string_length", string, T_STRING);
+        return STRING(string)->value_length;
+}
+
+uint8_t get_string_char(position_t string, uint32_t index)
+{
+        assert_type("get_string_char", string, T_STRING);
+        if (index >= STRING(string)->value_length) runtime_error("get_string_char: Index out of range");
+        return STRING_VALUE(string)[index];
+}
+
+void set_string_char(position_t string, uint32_t index, uint8_t new_char)
+{
+        assert_type("set_string_char", string, T_STRING);
+        if (index >= STRING(string)->value_length) runtime_error("set_string_char: Index out of range");
+        STRING_VALUE(string)[index] = new_char;
+}
+
+/* ------------------------------------------------------------------------ */
+
+position_t get_true()
+{
+        return true_object;
+}
+
+position_t get_false()
+{
+        return false_object;
+}
+
+position_t new_char(uint8_t value)
+{
+        position_t ret = allocate(sizeof(struct Char), T_CHAR);
+        CHAR(ret)->value = value;
+        return ret;
+}
+
+position_t get_null()
+{
+        return null_object;
+}
+
+position_t get_builtin_function(uint8_t opcode)
+{
+        if (!builtin_functions[opcode]) {
+                builtin_functions[opcode] = allocate_keepalive(sizeof(struct BuiltinFunction), T_BUILTIN_FUNCTION);
+                BUILTIN_FUNCTION(builtin_functions[opcode])->opcode = opcode;
+        }
+        return builtin_functions[opcode];
+}
+
+uint8_t get_builtin_function_opcode(position_t builtin_function)
+{
+        assert_type("get_builtin_function_opcode", builtin_function, T_BUILTIN_FUNCTION);
+        return BUILTIN_FUNCTION(builtin_function)->opcode;
+}
+
+/* ------------------------------------------------------------------------ */
+
+position_t new_closure(uint8_t number_of_parameters,
+                       uint8_t has_rest_parameter,
+                       position_t symbol,
+                       position_t captured_environment,
+                       position_t body)
+{
+        position_t ret;
+
+        protect(&symbol);
+        protect(&captured_environment);
+        protect(&body);
+        ret = allocate(sizeof(struct Closure), T_CLOSURE);
+        unprotect(3);
+        CLOSURE(ret)->number_of_parameters = number_of_parameters;
+        CLOSURE(ret)->has_rest_parameter = has_rest_parameter;
+        CLOSURE(ret)->symbol = symbol;
+        CLOSURE(ret)->captured_environment = captured_environment;
+        CLOSURE(ret)->body = body;
+        return ret;
+}
+
+uint8_t get_closure_number_of_parameters(position_t closure)
+{
+        assert_type("get_closure_number_of_parameters", closure, T_CLOSURE);
+        return CLOSURE(closure)->number_of_parameters;
+}
+
+uint8_t get_closure_has_rest_parameter(position_t closure)
+{
+        assert_type("get_closure_has_rest_parameter", closure, T_CLOSURE);
+        return CLOSURE(closure)->has_rest_parameter;
+}
+
+position_t get_closure_symbol(position_t closure)
+{
+        assert_type("get_closure_symbol", closure, T_CLOSURE);
+        return CLOSURE(closure)->symbol;
+}
+
+position_t get_closure_environment(position_t closure)
+{
+        assert_type("get_closure_environment", closure, T_CLOSURE);
+        return CLOSURE(closure)->captured_environment;
+}
+
+position_t get_closure_body(position_t closure)
+{
+        assert_type("get_closure_body", closure, T_CLOSURE);
+        return CLOSURE(closure)->body;
+}
+
+/* ------------------------------------------------------------------------ */
+
+position_t new_vector(uint32_t length)
+{
+        uint32_t i;
+        position_t ret = allocate(sizeof(struct Vector) + length * sizeof(position_t), T_VECTOR);
+        VECTOR(ret)->length = length;
+        for (i = 0; i < length; ++i) VECTOR_VALUES(ret)[i] = null_object;
+        return ret;
+}
+
+uint32_t get_vector_length(position_t vector)
+{
+        assert_type("get_vector_length", vector, T_VECTOR);
+        return VECTOR(vector)->length;
+}
+
+position_t get_vector_value(position_t vector, uint32_t index)
+{
+        assert_type("get_vector_value", vector, T_VECTOR);
+        if (index >= VECTOR(vector)->length) runtime_error("get_vector_value: Index out of range");
+        return VECTOR_VALUES(vector)[index];
+}
+
+void set_vector_value(position_t vector, uint32_t index, position_t new_value)
+{
+        assert_type("set_vector_value", vector, T_VECTOR);
+        if (index >= VECTOR(vector)->length) runtime_error("set_vector_value: Index out of range");
+        write_barrier(vector, new_value);
+        VECTOR_VALUES(vector)[index] = new_value;
+}
+
+/* ------------------------------------------------------------------------ */
+
+position_t get_eof()
+{
+        return eof_object;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* The variables of an environment are stored in a binary tree of
+ * Environment_Nodes ordered by the position of their symbol. If owner is not
+ * NULL, it receives the object containing the returned slot. */
+static position_t *find_environment_slot(position_t env, position_t symbol, position_t *owner)
+{
+        position_t *slot = &ENVIRONMENT(env)->root_node;
+        if (owner) *owner = env;
+        while (*slot && ENVIRONMENT_NODE(*slot)->symbol != symbol) {
+                if (owner) *owner = *slot;
+                slot = symbol < ENVIRONMENT_NODE(*slot)->symbol
+                        ? &ENVIRONMENT_NODE(*slot)->left_tree
+                        : &ENVIRONMENT_NODE(*slot)->right_tree;
+        }
+        return slot;
+}
+
+static position_t find_environment_node(position_t env, position_t symbol)
+{
+        for (; env && get_object_type(env) == T_ENVIRONMENT; env = ENVIRONMENT(env)->outer) {
+                position_t node = *find_environment_slot(env, symbol, NULL);
+                if (node) return node;
+        }
+        return 0;
+}
+
+position_t new_environment(position_t outer)
+{
+        position_t ret;
+
+        protect(&outer);
+        ret = allocate(sizeof(struct Environment), T_ENVIRONMENT);
+        unprotect(1);
+        ENVIRONMENT(ret)->outer = outer;
+        return ret;
+}
+
+void environment_define(position_t env, position_t symbol, position_t value)
+{
+        position_t node;
+        position_t owner;
+        position_t *slot;
+
+        assert_type("environment_define", env, T_ENVIRONMENT);
+        assert_type("environment_define", symbol, T_SYMBOL);
+
+        node = *find_environment_slot(env, symbol, NULL);
+        if (node) {
+                write_barrier(node, value);
+                ENVIRONMENT_NODE(node)->value = value;
+                return;
+        }
+
+        protect(&env);
+        protect(&symbol);
+        protect(&value);
+        node = allocate(sizeof(struct Environment_Node), T_ENVIRONMENT_NODE);
+        unprotect(3);
+        ENVIRONMENT_NODE(node)->symbol = symbol;
+        ENVIRONMENT_NODE(node)->value = value;
+        slot = find_environment_slot(env, symbol, &owner);
+        write_barrier(owner, node);
+        *slot = node;
+}
+
+void environment_set(position_t env, position_t symbol, position_t value)
+{
+        position_t node;
+
+        assert_type("environment_set", env, T_ENVIRONMENT);
+        node = find_environment_node(env, symbol);
+        if (!node) runtime_error("environment_set: Unknown variable");
+        write_barrier(node, value);
+        ENVIRONMENT_NODE(node)->value = value;
+}
+
+position_t environment_get(position_t env, position_t symbol)
+{
+        position_t node;
+
+        assert_type("environment_get", env, T_ENVIRONMENT);
+        node = find_environment_node(env, symbol);
+        if (!node) runtime_error("environment_get: Unknown variable");
+        return ENVIRONMENT_NODE(node)->value;
+}
+
+/* ------------------------------------------------------------------------ */
+
+position_t new_tagged_value(position_t value)
+{
+        position_t ret;
+
+        protect(&value);
+        ret = allocate(sizeof(struct Tagged_Value), T_TAGGED_VALUE);
+        unprotect(1);
+        TAGGED_VALUE(ret)->value = value;
+        return ret;
+}
+
+position_t get_tagged_value(position_t tagged_value)
+{
+        assert_type("get_tagged_value", tagged_value, T_TAGGED_VALUE);
+        return TAGGED_VALUE(tagged_value)->value;
+}
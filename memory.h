@@ -25,9 +25,16 @@
 
 #include "structures.h"
 
+/* Any allocation may trigger a garbage collection. Only objects with the
+ * keepalive flag set and the objects reachable from them survive it.
+ * Keepalive objects are never moved; the positions of all other objects are
+ * invalid after a collection. */
 void init_memory(uint32_t initial_heap_size);
 void gc();
+void gc_nursery(); /* Only collects the young objects, for benchmarks */
 enum ObjectType get_object_type(position_t object);
+void set_keepalive(position_t object, uint8_t keepalive);
+void set_gc_threads(int count);
 
 position_t new_fixnum(uint32_t value);
 uint32_t get_fixnum_value(position_t fixnum);
@@ -20,10 +20,204 @@
 * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "structures.h"
 #include "memory.h"
 
-int main() {
-	return 0;
+static int failed_assertions = 0;
+
+static void perform_assertion(const char *name, int condition)
+{
+        if (condition) return;
+        printf("Assertion failed: %s\n", name);
+        ++failed_assertions;
+}
+
+#define ASSERT(condition) perform_assertion(#condition, condition)
+
+static position_t symbol(const char *name)
+{
+        return get_symbol_from_string(strlen(name), (uint8_t*)name);
+}
+
+static void self_tests()
+{
+        position_t env, pinned, value, i;
+        uint32_t n;
+        long sum = 0;
+        char name[16];
+
+        printf("Running self tests...\n");
+        init_memory(1024);
+        set_gc_threads(4);
+
+        env = new_environment(get_null());
+        set_keepalive(env, 1);
+        environment_define(env, symbol("lst"), get_null());
+
+        /* The list only survives the collections triggered by the garbage
+         * strings because it is reachable from the keepalive environment */
+        for (n = 0; n < 50000; ++n) {
+                new_string(100);
+                value = new_fixnum(n);
+                value = new_pair(value, environment_get(env, symbol("lst")));
+                environment_define(env, symbol("lst"), value);
+        }
+        for (i = environment_get(env, symbol("lst")); get_object_type(i) == T_PAIR; i = get_cdr(i))
+                sum += get_fixnum_value(get_car(i));
+        ASSERT(sum == 1249975000L);
+
+        pinned = new_pair(get_true(), get_false());
+        set_keepalive(pinned, 1);
+        environment_define(env, symbol("lst"), get_null());
+        gc();
+        ASSERT(get_object_type(pinned) == T_PAIR);
+        ASSERT(get_car(pinned) == get_true() && get_cdr(pinned) == get_false());
+
+        ASSERT(symbol("abc") == symbol("abc"));
+        ASSERT(symbol("abc") != symbol("abd"));
+        value = get_string_from_symbol(symbol("abc"));
+        ASSERT(get_string_length(value) == 3 && get_string_char(value, 2) == 'c');
+
+        /* Enough symbols to grow the symbol table a few times */
+        for (n = 0; n < 5000; ++n) {
+                sprintf(name, "sym%u", (unsigned)n);
+                symbol(name);
+        }
+        gc();
+        ASSERT(get_object_type(symbol("sym4711")) == T_SYMBOL);
+        ASSERT(symbol("sym4711") == symbol("sym4711") && symbol("sym4711") != symbol("sym4712"));
+        ASSERT(symbol("abc") == symbol("abc"));
+
+        value = new_vector(3);
+        set_vector_value(value, 1, get_eof());
+        environment_define(env, symbol("vec"), value);
+        gc();
+        value = environment_get(env, symbol("vec"));
+        ASSERT(get_vector_length(value) == 3 && get_vector_value(value, 1) == get_eof());
+
+        /* The large vector lives in the old space, the pairs stored into it
+         * are young and only survive the nursery collections because of the
+         * write barrier */
+        value = new_vector(50000);
+        environment_define(env, symbol("vec"), value);
+        for (n = 0; n < 50000; ++n) {
+                new_string(100);
+                value = new_fixnum(n);
+                value = new_pair(value, get_null());
+                set_vector_value(environment_get(env, symbol("vec")), n, value);
+        }
+        value = environment_get(env, symbol("vec"));
+        for (sum = 0, n = 0; n < 50000; ++n) sum += get_fixnum_value(get_car(get_vector_value(value, n)));
+        ASSERT(sum == 1249975000L);
+
+        if (failed_assertions == 0) printf("OK\n");
+        else printf("%d assertion(s) failed\n", failed_assertions);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static double milliseconds(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/* Builds list_count lists with pair_count pairs in total, which stay alive
+ * in the returned keepalive vector, and moves them to the old space */
+static position_t build_lists(uint32_t list_count, uint32_t pair_count)
+{
+        position_t lists = new_vector(list_count);
+        uint32_t n;
+
+        set_keepalive(lists, 1);
+        for (n = 0; n < list_count; ++n) set_vector_value(lists, n, get_null());
+        for (n = 0; n < pair_count; ++n)
+                set_vector_value(lists, n % list_count,
+                                 new_pair(get_true(), get_vector_value(lists, n % list_count)));
+        gc();
+        return lists;
+}
+
+/* Compares full collections, whose pauses grow with the old space, to
+ * nursery collections, which only copy the few young survivors */
+static void gc_benchmark(uint32_t pair_count)
+{
+        double start, time, full_total = 0, full_max = 0, minor_total = 0, minor_max = 0;
+        position_t lists;
+        uint32_t n;
+        int i;
+
+        init_memory(1024);
+        lists = build_lists(64, pair_count);
+        printf("Live old space: %u pairs (%u MB)\n", (unsigned)pair_count, (unsigned)(pair_count * sizeof(struct Pair) >> 20));
+
+        for (i = 0; i < 5; ++i) {
+                start = milliseconds();
+                gc();
+                time = milliseconds() - start;
+                full_total += time;
+                if (time > full_max) full_max = time;
+        }
+        printf("Full collection:    %9.3f ms average, %9.3f ms max\n", full_total / 5, full_max);
+
+        /* 10000 garbage pairs and 100 survivors per collection */
+        for (i = 0; i < 100; ++i) {
+                for (n = 0; n < 10000; ++n) new_pair(get_true(), get_null());
+                for (n = 0; n < 100; ++n) set_vector_value(lists, n % 64, new_pair(get_false(), get_vector_value(lists, n % 64)));
+                start = milliseconds();
+                gc_nursery();
+                time = milliseconds() - start;
+                minor_total += time;
+                if (time > minor_max) minor_max = time;
+        }
+        printf("Nursery collection: %9.3f ms average, %9.3f ms max\n", minor_total / 100, minor_max);
+}
+
+/* Times full collections of 64 lists with 1, 2, 4 and 8 marking threads.
+ * Only the MARK phase runs in parallel, the compaction does not. */
+static void mark_benchmark(uint32_t pair_count)
+{
+        double start, time, best;
+        int threads, i;
+
+        init_memory(1024);
+        build_lists(64, pair_count);
+        printf("Live old space: %u pairs in 64 lists\n", (unsigned)pair_count);
+
+        for (threads = 1; threads <= 8; threads *= 2) {
+                set_gc_threads(threads);
+                for (best = 0, i = 0; i < 3; ++i) {
+                        start = milliseconds();
+                        gc();
+                        time = milliseconds() - start;
+                        if (i == 0 || time < best) best = time;
+                }
+                printf("%d thread(s): %9.3f ms\n", threads, best);
+        }
+        set_gc_threads(1);
+}
+
+/* Usage: runtime [gc-benchmark [pairs] | mark-benchmark [pairs]]
+ * Without arguments, the self tests are run. */
+int main(int argc, char **argv)
+{
+        uint32_t pair_count = argc >= 3 ? (uint32_t)strtoul(argv[2], NULL, 10) : 4000000;
+
+        if (argc >= 2 && strcmp(argv[1], "gc-benchmark") == 0) {
+                gc_benchmark(pair_count);
+                return 0;
+        }
+        if (argc >= 2 && strcmp(argv[1], "mark-benchmark") == 0) {
+                mark_benchmark(pair_count);
+                return 0;
+        }
+        self_tests();
+        return failed_assertions == 0 ? 0 : 1;
 }
 
@@ -49,12 +49,14 @@ enum ObjectType {
  * course, we are limited to a max heap size of 4GB. */
 typedef uint32_t position_t;
 
-/* General object header. The first byte is encoded as LK00TTTT, with
- * L = Live flag during GC MARK phase
+/* General object header. The first byte is encoded as LKR0TTTT, with
+ * L = Live flag during GC MARK phase, forwarded flag for young objects
  * K = Keepalive flag to prevent an object from being collected
+ * R = Remembered flag: Old object possibly referencing young objects
  * T = ObjectType value
  * The target_position value is used during the GC COMPACT phase to store
- * the new position an object will be moved to */
+ * the new position an object will be moved to, and during a nursery
+ * collection to store the position a young object has been copied to */
 struct Object {
         uint8_t type_and_gc_flags;
         position_t gc_target_position;
@@ -72,8 +74,7 @@ struct Flonum {
 
 struct Symbol {
         struct Object obj_data;
-        position_t left_tree;
-        position_t right_tree;
+        uint32_t hash;
         uint32_t name_length;
         /* uint8_t[] name; */
 };